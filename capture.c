@@ -0,0 +1,809 @@
+/* capture.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Indexed capture files ("proto=capture" for file interfaces)
+ *
+ * A capture file is the 8 byte magic "KPLXCAP" <version> followed by blocks:
+ *   "KBLK" <u32 body length> <u32 sentence count> <u32 CRC-32 of body>
+ *   <i64 time (ms since epoch) of first sentence> <body>
+ * The body starts with the names of the sources of its sentences:
+ *   <varint number of sources> then for each <varint source interface index>
+ *   <varint name length> <name>
+ * followed by the sentences encoded as in kplex protocol frames:
+ *   <varint source interface index> <zigzag varint time delta in ms from
+ *   previous sentence> <varint length> <sentence without <CR><LF>>
+ * Version 1 files have no source names.
+ * Alongside it, "<file>.idx" has a record for each block:
+ *   <i64 time of first sentence> <u64 offset of block in capture file>
+ * and "<file>.names" has each source name found in the capture file once:
+ *   <varint name length> <name>
+ * All fixed size integers are little-endian.  The index may lag the capture
+ * file (or be missing): readers fall back to walking block headers.  Without
+ * the names file sources are only added as blocks naming them are read.
+ */
+
+#include "kplex.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define CAPMAGIC "KPLXCAP"
+#define CAPVERSION 2
+#define CAPMAGICLEN 8
+#define CAPBLKMAGIC "KBLK"
+#define CAPHDRLEN 24
+#define CAPIDXLEN 16
+#define CAPIDXSFX ".idx"
+#define CAPNAMESFX ".names"
+#define CAPBLOCKSIZE 65536
+/* Longest sentence stored, without <CR><LF>: as long as the input parser
+ * accepts */
+#define CAPSENLEN (SENBUFSZ-2)
+/* Worst case encoded size of a single sentence */
+#define CAPSENMAX (5+10+2+CAPSENLEN)
+/* Most sources named in one block */
+#define CAPSRCMAX 64
+/* Longest source name recorded */
+#define CAPNAMEMAX 255
+/* Worst case encoded size of a source's entry without its name, and of the
+ * count of sources */
+#define CAPSRCENTMAX (5+2)
+#define CAPSRCHDRMAX 1
+
+/* Source of sentences in a block being written */
+struct capname {
+    srcid_t id;
+    size_t len;
+    char name[CAPNAMEMAX];
+};
+
+/* Source interface index recorded in a block and its id when read back */
+struct capsrc {
+    uint32_t idx;
+    srcid_t id;
+};
+
+struct capture {
+    int fd;
+    int idxfd;
+    int namefd;
+    char **names;
+    int nnames;
+    int maxnames;
+    off_t offset;
+    int64_t span;
+    int64_t first;
+    int64_t last;
+    uint32_t count;
+    unsigned char *ptr;
+    int nsrc;
+    size_t srclen;
+    struct capname src[CAPSRCMAX];
+    unsigned char block[CAPHDRLEN+CAPBLOCKSIZE];
+};
+
+struct capblk {
+    uint32_t len;
+    uint32_t count;
+    uint32_t crc;
+    int64_t first;
+};
+
+struct capreader {
+    int fd;
+    const char *name;
+    int version;
+    srcid_t id;
+    int nsrc;
+    struct capsrc src[CAPSRCMAX];
+    off_t off;
+    struct capblk hdr;
+    uint32_t left;
+    int64_t ts;
+    unsigned char *ptr;
+    unsigned char body[CAPBLOCKSIZE];
+};
+
+static const uint32_t crctab[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+/*
+ * Calculate a CRC-32 (as used by zlib and ethernet)
+ * Args: Pointer to data, length of data
+ * Returns: CRC
+ */
+static uint32_t crc32_calc(const unsigned char *ptr, size_t len)
+{
+    uint32_t crc=0xffffffff;
+
+    while (len--) {
+        crc ^= *ptr++;
+        crc = (crc >> 4) ^ crctab[crc & 0x0f];
+        crc = (crc >> 4) ^ crctab[crc & 0x0f];
+    }
+    return(~crc);
+}
+
+/*
+ * Open the index or names file for a capture file
+ * Args: Capture file name, suffix of the file to open, flags for open()
+ * Returns: File descriptor or -1 on failure
+ */
+static int open_sidecar(const char *name, const char *sfx, int flags)
+{
+    char *idxname;
+    int fd;
+
+    if ((idxname=(char *) malloc(strlen(name)+strlen(sfx)+1)) == NULL)
+        return(-1);
+    strcpy(idxname,name);
+    strcat(idxname,sfx);
+    fd=open(idxname,flags,0664);
+    free(idxname);
+    return(fd);
+}
+
+/*
+ * Read the whole of a capture file's names file
+ * Args: Names file descriptor, pointer to length read
+ * Returns: Pointer to allocated buffer holding the file (NULL if it is empty
+ * or can't be read)
+ */
+static unsigned char *read_namefile(int fd, size_t *len)
+{
+    unsigned char *buf;
+    struct stat st;
+
+    if (fstat(fd,&st) < 0 || st.st_size == 0 ||
+            (buf=(unsigned char *) malloc(st.st_size)) == NULL)
+        return(NULL);
+    if (pread(fd,buf,st.st_size,0) != st.st_size) {
+        free(buf);
+        return(NULL);
+    }
+    *len=st.st_size;
+    return(buf);
+}
+
+/*
+ * Note a source name as being in a capture's names file
+ * Args: Pointer to capture state, name (not nul terminated), length of name
+ * Returns: 0 on success, -1 on failure
+ */
+static int add_capname(struct capture *cap, const char *name, size_t len)
+{
+    char **tmp;
+
+    if (cap->nnames == cap->maxnames) {
+        if ((tmp=(char **) realloc(cap->names,(cap->maxnames+16)*
+                sizeof(char *))) == NULL)
+            return(-1);
+        cap->names=tmp;
+        cap->maxnames+=16;
+    }
+    if ((cap->names[cap->nnames]=strndup(name,len)) == NULL)
+        return(-1);
+    cap->nnames++;
+    return(0);
+}
+
+/*
+ * Add the names of a block's sources to the names file if not already there
+ * Args: Pointer to capture state
+ * Returns: Nothing
+ */
+static void capture_newnames(struct capture *cap)
+{
+    unsigned char buf[CAPSRCENTMAX+CAPNAMEMAX];
+    unsigned char *ptr;
+    struct capname *cn;
+    int i,j;
+
+    for (i=0;i<cap->nsrc;i++) {
+        if ((cn=&cap->src[i])->len == 0)
+            continue;
+        for (j=0;j<cap->nnames;j++)
+            if (strlen(cap->names[j]) == cn->len &&
+                    !memcmp(cap->names[j],cn->name,cn->len))
+                break;
+        if (j < cap->nnames)
+            continue;
+        ptr=put_varint(buf,cn->len);
+        memcpy(ptr,cn->name,cn->len);
+        ptr+=cn->len;
+        if (write(cap->namefd,buf,ptr-buf) != ptr-buf ||
+                add_capname(cap,cn->name,cn->len) < 0)
+            logerr(errno,"Failed to update capture source names");
+    }
+}
+
+/*
+ * Read and check a block header
+ * Args: File descriptor, offset of block, pointer to header to fill in
+ * Returns: 0 on success, -1 at end of file or if the header is invalid
+ */
+static int read_blkhdr(int fd, off_t offset, struct capblk *hdr)
+{
+    unsigned char buf[CAPHDRLEN];
+
+    if (pread(fd,buf,CAPHDRLEN,offset) != CAPHDRLEN ||
+            memcmp(buf,CAPBLKMAGIC,4))
+        return(-1);
+    hdr->len=get_le32(buf+4);
+    hdr->count=get_le32(buf+8);
+    hdr->crc=get_le32(buf+12);
+    hdr->first=(int64_t) get_le64(buf+16);
+    return((hdr->len > CAPBLOCKSIZE)?-1:0);
+}
+
+/*
+ * Look up a time in the index of a capture file
+ * Args: Capture file descriptor, capture file name, time (ms since epoch),
+ * pointer to flag set if the record found is the last in the index
+ * Returns: Offset of the last indexed block starting no later than the given
+ * time, or of the first block if there is none
+ */
+static off_t index_lookup(int fd, const char *name, int64_t when, int *last)
+{
+    unsigned char rec[CAPIDXLEN];
+    struct capblk hdr;
+    struct stat st;
+    off_t off=CAPMAGICLEN,lo,hi,mid,nrecs=0;
+    int idxfd;
+
+    if ((idxfd=open_sidecar(name,CAPIDXSFX,O_RDONLY)) < 0) {
+        DEBUG(3,"No index for %s: searching block headers",name);
+    } else if (fstat(idxfd,&st) == 0)
+        nrecs=st.st_size/CAPIDXLEN;
+
+    /* Bisect for the number of records with time <= when */
+    for (lo=0,hi=nrecs;lo<hi;) {
+        mid=lo+(hi-lo)/2;
+        if (pread(idxfd,rec,CAPIDXLEN,mid*CAPIDXLEN) != CAPIDXLEN) {
+            lo=nrecs=0;
+            break;
+        }
+        if ((int64_t) get_le64(rec) <= when)
+            lo=mid+1;
+        else
+            hi=mid;
+    }
+    if (lo) {
+        if (pread(idxfd,rec,CAPIDXLEN,(lo-1)*CAPIDXLEN) != CAPIDXLEN ||
+                read_blkhdr(fd,(off=(off_t) get_le64(rec+8)),&hdr) < 0 ||
+                hdr.first != (int64_t) get_le64(rec)) {
+            logwarn("Index for %s doesn't match: searching block headers",
+                    name);
+            off=CAPMAGICLEN;
+            lo=nrecs=0;
+        }
+    }
+    if (idxfd >= 0)
+        close(idxfd);
+    *last=(lo == nrecs);
+    return(off);
+}
+
+/*
+ * Find the block from which to start reading to get sentences from a given
+ * time
+ * Args: Capture file descriptor, capture file name, time (ms since epoch)
+ * Returns: Offset of the last block starting no later than the given time, or
+ * of the first block if there is none
+ */
+static off_t capture_seek(int fd, const char *name, int64_t when)
+{
+    struct capblk hdr,next;
+    off_t off;
+    int last;
+
+    off=index_lookup(fd,name,when,&last);
+    if (!last)
+        return(off);
+
+    /* Blocks after the last index record must be checked one by one */
+    for (;read_blkhdr(fd,off,&hdr) == 0;off+=CAPHDRLEN+hdr.len)
+        if (read_blkhdr(fd,off+CAPHDRLEN+hdr.len,&next) < 0 ||
+                next.first > when)
+            break;
+    return(off);
+}
+
+/*
+ * Find the end of the last complete block in a capture file
+ * Args: Capture file descriptor, capture file name, size of file
+ * Returns: Offset following the last complete block
+ */
+static off_t capture_tail(int fd, const char *name, off_t size)
+{
+    struct capblk hdr;
+    off_t off;
+    int last;
+
+    for (off=index_lookup(fd,name,INT64_MAX,&last);
+            read_blkhdr(fd,off,&hdr) == 0 && off+CAPHDRLEN+hdr.len <= size;
+            off+=CAPHDRLEN+hdr.len);
+    return(off);
+}
+
+/*
+ * Start writing to a capture file
+ * Args: File descriptor open for writing, file name, whether appending,
+ * maximum time in ms spanned by a block
+ * Returns: Pointer to capture state or NULL on failure
+ * Side Effects: The index file is created, or truncated if not appending.
+ * If appending, an existing capture file must have a valid header.
+ */
+struct capture *capture_open(int fd, const char *name, int append,
+        int64_t span)
+{
+    struct capture *cap;
+    unsigned char buf[CAPMAGICLEN];
+    unsigned char rec[CAPIDXLEN];
+    unsigned char *nbuf,*ptr;
+    struct stat st;
+    off_t offset=CAPMAGICLEN,idxlen;
+    size_t nlen;
+    uint64_t len;
+
+    if (fstat(fd,&st) < 0) {
+        logerr(errno,"Could not stat %s",name);
+        return(NULL);
+    }
+
+    if (st.st_size) {
+        if (pread(fd,buf,CAPMAGICLEN,0) != CAPMAGICLEN ||
+                memcmp(buf,CAPMAGIC,CAPMAGICLEN-1) ||
+                buf[CAPMAGICLEN-1] > CAPVERSION) {
+            logerr(0,"%s is not a capture file",name);
+            return(NULL);
+        }
+        if (buf[CAPMAGICLEN-1] != CAPVERSION) {
+            logerr(0,"Can't append to %s: written by an older kplex",name);
+            return(NULL);
+        }
+        /* Drop any block left incomplete when the file was last written */
+        if ((offset=capture_tail(fd,name,st.st_size)) < st.st_size) {
+            logwarn("Discarding incomplete block at end of %s",name);
+            if (ftruncate(fd,offset) < 0) {
+                logerr(errno,"Could not truncate %s",name);
+                return(NULL);
+            }
+        }
+    } else {
+        memcpy(buf,CAPMAGIC,CAPMAGICLEN-1);
+        buf[CAPMAGICLEN-1]=CAPVERSION;
+        if (write(fd,buf,CAPMAGICLEN) != CAPMAGICLEN) {
+            logerr(errno,"Could not write to %s",name);
+            return(NULL);
+        }
+    }
+
+    if ((cap=(struct capture *) malloc(sizeof(struct capture))) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return(NULL);
+    }
+    if ((cap->idxfd=open_sidecar(name,CAPIDXSFX,O_RDWR|O_CREAT|
+            ((append)?O_APPEND:O_TRUNC))) < 0) {
+        logerr(errno,"Could not open index for %s",name);
+        free(cap);
+        return(NULL);
+    }
+    cap->names=NULL;
+    cap->nnames=cap->maxnames=0;
+    if ((cap->namefd=open_sidecar(name,CAPNAMESFX,O_RDWR|O_CREAT|
+            ((append)?O_APPEND:O_TRUNC))) < 0) {
+        logerr(errno,"Could not open source names for %s",name);
+        close(cap->idxfd);
+        free(cap);
+        return(NULL);
+    }
+    /* Names already recorded aren't added again */
+    if ((nbuf=read_namefile(cap->namefd,&nlen)) != NULL) {
+        for (ptr=nbuf;get_varint(&ptr,nbuf+nlen,&len) == 0 &&
+                ptr+len <= nbuf+nlen;ptr+=len)
+            if (add_capname(cap,(char *) ptr,len) < 0)
+                break;
+        free(nbuf);
+    }
+    /* Drop index records for anything discarded above */
+    if (fstat(cap->idxfd,&st) == 0) {
+        for (idxlen=st.st_size-st.st_size%CAPIDXLEN;idxlen;idxlen-=CAPIDXLEN)
+            if (pread(cap->idxfd,rec,CAPIDXLEN,idxlen-CAPIDXLEN) !=
+                    CAPIDXLEN || (off_t) get_le64(rec+8) < offset)
+                break;
+        if (idxlen < st.st_size && ftruncate(cap->idxfd,idxlen) < 0)
+            logerr(errno,"Could not truncate index for %s",name);
+    }
+    cap->fd=fd;
+    cap->offset=offset;
+    cap->span=span;
+    cap->count=0;
+    cap->nsrc=0;
+    cap->srclen=0;
+    cap->ptr=cap->block+CAPHDRLEN;
+    return(cap);
+}
+
+/*
+ * Write out the current block of a capture file and add it to the index
+ * Args: Pointer to capture state
+ * Returns: 0 on success, -1 on failure
+ */
+static int capture_flush(struct capture *cap)
+{
+    unsigned char idx[CAPIDXLEN];
+    unsigned char names[CAPSRCHDRMAX+CAPSRCMAX*(CAPSRCENTMAX+CAPNAMEMAX)];
+    size_t len=cap->ptr-cap->block-CAPHDRLEN;
+    unsigned char *ptr;
+    ssize_t n;
+    int i;
+
+    if (cap->count == 0)
+        return(0);
+
+    /* Names file is written first so that readers can find every name in
+     * the capture file in it */
+    capture_newnames(cap);
+
+    /* Prepend the names of the sources in this block to its sentences */
+    ptr=put_varint(names,cap->nsrc);
+    for (i=0;i<cap->nsrc;i++) {
+        ptr=put_varint(ptr,cap->src[i].id >> IDMINORBITS);
+        ptr=put_varint(ptr,cap->src[i].len);
+        memcpy(ptr,cap->src[i].name,cap->src[i].len);
+        ptr+=cap->src[i].len;
+    }
+    memmove(cap->block+CAPHDRLEN+(ptr-names),cap->block+CAPHDRLEN,len);
+    memcpy(cap->block+CAPHDRLEN,names,ptr-names);
+    len+=ptr-names;
+
+    memcpy(cap->block,CAPBLKMAGIC,4);
+    put_le32(cap->block+4,len);
+    put_le32(cap->block+8,cap->count);
+    put_le32(cap->block+12,crc32_calc(cap->block+CAPHDRLEN,len));
+    put_le64(cap->block+16,(uint64_t) cap->first);
+
+    for (ptr=cap->block,len+=CAPHDRLEN;len;len-=n,ptr+=n)
+        if ((n=write(cap->fd,ptr,len)) < 0)
+            return(-1);
+
+    /* Index is only written once the block it refers to is complete */
+    put_le64(idx,(uint64_t) cap->first);
+    put_le64(idx+8,(uint64_t) cap->offset);
+    if (write(cap->idxfd,idx,CAPIDXLEN) != CAPIDXLEN)
+        logerr(errno,"Failed to update capture index");
+
+    cap->offset+=ptr-cap->block;
+    cap->count=0;
+    cap->nsrc=0;
+    cap->srclen=0;
+    cap->ptr=cap->block+CAPHDRLEN;
+    return(0);
+}
+
+/*
+ * Add a sentence to a capture file
+ * Args: Pointer to capture state, senblk to add
+ * Returns: 0 on success, -1 on failure
+ * Side Effects: The current block is written out first if the sentence
+ * won't fit or the block already spans the maximum time
+ */
+int capture_add(struct capture *cap, senblk_t *sptr)
+{
+    srcid_t src=sptr->src & ~IDMINORMASK;
+    struct capname *cn;
+    int64_t delta;
+    size_t len;
+    char *name;
+    int i;
+
+    for (i=0;i<cap->nsrc;i++)
+        if (cap->src[i].id == src)
+            break;
+
+    /* Room is left for the names of the block's sources and one more */
+    if (cap->count && ((cap->ptr-cap->block)+CAPSRCHDRMAX+cap->srclen+
+            CAPSRCENTMAX+CAPNAMEMAX+CAPSENMAX > CAPHDRLEN+CAPBLOCKSIZE ||
+            (i == cap->nsrc && i == CAPSRCMAX) ||
+            sptr->ts - cap->first >= cap->span)) {
+        if (capture_flush(cap) < 0)
+            return(-1);
+        i=0;
+    }
+
+    if (i == cap->nsrc) {
+        /* The name is copied now as the source may be gone when the block
+         * is written.  Made up names of unnamed interfaces aren't worth
+         * keeping */
+        cn=&cap->src[cap->nsrc++];
+        cn->id=src;
+        if ((name=idlookup(src)) == NULL || *name == '_' ||
+                (cn->len=strlen(name)) > CAPNAMEMAX)
+            cn->len=0;
+        else
+            memcpy(cn->name,name,cn->len);
+        cap->srclen+=CAPSRCENTMAX+cn->len;
+    }
+
+    if (cap->count++ == 0)
+        cap->first=cap->last=sptr->ts;
+    delta=sptr->ts-cap->last;
+    cap->last=sptr->ts;
+
+    if ((len=sptr->len-2) > CAPSENLEN)
+        len=CAPSENLEN;
+    cap->ptr=put_varint(cap->ptr,sptr->src >> IDMINORBITS);
+    cap->ptr=put_varint(cap->ptr,(uint64_t) (delta << 1) ^
+            (uint64_t) (delta >> 63));
+    cap->ptr=put_varint(cap->ptr,len);
+    memcpy(cap->ptr,sptr->data,len);
+    cap->ptr+=len;
+    return(0);
+}
+
+/*
+ * Finish writing to a capture file
+ * Args: Pointer to capture state
+ * Returns: 0 on success, -1 if the last block couldn't be written
+ * Side Effects: The index is closed and the capture state freed.  The
+ * capture file itself is not closed
+ */
+int capture_close(struct capture *cap)
+{
+    int ret;
+
+    int i;
+
+    if ((ret=capture_flush(cap)) < 0)
+        logerr(errno,"Failed to write capture block");
+    close(cap->idxfd);
+    close(cap->namefd);
+    for (i=0;i<cap->nnames;i++)
+        free(cap->names[i]);
+    free(cap->names);
+    free(cap);
+    return(ret);
+}
+
+/*
+ * Get the id for a source named in a capture file
+ * Args: Source name (not nul terminated), length of name, id to use if the
+ * name can't be given one
+ * Returns: id of the interface or source with that name, which is added if
+ * there is none
+ */
+static srcid_t capture_srcid(const unsigned char *name, size_t len,
+        srcid_t dflt)
+{
+    static pthread_mutex_t src_mutex = PTHREAD_MUTEX_INITIALIZER;
+    char buf[CAPNAMEMAX+1];
+    char *newname;
+    srcid_t id;
+
+    if (len == 0)
+        return(dflt);
+    memcpy(buf,name,len);
+    buf[len]='\0';
+
+    /* Readers of different files may find the same new name */
+    pthread_mutex_lock(&src_mutex);
+    if ((id=namelookup(buf)) == 0) {
+        if ((newname=strdup(buf)) == NULL) {
+            logerr(errno,"Could not allocate memory");
+            id=dflt;
+        } else if ((id=new_srcid(newname)) == 0) {
+            free(newname);
+            id=dflt;
+        } else
+            DEBUG(3,"Added source %s from capture file",newname);
+    }
+    pthread_mutex_unlock(&src_mutex);
+    return(id);
+}
+
+/*
+ * Read the source names at the start of a capture block
+ * Args: Pointer to pointer to start of block body (advanced past the names),
+ * end of body, array of CAPSRCMAX sources to fill in, pointer to number of
+ * sources filled in, id for sources without names
+ * Returns: 0 on success, -1 if the names are invalid
+ */
+static int read_srcnames(unsigned char **pptr, unsigned char *end,
+        struct capsrc *src, int *nsrc, srcid_t dflt)
+{
+    uint64_t n,idx,len;
+
+    *nsrc=0;
+    if (get_varint(pptr,end,&n) || n > CAPSRCMAX)
+        return(-1);
+    for (;n;n--,(*nsrc)++) {
+        if (get_varint(pptr,end,&idx) || idx > MAXINTERFACES ||
+                get_varint(pptr,end,&len) || len > CAPNAMEMAX ||
+                *pptr+len > end)
+            return(-1);
+        src[*nsrc].idx=(uint32_t) idx;
+        src[*nsrc].id=capture_srcid(*pptr,len,dflt);
+        *pptr+=len;
+    }
+    return(0);
+}
+
+/*
+ * Add the sources named in a capture file so that filter rules can refer to
+ * them
+ * Args: Capture file descriptor, capture file name
+ * Returns: Nothing
+ * Only the names file is read.  Without one, sources are added as the blocks
+ * naming them are read
+ */
+void capture_names(int fd, const char *name)
+{
+    unsigned char *buf,*ptr;
+    uint64_t len;
+    size_t size;
+    int namefd;
+
+    if ((namefd=open_sidecar(name,CAPNAMESFX,O_RDONLY)) < 0) {
+        DEBUG(3,"No source names for %s: adding them as read",name);
+        return;
+    }
+    if ((buf=read_namefile(namefd,&size)) != NULL) {
+        for (ptr=buf;get_varint(&ptr,buf+size,&len) == 0 &&
+                len <= CAPNAMEMAX && ptr+len <= buf+size;ptr+=len)
+            (void) capture_srcid(ptr,len,0);
+        if (ptr != buf+size)
+            DEBUG(3,"%s: bad source names file",name);
+        free(buf);
+    }
+    close(namefd);
+}
+
+/*
+ * Start reading a capture file
+ * Args: Capture file descriptor, capture file name (not copied), time (ms
+ * since epoch) to start from, 0 for the beginning, id for sentences whose
+ * source isn't named in the file
+ * Returns: Pointer to reader state or NULL on failure
+ * Sources named in the file are added on reading if there are no interfaces
+ * or sources with the same names
+ */
+struct capreader *capture_reader(int fd, const char *name, int64_t start,
+        srcid_t id)
+{
+    unsigned char magic[CAPMAGICLEN];
+    struct capreader *cr;
+
+    if (pread(fd,magic,CAPMAGICLEN,0) != CAPMAGICLEN ||
+            memcmp(magic,CAPMAGIC,CAPMAGICLEN-1) ||
+            magic[CAPMAGICLEN-1] < 1 || magic[CAPMAGICLEN-1] > CAPVERSION) {
+        logerr(0,"%s is not a capture file",name);
+        return(NULL);
+    }
+
+    if ((cr=(struct capreader *) malloc(sizeof(struct capreader))) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return(NULL);
+    }
+    cr->fd=fd;
+    cr->name=name;
+    cr->version=magic[CAPMAGICLEN-1];
+    cr->id=id;
+    cr->nsrc=0;
+    cr->left=0;
+    cr->off=start?capture_seek(fd,name,start):CAPMAGICLEN;
+    DEBUG(3,"Reading %s from offset %lld",name,(long long) cr->off);
+    return(cr);
+}
+
+/*
+ * Get the next sentence from a capture file
+ * Args: Reader state, senblk to fill in (data, len, ts and src)
+ * Returns: 0 on success, -1 at the end of the file
+ * Blocks with bad checksums or contents are skipped.  Reading stops at the
+ * first invalid or incomplete block header
+ */
+int capture_next(struct capreader *cr, senblk_t *sptr)
+{
+    uint64_t idx,val,slen;
+    int i;
+
+    for (;;) {
+        while (cr->left == 0) {
+            if (read_blkhdr(cr->fd,cr->off,&cr->hdr) < 0)
+                return(-1);
+            if (pread(cr->fd,cr->body,cr->hdr.len,cr->off+CAPHDRLEN) !=
+                    (ssize_t) cr->hdr.len) {
+                logwarn("%s: truncated block at offset %lld",cr->name,
+                        (long long) cr->off);
+                return(-1);
+            }
+            cr->ptr=cr->body;
+            if (crc32_calc(cr->body,cr->hdr.len) != cr->hdr.crc ||
+                    (cr->version > 1 && read_srcnames(&cr->ptr,
+                    cr->body+cr->hdr.len,cr->src,&cr->nsrc,cr->id) < 0))
+                logwarn("%s: bad block at offset %lld",cr->name,
+                        (long long) cr->off);
+            else {
+                cr->left=cr->hdr.count;
+                cr->ts=cr->hdr.first;
+            }
+            cr->off+=CAPHDRLEN+cr->hdr.len;
+        }
+
+        cr->left--;
+        if (get_varint(&cr->ptr,cr->body+cr->hdr.len,&idx) ||
+                get_varint(&cr->ptr,cr->body+cr->hdr.len,&val) ||
+                get_varint(&cr->ptr,cr->body+cr->hdr.len,&slen) ||
+                slen > CAPSENLEN || slen < 1 ||
+                cr->ptr+slen > cr->body+cr->hdr.len) {
+            logwarn("%s: bad block before offset %lld",cr->name,
+                    (long long) cr->off);
+            cr->left=0;
+            continue;
+        }
+        cr->ts += (int64_t) (val >> 1) ^ -(int64_t) (val & 1);
+        memcpy(sptr->data,cr->ptr,slen);
+        cr->ptr+=slen;
+        sptr->data[slen++]='\r';
+        sptr->data[slen++]='\n';
+        sptr->len=slen;
+        sptr->ts=cr->ts;
+        /* Recorded source index is only meaningful with its name */
+        for (i=0;i<cr->nsrc;i++)
+            if (cr->src[i].idx == idx)
+                break;
+        sptr->src=(i < cr->nsrc)?cr->src[i].id:cr->id;
+        return(0);
+    }
+}
+
+/*
+ * Finish reading a capture file
+ * Args: Reader state
+ * Returns: Nothing
+ * The capture file itself is not closed
+ */
+void capture_free(struct capreader *cr)
+{
+    free(cr);
+}
+
+/*
+ * Read routine for file interfaces using the capture format
+ * Args: Interface, capture file descriptor, capture file name, start and end
+ * times (ms since epoch, 0 for none), replay state (NULL if not pacing)
+ * Returns: nothing
+ */
+void read_capture(iface_t *ifa, int fd, const char *name, int64_t start,
+        int64_t end, struct replay *rp)
+{
+    struct capreader *cr;
+    senblk_t sblk;
+
+    if ((cr=capture_reader(fd,name,start,ifa->id)) == NULL)
+        iface_thread_exit(0);
+
+    sblk.enc=NULL;
+    sblk.next=NULL;
+    while (capture_next(cr,&sblk) == 0) {
+        if (sblk.ts < start)
+            continue;
+        if (end && sblk.ts > end)
+            break;
+        if (senfilter(&sblk,ifa->ifilter,ifa))
+            continue;
+        if (rp) {
+            replay_wait(rp,sblk.ts);
+            sblk.ts=mstime();
+        }
+        publish(&sblk,ifa);
+    }
+    capture_free(cr);
+    iface_thread_exit(0);
+}
@@ -11,15 +11,90 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <pwd.h>
 #include <grp.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <limits.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef linux
+#include <sys/inotify.h>
+#endif
 
 #define DEFFILEQSIZE 128
+#define DEFFLUSHINT 1000
+/* Buffer size used for rotating or compressed output if none is given */
+#define DEFFILEBUF 65536
+/* Size of each part of a file mapped at once for "mmap" input, and of the
+ * slices of it parsed with the same timestamp */
+#define MAPWINDOW (64*1024*1024)
+#define MAPSLICE 65536
+
+/* Double buffer for file output.  The writer fills one buffer whilst a
+ * flusher thread writes the other to the file */
+struct filebuf {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t tid;
+    int fd;
+    char *buf[2];
+    size_t len[2];
+    size_t size;
+    int fill;
+    int pending;
+    int done;
+    int err;
+    int64_t flushint;
+    int64_t syncint;
+    /* Rotation and compression are done by the flusher thread */
+    char *pattern;
+    char *current;
+    off_t rotsize;
+    time_t rotint;
+    time_t rotdue;
+    time_t opened;
+    mode_t perm;
+    uid_t uid;
+    gid_t gid;
+    int compress;
+#ifdef HAVE_ZLIB
+    gzFile gz;
+#endif
+};
+
+/* One of the files merged by a file input */
+struct mergesrc {
+    srcid_t id;
+    char *path;
+    int fd;
+    struct capreader *cr;
+    struct rdstate *rs;
+    char *buf;
+    size_t len;
+    size_t pos;
+    int64_t ts;
+    senblk_t sblk;
+};
 
 struct if_file {
     int fd;
     char *filename;
     size_t qsize;
+    struct filebuf *fbuf;
+    struct capture *cap;
+    int64_t start;
+    int64_t end;
+    int mapped;
+    struct replay *replay;
+    struct mergesrc **msrc;
+    int nmsrc;
+    int tail;
+    int notify;
 };
 
 /*
@@ -43,16 +118,380 @@ void *ifdup_file(void *iff)
     return(newif);
 }
 
+/*
+ * Generate the name of an output file from a pattern
+ * Args: Pattern (expanded by strftime() using local time), time
+ * Returns: Pointer to malloc'd name, NULL on failure
+ */
+static char *expand_name(const char *pattern, time_t t)
+{
+    char buf[PATH_MAX];
+    struct tm tm;
+
+    localtime_r(&t,&tm);
+    if (strftime(buf,sizeof(buf),pattern,&tm) == 0) {
+        errno=ENAMETOOLONG;
+        return(NULL);
+    }
+    return(strdup(buf));
+}
+
+/*
+ * Attach a newly opened output file to a file buffer
+ * Args: Pointer to file buffer, file descriptor
+ * Returns: 0 on success, -1 on failure
+ */
+static int attach_output(struct filebuf *fb, int fd)
+{
+    fb->fd=fd;
+#ifdef HAVE_ZLIB
+    if (fb->compress && (fb->gz=gzdopen(fd,"ab")) == NULL) {
+        logerr(errno,"Could not start compression");
+        return(-1);
+    }
+#endif
+    if (fb->rotint)
+        fb->rotdue=(fb->opened/fb->rotint+1)*fb->rotint;
+    return(0);
+}
+
+/*
+ * Write data to a buffered output file, compressing it if required
+ * Args: Pointer to file buffer, data, length of data
+ * Returns: 0 on success, -1 on failure
+ */
+static int write_output(struct filebuf *fb, char *ptr, size_t len)
+{
+    ssize_t n;
+
+#ifdef HAVE_ZLIB
+    if (fb->gz)
+        return((gzwrite(fb->gz,ptr,(unsigned) len) == (int) len)?0:-1);
+#endif
+    for (;len;len-=n,ptr+=n)
+        if ((n=write(fb->fd,ptr,len)) < 0)
+            return(-1);
+    return(0);
+}
+
+/*
+ * Commit written data to storage
+ * Args: Pointer to file buffer
+ * Returns: Nothing
+ * Compressed output is flushed through zlib first, at some cost in
+ * compression, so that everything written so far can be decompressed
+ */
+static void sync_output(struct filebuf *fb)
+{
+#ifdef HAVE_ZLIB
+    if (fb->gz)
+        (void) gzflush(fb->gz,Z_SYNC_FLUSH);
+#endif
+#ifdef __APPLE__
+    if (fsync(fb->fd) < 0)
+#else
+    if (fdatasync(fb->fd) < 0)
+#endif
+        logerr(errno,"Failed to sync output file");
+}
+
+/*
+ * Close a buffered output file
+ * Args: Pointer to file buffer
+ * Returns: 0 on success, -1 on failure
+ */
+static int close_output(struct filebuf *fb)
+{
+    int ret;
+
+#ifdef HAVE_ZLIB
+    if (fb->gz) {
+        ret=(gzclose(fb->gz) == Z_OK)?0:-1;
+        fb->gz=NULL;
+        fb->fd=-1;
+        return(ret);
+    }
+#endif
+    ret=close(fb->fd);
+    fb->fd=-1;
+    return(ret);
+}
+
+/*
+ * Switch a rotating output to a new file
+ * Args: Pointer to file buffer
+ * Returns: 0 on success, -1 on failure
+ * If the new file would have the same name (the file name has no strftime()
+ * conversions or none which have changed since it was opened), the file just
+ * closed is renamed with the time it was opened inserted before any ".gz"
+ * suffix
+ */
+static int rotate_output(struct filebuf *fb)
+{
+    char name[PATH_MAX];
+    struct stat st;
+    struct tm tm;
+    char *sfx,*next;
+    size_t len;
+    time_t now;
+    int fd,i;
+
+    if (fb->syncint)
+        sync_output(fb);
+    if (close_output(fb) < 0)
+        logerr(errno,"Error closing %s",fb->current);
+
+    now=time(NULL);
+    if ((next=expand_name(fb->pattern,now)) == NULL) {
+        logerr(errno,"Could not generate output file name");
+        return(-1);
+    }
+
+    if (!strcmp(next,fb->current)) {
+        len=strlen(fb->current);
+        if ((sfx=strrchr(fb->current,'.')) == NULL || strcmp(sfx,".gz"))
+            sfx=fb->current+len;
+        localtime_r(&fb->opened,&tm);
+        len=snprintf(name,sizeof(name),"%.*s.",(int) (sfx-fb->current),
+                fb->current);
+        len+=strftime(name+len,sizeof(name)-len,"%Y%m%d%H%M%S",&tm);
+        snprintf(name+len,sizeof(name)-len,"%s",sfx);
+        /* Don't overwrite a file rotated within the same second */
+        for (i=1;stat(name,&st) == 0 && i < 1000;i++)
+            snprintf(name+len,sizeof(name)-len,"-%d%s",i,sfx);
+        if (rename(fb->current,name) < 0)
+            logerr(errno,"Failed to rename %s to %s",fb->current,name);
+        else
+            DEBUG(3,"Rotated %s to %s",fb->current,name);
+    }
+
+    fb->opened=now;
+    free(fb->current);
+    fb->current=next;
+    if ((fd=open(fb->current,O_WRONLY|O_CREAT|O_APPEND,
+            fb->perm?fb->perm:0664)) < 0) {
+        logerr(errno,"Failed to open %s",fb->current);
+        return(-1);
+    }
+    if (fb->perm)
+        (void) fchmod(fd,fb->perm);
+    if ((fb->uid != (uid_t) -1 || fb->gid != (gid_t) -1) &&
+            fchown(fd,fb->uid,fb->gid) < 0)
+        logerr(errno,"Failed to set ownership or group on %s",fb->current);
+    DEBUG(3,"Opened %s for output",fb->current);
+    return(attach_output(fb,fd));
+}
+
+/*
+ * Check whether a rotating output is due to switch file before a write
+ * Args: Pointer to file buffer, length of data about to be written
+ * Returns: 1 if the file should be rotated, 0 otherwise
+ */
+static int rotate_due(struct filebuf *fb, size_t len)
+{
+    struct stat st;
+
+    if (fb->rotint && time(NULL) >= fb->rotdue)
+        return(1);
+    if (!fb->rotsize || fstat(fb->fd,&st) < 0 || st.st_size == 0)
+        return(0);
+    /* Compressed size isn't known in advance so that may overshoot */
+    return(st.st_size + (fb->compress?0:(off_t) len) > fb->rotsize);
+}
+
+/*
+ * Write out any buffered output and stop the flusher thread
+ * Args: Pointer to file buffer
+ * Returns: Nothing
+ */
+static void stop_flusher(struct filebuf *fb)
+{
+    pthread_mutex_lock(&fb->mutex);
+    while (fb->pending && !fb->err)
+        pthread_cond_wait(&fb->cond,&fb->mutex);
+    if (fb->len[fb->fill]) {
+        fb->pending=1;
+        fb->fill^=1;
+    }
+    fb->done=1;
+    pthread_cond_broadcast(&fb->cond);
+    pthread_mutex_unlock(&fb->mutex);
+    pthread_join(fb->tid,NULL);
+}
+
+/*
+ * Free a merge source
+ * Args: Pointer to merge source
+ * Returns: Nothing
+ */
+static void free_mergesrc(struct mergesrc *ms)
+{
+    if (ms->cr)
+        capture_free(ms->cr);
+    if (ms->rs)
+        free(ms->rs);
+    if (ms->buf)
+        free(ms->buf);
+    if (ms->path)
+        free(ms->path);
+    if (ms->fd >= 0)
+        close(ms->fd);
+    free(ms);
+}
+
 void cleanup_file(iface_t *ifa)
 {
     struct if_file *iff = (struct if_file *) ifa->info;
 
+    if (iff->fbuf) {
+        /* unlock mutex in case we were interupted whilst holding it */
+        (void) pthread_mutex_unlock(&iff->fbuf->mutex);
+        if (iff->fbuf->tid)
+            stop_flusher(iff->fbuf);
+        if (iff->fbuf->fd >= 0 && close_output(iff->fbuf) < 0)
+            logerr(errno,"Error closing output file");
+        pthread_mutex_destroy(&iff->fbuf->mutex);
+        pthread_cond_destroy(&iff->fbuf->cond);
+        free(iff->fbuf->buf[0]);
+        if (iff->fbuf->pattern)
+            free(iff->fbuf->pattern);
+        if (iff->fbuf->current)
+            free(iff->fbuf->current);
+        free(iff->fbuf);
+    }
+    if (iff->cap)
+        (void) capture_close(iff->cap);
+    if (iff->replay)
+        free(iff->replay);
+    for (;iff->nmsrc;iff->nmsrc--)
+        free_mergesrc(iff->msrc[iff->nmsrc-1]);
+    if (iff->msrc)
+        free(iff->msrc);
+    if (iff->notify >= 0)
+        close(iff->notify);
     if (iff->fd >= 0)
         close(iff->fd);
     if (iff->filename)
         free(iff->filename);
 }
 
+/*
+ * Thread writing full (or aged) output buffers to a file
+ * Args: Pointer to file buffer (cast to void *)
+ * Returns: Nothing
+ * A partly filled buffer is written once it has been waiting for the flush
+ * interval.  With a sync interval, data are committed to storage at most
+ * that often, and within that interval of being written
+ */
+static void *flusher(void *info)
+{
+    struct filebuf *fb = (struct filebuf *) info;
+    struct timeval tv;
+    struct timespec due;
+    int64_t nextsync=0,now,wait;
+    sigset_t set;
+    int idx,failed,unsynced=0;
+
+    sigemptyset(&set);
+    sigaddset(&set,SIGUSR1);
+    pthread_sigmask(SIG_BLOCK,&set,NULL);
+
+    pthread_mutex_lock(&fb->mutex);
+    for (;;) {
+        if (!fb->pending && !fb->done) {
+            /* Written data are synced once the sync interval is up even if
+             * nothing more is written */
+            wait=fb->flushint;
+            if (unsynced) {
+                if ((now=msclock()) >= nextsync) {
+                    pthread_mutex_unlock(&fb->mutex);
+                    sync_output(fb);
+                    unsynced=0;
+                    nextsync=now+fb->syncint;
+                    pthread_mutex_lock(&fb->mutex);
+                    continue;
+                }
+                if (nextsync-now < wait)
+                    wait=nextsync-now;
+            }
+            gettimeofday(&tv,NULL);
+            now=(int64_t) tv.tv_sec*1000+tv.tv_usec/1000+wait;
+            due.tv_sec=now/1000;
+            due.tv_nsec=(now%1000)*1000000;
+            if (pthread_cond_timedwait(&fb->cond,&fb->mutex,&due) == ETIMEDOUT
+                    && !fb->pending && fb->len[fb->fill]) {
+                fb->pending=1;
+                fb->fill^=1;
+            }
+            continue;
+        }
+        if (!fb->pending)
+            break;
+
+        idx=fb->fill^1;
+        pthread_mutex_unlock(&fb->mutex);
+        /* Buffers hold whole sentences so switching files between them
+         * loses nothing */
+        if (fb->pattern && rotate_due(fb,fb->len[idx]) &&
+                rotate_output(fb) < 0)
+            failed=1;
+        else if ((failed=write_output(fb,fb->buf[idx],fb->len[idx])) < 0)
+            logerr(errno,"Buffered write failed");
+        else if (fb->syncint && ((now=msclock()) >= nextsync || fb->done)) {
+            sync_output(fb);
+            unsynced=0;
+            nextsync=now+fb->syncint;
+        } else if (fb->syncint)
+            unsynced=1;
+        pthread_mutex_lock(&fb->mutex);
+        if (failed)
+            fb->err=1;
+        fb->len[idx]=0;
+        fb->pending=0;
+        pthread_cond_broadcast(&fb->cond);
+        if (fb->err)
+            break;
+    }
+    pthread_mutex_unlock(&fb->mutex);
+    return(NULL);
+}
+
+/*
+ * Add output to a file buffer, handing the buffer to the flusher thread if
+ * it is full
+ * Args: Pointer to file buffer, data to be written as for writev()
+ * Returns: 0 on success, -1 if the flusher has failed
+ * Side effects: Waits if the other buffer is still being written
+ */
+static int buffer_output(struct filebuf *fb, struct iovec *iov, int cnt)
+{
+    size_t total;
+    int i;
+
+    for (i=0,total=0;i<cnt;i++)
+        total+=iov[i].iov_len;
+
+    pthread_mutex_lock(&fb->mutex);
+    if (fb->len[fb->fill]+total > fb->size) {
+        while (fb->pending && !fb->err)
+            pthread_cond_wait(&fb->cond,&fb->mutex);
+        fb->pending=1;
+        fb->fill^=1;
+        pthread_cond_broadcast(&fb->cond);
+    }
+    if (fb->err) {
+        pthread_mutex_unlock(&fb->mutex);
+        return(-1);
+    }
+    for (i=0;i<cnt;i++) {
+        memcpy(fb->buf[fb->fill]+fb->len[fb->fill],iov[i].iov_base,
+                iov[i].iov_len);
+        fb->len[fb->fill]+=iov[i].iov_len;
+    }
+    pthread_mutex_unlock(&fb->mutex);
+    return(0);
+}
+
 void write_file(iface_t *ifa)
 {
     struct if_file *ifc = (struct if_file *) ifa->info;
@@ -86,18 +525,30 @@ void write_file(iface_t *ifa)
         }
     }
 
+    if (ifc->fbuf) {
+        /* The output file now belongs to the flusher */
+        if (attach_output(ifc->fbuf,ifc->fd) < 0)
+            iface_thread_exit(errno);
+        ifc->fd=-1;
+        if (pthread_create(&ifc->fbuf->tid,NULL,flusher,
+                (void *) ifc->fbuf) != 0) {
+            logerr(errno,"%s: Could not start flusher",ifa->name);
+            ifc->fbuf->tid=0;
+            iface_thread_exit(errno);
+        }
+    }
 
     for(;;)  {
         if ((sptr = next_senblk(ifa->q)) == NULL) {
             break;
         }
 
-        if (senfilter(sptr,ifa->ofilter)) {
+        if (senfilter(sptr,ifa->ofilter,ifa)) {
             senblk_free(sptr,ifa->q);
             continue;
         }
 
-        if (!usereturn) {
+        if (!usereturn && !sptr->enc) {
             sptr->data[sptr->len-2] = '\n';
             sptr->len--;
         }
@@ -111,9 +562,14 @@ void write_file(iface_t *ifa)
                 free(iov[0].iov_base);
             }
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-        if (writev(ifc->fd,iov,cnt) <0) {
+        iov[data].iov_base=senblk_out(sptr);
+        iov[data].iov_len=senblk_outlen(sptr);
+        if (ifc->fbuf) {
+            if (buffer_output(ifc->fbuf,iov,cnt) < 0) {
+                senblk_free(sptr,ifa->q);
+                break;
+            }
+        } else if (writev(ifc->fd,iov,cnt) <0) {
             if (!(flag_test(ifa,F_PERSIST) && errno == EPIPE) ) {
                 logerr(errno,"%s: write failed",ifa->name);
                 break;
@@ -132,12 +588,305 @@ void write_file(iface_t *ifa)
     if (cnt == 2)
         free(iov[0].iov_base);
 
+    if (ifc->fbuf) {
+        stop_flusher(ifc->fbuf);
+        ifc->fbuf->tid=0;
+    }
+
+    iface_thread_exit(errno);
+}
+
+/*
+ * Write routine for output to capture files
+ * Args: Interface pointer
+ * Returns: Nothing
+ */
+void write_capture(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    senblk_t *sptr;
+
+    while ((sptr = next_senblk(ifa->q)) != NULL) {
+        if (senfilter(sptr,ifa->ofilter,ifa) == 0 &&
+                capture_add(ifc->cap,sptr) < 0) {
+            logerr(errno,"%s: write failed",ifa->name);
+            senblk_free(sptr,ifa->q);
+            break;
+        }
+        senblk_free(sptr,ifa->q);
+    }
     iface_thread_exit(errno);
 }
 
+/*
+ * Read routine for input from capture files
+ * Args: Interface pointer
+ * Returns: Nothing
+ */
+void read_capture_file(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+
+    read_capture(ifa,ifc->fd,ifc->filename,ifc->start,ifc->end,ifc->replay);
+}
+
+/*
+ * Get the next sentence from a merge source
+ * Args: Interface pointer, merge source
+ * Returns: 0 on success, -1 when there are no more
+ * Side Effects: Sentence and its time are left in the source's senblk.  The
+ * time of a sentence with no TAG block time is that of the one before
+ */
+static int merge_next(iface_t *ifa, struct mergesrc *ms)
+{
+    ssize_t nread;
+
+    if (ms->cr) {
+        if (capture_next(ms->cr,&ms->sblk) < 0)
+            return(-1);
+        ms->ts=ms->sblk.ts;
+        return(0);
+    }
+
+    for (;;) {
+        if (ms->pos == ms->len) {
+            if ((nread=read(ms->fd,ms->buf,BUFSIZ)) <= 0)
+                return(-1);
+            ms->len=nread;
+            ms->pos=0;
+        }
+        ms->pos+=parse_input(ifa,ms->rs,ms->buf+ms->pos,ms->len-ms->pos);
+        if (ms->rs->ready) {
+            ms->rs->ready=0;
+            if (ms->rs->tagtime >= 0)
+                ms->ts=ms->rs->tagtime;
+            ms->sblk.len=ms->rs->sblk.len;
+            memcpy(ms->sblk.data,ms->rs->sblk.data,ms->sblk.len);
+            return(0);
+        }
+    }
+}
+
+/*
+ * Restore the heap property of a merge heap from a given position downwards
+ * Args: Heap of merge sources, number of sources, position
+ * Returns: Nothing
+ * Sources with equal times are ordered by id so files are merged stably
+ */
+static void merge_sift(struct mergesrc **heap, int n, int i)
+{
+    struct mergesrc *tmp;
+    int c;
+
+    for (;(c=2*i+1) < n;i=c) {
+        if (c+1 < n && (heap[c+1]->ts < heap[c]->ts ||
+                (heap[c+1]->ts == heap[c]->ts && heap[c+1]->id < heap[c]->id)))
+            c++;
+        if (heap[i]->ts < heap[c]->ts ||
+                (heap[i]->ts == heap[c]->ts && heap[i]->id < heap[c]->id))
+            break;
+        tmp=heap[i];
+        heap[i]=heap[c];
+        heap[c]=tmp;
+    }
+}
+
+/*
+ * Read routine for file inputs merging several files by time
+ * Args: Interface pointer
+ * Returns: Nothing
+ * Each file's next sentence is kept in a min-heap ordered by time, so only
+ * one sentence per file is held at once
+ */
+void read_merged(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct mergesrc **heap=ifc->msrc;
+    struct mergesrc *ms;
+    int i,n;
+
+    for (i=n=0;i<ifc->nmsrc;i++)
+        if (merge_next(ifa,ifc->msrc[i]) == 0)
+            heap[n++]=ifc->msrc[i];
+        else
+            free_mergesrc(ifc->msrc[i]);
+    ifc->nmsrc=n;
+    for (i=n/2-1;i>=0;i--)
+        merge_sift(heap,n,i);
+
+    while (n) {
+        ms=heap[0];
+        if (ms->ts >= ifc->start && !(ifc->end && ms->ts > ifc->end) &&
+                senfilter(&ms->sblk,ifa->ifilter,ifa) == 0) {
+            if (ifc->replay) {
+                replay_wait(ifc->replay,ms->ts);
+                ms->sblk.ts=mstime();
+            } else if (!ms->cr)
+                ms->sblk.ts=mstime();
+            publish(&ms->sblk,ifa);
+        }
+        if ((ifc->end && ms->ts > ifc->end) || merge_next(ifa,ms) < 0) {
+            heap[0]=heap[--n];
+            heap[n]=ms;
+        }
+        merge_sift(heap,n,0);
+    }
+    iface_thread_exit(0);
+}
+
+/*
+ * Set up the sources for a file input merging several files
+ * Args: Interface pointer, whether files are in capture format
+ * Returns: 0 on success, -1 on failure
+ * The filename is a list of glob patterns separated by ':'.  Each file is a
+ * source in its own right, named after the file with its directory and any
+ * extension removed
+ */
+static int init_merge(iface_t *ifa, int capture)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct mergesrc *ms;
+    glob_t g;
+    char *list,*pat,*next,*name,*cp;
+    size_t i;
+    int ret=0,flags=0;
+
+    /* Split a copy so the whole list is still there for messages */
+    if ((list=strdup(ifc->filename)) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return(-1);
+    }
+    for (pat=list;pat;pat=next,flags=GLOB_APPEND) {
+        if ((next=strchr(pat,':')) != NULL)
+            *next++='\0';
+        if ((ret=glob(pat,flags,NULL,&g)) == GLOB_NOMATCH)
+            logwarn("%s: No files match %s",ifa->name,pat);
+        else if (ret)
+            break;
+    }
+    free(list);
+    if (ret && ret != GLOB_NOMATCH) {
+        logerr(errno,"Failed to find files to merge");
+        globfree(&g);
+        return(-1);
+    }
+    if (g.gl_pathc == 0) {
+        logerr(0,"No files match %s",ifc->filename);
+        globfree(&g);
+        return(-1);
+    }
+
+    if ((ifc->msrc=(struct mergesrc **) calloc(g.gl_pathc,
+            sizeof(struct mergesrc *))) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        globfree(&g);
+        return(-1);
+    }
+
+    for (i=0;i<g.gl_pathc;i++) {
+        if ((ms=(struct mergesrc *) calloc(1,sizeof(struct mergesrc)))
+                == NULL) {
+            logerr(errno,"Could not allocate memory");
+            break;
+        }
+        ifc->msrc[ifc->nmsrc++]=ms;
+        if ((ms->path=strdup(g.gl_pathv[i])) == NULL) {
+            logerr(errno,"Could not allocate memory");
+            ms->fd=-1;
+            break;
+        }
+        if ((ms->fd=open(ms->path,O_RDONLY)) < 0) {
+            logerr(errno,"Failed to open %s",ms->path);
+            break;
+        }
+
+        /* Source name is the file's base name without extension */
+        if ((cp=strrchr(ms->path,'/')) == NULL)
+            cp=ms->path;
+        else
+            cp++;
+        if ((name=strdup(cp)) == NULL) {
+            logerr(errno,"Could not allocate memory");
+            break;
+        }
+        if ((cp=strrchr(name,'.')) != NULL && cp != name)
+            *cp='\0';
+        if ((ms->id=new_srcid(name)) == 0) {
+            logerr(0,"Could not add source %s for %s",name,ms->path);
+            free(name);
+            break;
+        }
+        ms->sblk.src=ms->id;
+        ms->sblk.enc=NULL;
+        ms->sblk.next=NULL;
+        DEBUG(3,"%s: merging %s as %s",ifa->name,ms->path,name);
+
+        if (capture) {
+            if ((ms->cr=capture_reader(ms->fd,ms->path,ifc->start,
+                    ms->id)) == NULL)
+                break;
+            capture_names(ms->fd,ms->path);
+        } else if ((ms->rs=(struct rdstate *) malloc(sizeof(struct rdstate)))
+                == NULL || (ms->buf=(char *) malloc(BUFSIZ)) == NULL) {
+            logerr(errno,"Could not allocate memory");
+            break;
+        } else {
+            init_rdstate(ifa,ms->rs);
+            ms->rs->hold=1;
+        }
+    }
+    ret=(i < g.gl_pathc)?-1:0;
+    globfree(&g);
+    return(ret);
+}
+
+/*
+ * Read routine for input from regular files using mmap()
+ * Args: Interface pointer
+ * Returns: Nothing
+ * The file is mapped a window at a time and sentences parsed directly from
+ * the mapping rather than being read into a buffer first
+ */
+void read_mapped(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct rdstate rs;
+    struct stat st;
+    off_t off;
+    size_t len,slice,i;
+    char *map;
+
+    if (fstat(ifc->fd,&st) < 0) {
+        logerr(errno,"%s: Could not stat input file",ifa->name);
+        iface_thread_exit(errno);
+    }
+
+    init_rdstate(ifa,&rs);
+    rs.replay=ifc->replay;
+    for (off=0;off<st.st_size;off+=len) {
+        len=(st.st_size-off > MAPWINDOW)?MAPWINDOW:(size_t) (st.st_size-off);
+        if ((map=mmap(NULL,len,PROT_READ,MAP_PRIVATE,ifc->fd,off))
+                == MAP_FAILED) {
+            logerr(errno,"%s: Could not map input file",ifa->name);
+            break;
+        }
+        (void) madvise(map,len,MADV_SEQUENTIAL);
+        for (i=0;i<len;i+=slice) {
+            slice=(len-i > MAPSLICE)?MAPSLICE:len-i;
+            rs.sblk.ts=mstime();
+            parse_input(ifa,&rs,map+i,slice);
+        }
+        (void) munmap(map,len);
+    }
+    iface_thread_exit(0);
+}
+
 void file_read_wrapper(iface_t *ifa)
 {
     struct if_file *ifc = (struct if_file *) ifa->info;
+    struct rdstate rs;
+    char buf[BUFSIZ];
+    ssize_t nread;
 
     /* Create FILE stream here to allow for non-blocking opening FIFOs */
     if (ifc->fd == -1) {
@@ -148,8 +897,173 @@ void file_read_wrapper(iface_t *ifa)
             DEBUG(3,"%s: opened %s for reading",ifa->name,ifc->filename);
         }
     }
-    do_read(ifa);
+
+    /* As do_read() but with pacing of replayed files */
+    init_rdstate(ifa,&rs);
+    rs.replay=ifc->replay;
+    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
+        rs.sblk.ts=mstime();
+        parse_input(ifa,&rs,buf,nread);
+    }
+    iface_thread_exit(errno);
+}
+
+#ifdef linux
+/*
+ * Read what is available from a followed file
+ * Args: Interface pointer, read state, buffer of size BUFSIZ
+ * Returns: 0 on success, -1 on error
+ * If the file has been truncated it is read again from the start
+ */
+static int tail_drain(iface_t *ifa, struct rdstate *rs, char *buf)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct stat st;
+    ssize_t nread;
+
+    for (;;) {
+        while ((nread=read(ifc->fd,buf,BUFSIZ)) > 0) {
+            rs->sblk.ts=mstime();
+            parse_input(ifa,rs,buf,nread);
+        }
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        if (fstat(ifc->fd,&st) < 0)
+            return(-1);
+        if (st.st_size >= lseek(ifc->fd,0,SEEK_CUR))
+            return(0);
+        DEBUG(3,"%s: %s truncated",ifa->name,ifc->filename);
+        (void) lseek(ifc->fd,0,SEEK_SET);
+        init_rdstate(ifa,rs);
+    }
+}
+
+/*
+ * Watch a followed file by name
+ * Args: Interface pointer, pointer to watch descriptor to set (-1 if there
+ * is no file with the name)
+ * Returns: 0 if the file watched is the one open, 1 if it is not, -1 on error
+ * The file is opened before it is watched, so it may have been renamed or
+ * removed in between.  Events for it and for a new file with its name would
+ * then be missed, so the caller should look for a new file without waiting
+ * for them
+ */
+static int tail_watch(iface_t *ifa, int *wd)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct stat st,nst;
+
+    if ((*wd=inotify_add_watch(ifc->notify,ifc->filename,
+            IN_MODIFY|IN_MOVE_SELF|IN_DELETE_SELF)) < 0 && errno != ENOENT)
+        return(-1);
+    if (*wd < 0 || stat(ifc->filename,&nst) < 0 || fstat(ifc->fd,&st) < 0 ||
+            nst.st_dev != st.st_dev || nst.st_ino != st.st_ino) {
+        DEBUG(3,"%s: %s replaced before being watched",ifa->name,
+                ifc->filename);
+        return(1);
+    }
+    return(0);
+}
+
+/*
+ * Read routine for following a file as it is written to ("tail" option)
+ * Args: Interface pointer
+ * Returns: Nothing
+ * The thread sleeps until inotify reports a change to the file or to the
+ * directory containing it.  When the file is renamed or removed and a new one
+ * created in its place, the rest of the old file is read before switching to
+ * the new one
+ */
+void read_tail(iface_t *ifa)
+{
+    struct if_file *ifc = (struct if_file *) ifa->info;
+    struct rdstate rs;
+    struct inotify_event *ev;
+    struct stat st,nst;
+    char buf[BUFSIZ];
+    char evbuf[4096]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char dir[PATH_MAX];
+    char *base,*ptr;
+    int wd=-1,dwd=-1,fd,moved=0,created=0;
+    ssize_t nread;
+
+    if ((base=strrchr(ifc->filename,'/')) == NULL) {
+        strcpy(dir,".");
+        base=ifc->filename;
+    } else {
+        snprintf(dir,sizeof(dir),"%.*s",(base == ifc->filename)?1:
+                (int) (base-ifc->filename),ifc->filename);
+        base++;
+    }
+
+    if ((ifc->notify=inotify_init1(IN_CLOEXEC)) < 0 ||
+            (dwd=inotify_add_watch(ifc->notify,dir,IN_CREATE|IN_MOVED_TO)) < 0
+            || (created=tail_watch(ifa,&wd)) < 0) {
+        logerr(errno,"%s: Could not watch %s",ifa->name,ifc->filename);
+        iface_thread_exit(errno);
+    }
+    moved=created;
+
+    init_rdstate(ifa,&rs);
+    for (;;) {
+        if (tail_drain(ifa,&rs,buf) < 0) {
+            logerr(errno,"%s: Error reading %s",ifa->name,ifc->filename);
+            break;
+        }
+
+        if (created)
+            nread=0;
+        else if ((nread=read(ifc->notify,evbuf,sizeof(evbuf))) < 0) {
+            if (errno == EINTR)
+                continue;
+            logerr(errno,"%s: Error reading inotify events",ifa->name);
+            break;
+        }
+
+        for (ptr=evbuf;ptr<evbuf+nread;
+                ptr+=sizeof(struct inotify_event)+ev->len) {
+            ev=(struct inotify_event *) ptr;
+            if (ev->wd == wd) {
+                if (ev->mask & (IN_MOVE_SELF|IN_DELETE_SELF))
+                    moved=1;
+                if (ev->mask & IN_IGNORED)
+                    wd=-1;
+            } else if (ev->wd == dwd && ev->len && !strcmp(ev->name,base))
+                created=1;
+        }
+
+        if (!(moved || created))
+            continue;
+        created=0;
+
+        /* Switch to a new file with our name if there is one */
+        if ((fd=open(ifc->filename,O_RDONLY)) < 0)
+            continue;
+        if (fstat(fd,&nst) < 0 || fstat(ifc->fd,&st) < 0 ||
+                (nst.st_dev == st.st_dev && nst.st_ino == st.st_ino)) {
+            close(fd);
+            continue;
+        }
+        if (tail_drain(ifa,&rs,buf) < 0)
+            logerr(errno,"%s: Error reading %s",ifa->name,ifc->filename);
+        close(ifc->fd);
+        ifc->fd=fd;
+        if (wd >= 0)
+            (void) inotify_rm_watch(ifc->notify,wd);
+        if ((moved=created=tail_watch(ifa,&wd)) < 0) {
+            logerr(errno,"%s: Could not watch %s",ifa->name,ifc->filename);
+            break;
+        }
+        init_rdstate(ifa,&rs);
+        DEBUG(3,"%s: following new %s",ifa->name,ifc->filename);
+    }
+    iface_thread_exit(errno);
 }
+#endif
 
 ssize_t read_file(iface_t *ifa, char *buf)
 {
@@ -185,8 +1099,15 @@ iface_t *init_file (iface_t *ifa)
     gid_t gid=-1;
     struct passwd *owner;
     struct group *group;
-    mode_t tperm,perm=0;
+    mode_t perm=0;
     char *cp;
+    size_t bufsize=0;
+    double flushint=0,syncint=0;
+    off_t rotsize=0;
+    time_t rotint=0,now;
+    char *pattern=NULL;
+    int compress=0,capture=0,replay=0,merge=0;
+    double start=0,end=0,rate=0,speed=1;
 
     if ((ifc = (struct if_file *)malloc(sizeof(struct if_file))) == NULL) {
         logerr(errno,"Could not allocate memory");
@@ -197,6 +1118,7 @@ iface_t *init_file (iface_t *ifa)
 
     ifc->qsize=DEFFILEQSIZE;
     ifc->fd=-1;
+    ifc->notify=-1;
     ifa->info = (void *) ifc;
 
     for(opt=ifa->options;opt;opt=opt->next) {
@@ -211,6 +1133,120 @@ iface_t *init_file (iface_t *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"buffer")) {
+            if ((bufsize=(size_t) strtoul(opt->val,&cp,0)) < BUFSIZE ||
+                    *cp) {
+                logerr(0,"Invalid buffer size %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"flush")) {
+            if ((flushint=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid flush interval %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"sync")) {
+            if ((syncint=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid sync interval %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"rotate")) {
+            if ((rotsize=(off_t) strtoull(opt->val,&cp,0)) < BUFSIZE || *cp) {
+                logerr(0,"Invalid rotation size %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"rotatetime")) {
+            if ((rotint=(time_t) strtoul(opt->val,&cp,0)) <= 0 || *cp) {
+                logerr(0,"Invalid rotation interval %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"compress")) {
+            if (!strcasecmp(opt->val,"gzip")) {
+#ifdef HAVE_ZLIB
+                compress=1;
+#else
+                logerr(0,"gzip compression not supported in this build");
+                return(NULL);
+#endif
+            } else if (!strcasecmp(opt->val,"no")) {
+                compress=0;
+            } else {
+                logerr(0,"Invalid option \"compress=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"proto")) {
+            if (!strcasecmp(opt->val,"capture")) {
+                capture=1;
+            } else if (!strcasecmp(opt->val,"nmea")) {
+                capture=0;
+            } else {
+                logerr(0,"Invalid option \"proto=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"merge")) {
+            if (!strcasecmp(opt->val,"yes")) {
+                merge=1;
+            } else if (!strcasecmp(opt->val,"no")) {
+                merge=0;
+            } else {
+                logerr(0,"Invalid option \"merge=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"mmap")) {
+            if (!strcasecmp(opt->val,"yes")) {
+                ifc->mapped=1;
+            } else if (!strcasecmp(opt->val,"no")) {
+                ifc->mapped=0;
+            } else {
+                logerr(0,"Invalid option \"mmap=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"tail")) {
+            if (!strcasecmp(opt->val,"yes")) {
+#ifdef linux
+                ifc->tail=1;
+#else
+                logerr(0,"tail option not supported on this platform");
+                return(NULL);
+#endif
+            } else if (!strcasecmp(opt->val,"no")) {
+                ifc->tail=0;
+            } else {
+                logerr(0,"Invalid option \"tail=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"replay")) {
+            if (!strcasecmp(opt->val,"time")) {
+                replay=1;
+            } else if (!strcasecmp(opt->val,"rate")) {
+                replay=2;
+            } else if (!strcasecmp(opt->val,"no")) {
+                replay=0;
+            } else {
+                logerr(0,"Invalid option \"replay=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"rate")) {
+            if ((rate=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid replay rate %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"speed")) {
+            if (!strcasecmp(opt->val,"max"))
+                speed=0;
+            else if ((speed=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid replay speed %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"start")) {
+            if ((start=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid start time %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"end")) {
+            if ((end=strtod(opt->val,&cp)) <= 0 || *cp) {
+                logerr(0,"Invalid end time %s",opt->val);
+                return(NULL);
+            }
         } else if (!strcasecmp(opt->var,"append")) {
             if (!strcasecmp(opt->val,"yes")) {
                 append++;
@@ -221,17 +1257,23 @@ iface_t *init_file (iface_t *ifa)
                 return(NULL);
             }
         } else if (!strcasecmp(opt->var,"owner")) {
-            if ((owner=getpwnam(opt->val)) == NULL) {
+            pthread_mutex_lock(&ifa->lists->init_mutex);
+            if ((owner=getpwnam(opt->val)) != NULL)
+                uid=owner->pw_uid;
+            pthread_mutex_unlock(&ifa->lists->init_mutex);
+            if (owner == NULL) {
                 logerr(0,"No such user '%s'",opt->val);
                 return(NULL);
             }
-            uid=owner->pw_uid;
         } else if (!strcasecmp(opt->var,"group")) {
-            if ((group=getgrnam(opt->val)) == NULL) {
+            pthread_mutex_lock(&ifa->lists->init_mutex);
+            if ((group=getgrnam(opt->val)) != NULL)
+                gid=group->gr_gid;
+            pthread_mutex_unlock(&ifa->lists->init_mutex);
+            if (group == NULL) {
                 logerr(0,"No such group '%s'",opt->val);
                 return(NULL);
             }
-            gid=group->gr_gid;
         }
         else if (!strcasecmp(opt->var,"perm")) {
             for (cp=opt->val;*cp;cp++) {
@@ -254,10 +1296,93 @@ iface_t *init_file (iface_t *ifa)
         }
     }
 
+    if (rate && !replay)
+        replay=2;
+    if (replay) {
+        if (ifa->direction != IN) {
+            logerr(0,"replay options only valid for input");
+            return(NULL);
+        }
+        if (replay == 2 && !rate) {
+            logerr(0,"replay=rate requires a rate");
+            return(NULL);
+        }
+        if ((ifc->replay=(struct replay *) calloc(1,sizeof(struct replay)))
+                == NULL) {
+            logerr(errno,"Could not allocate memory");
+            return(NULL);
+        }
+        ifc->replay->speed=speed;
+        ifc->replay->rate=(replay == 2)?rate:0;
+    } else if (speed != 1) {
+        logerr(0,"speed option requires replay");
+        return(NULL);
+    }
+
+    if (capture) {
+        if (ifc->filename == NULL || ifa->direction == BOTH) {
+            logerr(0,"proto=capture requires a filename for input or output");
+            return(NULL);
+        }
+        if (pattern || compress || bufsize || syncint ||
+                flag_test(ifa,F_PERSIST)) {
+            logerr(0,"rotate, compress, buffer, sync and persist options can't be used with proto=capture");
+            return(NULL);
+        }
+        if (ifa->format != FMT_NMEA) {
+            logerr(0,"format option can't be used with proto=capture");
+            return(NULL);
+        }
+        if (ifa->tagflags) {
+            logwarn("%s: TAG blocks not written with proto=capture",
+                    ifa->name);
+            ifa->tagflags=0;
+        }
+        if (ifa->direction == OUT && (start || end)) {
+            logerr(0,"start and end options only valid for input");
+            return(NULL);
+        }
+        ifc->start=(int64_t) (start*1000);
+        ifc->end=(int64_t) (end*1000);
+    } else if (merge) {
+        ifc->start=(int64_t) (start*1000);
+        ifc->end=(int64_t) (end*1000);
+    } else if (start || end) {
+        logerr(0,"start and end options require proto=capture or merge");
+        return(NULL);
+    }
+
+    if (merge) {
+        if (ifa->direction != IN || ifc->filename == NULL ||
+                flag_test(ifa,F_PERSIST) || ifc->mapped) {
+            logerr(0,"merge option only valid for input from named files without persist or mmap");
+            return(NULL);
+        }
+        if (init_merge(ifa,capture) < 0)
+            return(NULL);
+    }
+
+    now=time(NULL);
+    if (rotsize || rotint) {
+        if (ifc->filename == NULL || ifa->direction != OUT) {
+            logerr(0,"Rotation only supported for output to named files");
+            return(NULL);
+        }
+        /* The filename may contain strftime() conversions */
+        pattern=ifc->filename;
+        if ((ifc->filename=expand_name(pattern,now)) == NULL) {
+            logerr(errno,"Could not generate file name from %s",pattern);
+            free(pattern);
+            return(NULL);
+        }
+    }
+
     /* We do allow use of stdin and stdout, but not if they're connected to
      * a terminal. This allows re-direction in background mode
      */
-    if (ifc->filename == NULL) {
+    if (merge) {
+        /* Files were opened above */
+    } else if (ifc->filename == NULL) {
         if (flag_test(ifa,F_PERSIST)) {
             logerr(0,"Can't use persist mode with stdin/stdout");
             return(NULL);
@@ -301,20 +1426,28 @@ iface_t *init_file (iface_t *ifa)
                 logerr(errno,"Could not access %s",ifc->filename);
                 return(NULL);
             }
+            if (pattern || capture) {
+                logerr(0,"Can't %s FIFO %s",pattern?"rotate":"capture to",
+                        ifc->filename);
+                return(NULL);
+            }
         } else {
             if (flag_test(ifa,F_PERSIST)) {
                 logerr(0,"Can't use persist mode on %s: Not a FIFO",
                         ifc->filename);
                 return(NULL);
             }
-            if (perm)
-                tperm=umask(0);
-
             errno=0;
             /* If file is for output and doesn't currently exist...*/
             if (ifa->direction != IN && (ifc->fd=open(ifc->filename,
-                        O_WRONLY|O_CREAT|O_EXCL|((append)?O_APPEND:0),
-                        (perm)?perm:0664)) >= 0) {
+                        ((capture)?O_RDWR:O_WRONLY)|O_CREAT|O_EXCL|
+                        ((append)?O_APPEND:0),(perm)?perm:0664)) >= 0) {
+                /* Not umask(): other interfaces may be creating files too */
+                if (perm && fchmod(ifc->fd,perm) < 0) {
+                    logerr(errno,"Failed to set permissions on output file %s",
+                            ifc->filename);
+                    return(NULL);
+                }
                 if (gid != 0 || uid != -1) {
                     if (chown(ifc->filename,uid,gid) < 0) {
                         logerr(errno, "Failed to set ownership or group on output file %s",ifc->filename);
@@ -328,24 +1461,118 @@ iface_t *init_file (iface_t *ifa)
                     return(NULL);
                 }
                 /* file is for input or already exists */
+                /* Capture files are read when appended to */
                 if ((ifc->fd=open(ifc->filename,(ifa->direction==IN)?O_RDONLY:
-                        (O_WRONLY|((append)?O_APPEND:O_TRUNC)))) < 0) {
+                        (((capture)?O_RDWR:O_WRONLY)|
+                        ((append)?O_APPEND:O_TRUNC)))) < 0) {
                     logerr(errno,"Failed to open file %s",ifc->filename);
                     return(NULL);
                 }
                 DEBUG(3,"%s: opened %s for %s",ifa->name,ifc->filename,
                         (ifa->direction==IN)?"input":"output");
             }
-            /* reset umask: not really necessary */
-            if (perm)
-                (void) umask(tperm);
         }
     }
 
+    /* Rotation and compression are done by the flusher thread */
+    if ((pattern || compress) && !bufsize)
+        bufsize=DEFFILEBUF;
+
+    if (bufsize) {
+        if (ifa->direction != OUT || flag_test(ifa,F_PERSIST)) {
+            logerr(0,"%s option only valid for output to files",
+                    compress?"compress":"buffer");
+            return(NULL);
+        }
+        if ((ifc->fbuf=(struct filebuf *) calloc(1,sizeof(struct filebuf)))
+                == NULL || (ifc->fbuf->buf[0]=(char *) malloc(2*bufsize))
+                == NULL) {
+            logerr(errno,"Could not allocate output buffer");
+            return(NULL);
+        }
+        ifc->fbuf->buf[1]=ifc->fbuf->buf[0]+bufsize;
+        ifc->fbuf->size=bufsize;
+        ifc->fbuf->flushint=flushint?(int64_t) (flushint*1000):DEFFLUSHINT;
+        ifc->fbuf->syncint=(int64_t) (syncint*1000);
+        if (ifc->fbuf->flushint == 0)
+            ifc->fbuf->flushint=1;
+        ifc->fbuf->fd=-1;
+        ifc->fbuf->compress=compress;
+        if ((ifc->fbuf->pattern=pattern) != NULL &&
+                (ifc->fbuf->current=strdup(ifc->filename)) == NULL) {
+            logerr(errno,"Failed to duplicate file name");
+            return(NULL);
+        }
+        ifc->fbuf->rotsize=rotsize;
+        ifc->fbuf->rotint=rotint;
+        ifc->fbuf->opened=now;
+        ifc->fbuf->perm=perm;
+        ifc->fbuf->uid=uid;
+        ifc->fbuf->gid=gid;
+        pthread_mutex_init(&ifc->fbuf->mutex,NULL);
+        pthread_cond_init(&ifc->fbuf->cond,NULL);
+    } else if ((flushint && !capture) || syncint) {
+        logerr(0,"flush and sync options require buffer option");
+        return(NULL);
+    }
+
+    if (capture && ifa->direction == OUT && (ifc->cap=capture_open(ifc->fd,
+            ifc->filename,append,flushint?(int64_t) (flushint*1000):
+            DEFFLUSHINT)) == NULL)
+        return(NULL);
+
+    /* Sources named in a capture file may be used in filter rules */
+    if (capture && ifa->direction == IN && !merge)
+        capture_names(ifc->fd,ifc->filename);
+
     free_options(ifa->options);
 
-    ifa->write=write_file;
-    ifa->read=file_read_wrapper;
+    if (ifc->tail) {
+        if (ifa->direction != IN || capture || merge || ifc->mapped ||
+                ifc->replay || flag_test(ifa,F_PERSIST)) {
+            logerr(0,"tail option only valid for NMEA input without merge, mmap, replay or persist");
+            return(NULL);
+        }
+        if (ifc->filename == NULL || fstat(ifc->fd,&statbuf) < 0 ||
+                !S_ISREG(statbuf.st_mode)) {
+            logerr(0,"tail option only valid for regular files");
+            return(NULL);
+        }
+        /* Start with data written from now on */
+        if (lseek(ifc->fd,0,SEEK_END) < 0) {
+            logerr(errno,"Could not seek to end of %s",ifc->filename);
+            return(NULL);
+        }
+    }
+
+    if (ifc->mapped) {
+        if (ifa->direction != IN || capture) {
+            logerr(0,"mmap option only valid for NMEA input");
+            return(NULL);
+        }
+        if (fstat(ifc->fd,&statbuf) < 0 || !S_ISREG(statbuf.st_mode)) {
+            logerr(0,"mmap option only valid for regular files");
+            return(NULL);
+        }
+    }
+
+    /* Regular files are read no faster than the engine takes sentences
+     * rather than losing those there is no room for */
+    if (ifa->direction == IN && !ifc->tail && (merge || (ifc->fd >= 0 &&
+            fstat(ifc->fd,&statbuf) == 0 && S_ISREG(statbuf.st_mode))))
+        flag_set(ifa,F_NODROP);
+
+    ifa->write=capture?write_capture:write_file;
+    if (merge)
+        ifa->read=read_merged;
+    else if (capture)
+        ifa->read=read_capture_file;
+#ifdef linux
+    else if (ifc->tail)
+        ifa->read=read_tail;
+#endif
+    else
+        ifa->read=ifc->mapped?read_mapped:file_read_wrapper;
     ifa->readbuf=read_file;
     ifa->cleanup=cleanup_file;
 
@@ -86,7 +86,8 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
         return(NULL);
     }
     newift->shared=NULL;
-    newifa->id=ifa->id+(newift->fd&IDMINORMASK);
+    newift->multi=NULL;
+    newifa->id=new_connid(ifa);
     newifa->direction=IN;
     newifa->type=TCP;
     newifa->name=ifa->name;
@@ -100,7 +101,8 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
     newifa->ifilter=addfilter(ifa->ifilter);
     /* Copying ofilter is unnecessary as gofree is input only */
     newifa->checksum=ifa->checksum;
-    newifa->q=ifa->lists->engine->q;
+    newifa->buses=ifa->buses;
+    newifa->q=bus_queue(ifa);
     /* disable SIGUSR1 before launching new thread to avoid it being killed
      * while holding a mutex */
     sigemptyset(&set);
@@ -21,6 +21,9 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <inttypes.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 /* Macro to identify kplex Proprietary sentences */
 #define isprop(sptr) (sptr->data[1] == 'P' && sptr->data[2] == 'K' && sptr->data[3] == 'P' && sptr->data[4] == 'X')
@@ -31,6 +34,7 @@ pthread_t reaper;       /* tid of thread responsible for reaping */
 int timetodie=0;        /* Set on receipt of SIGTERM or SIGINT */
 time_t graceperiod=3;   /* Grace period for unsent data before shutdown (secs)*/
 int debuglevel=0;                    /* debug off by default */
+static unsigned int lastidx=0;  /* Index of the last interface id allocated */
 
 /* Signal handler for SIGUSR1 used by interface threads.  Note that this is
  * highly dubious: pthread_exit() is not async safe.  No associated problems
@@ -56,6 +60,40 @@ int mysleep(time_t sleepytime)
     return (nanosleep(&rqtp,NULL));
 }
 
+/*
+ * Millisecond clock for measuring intervals. Monotonic where the platform
+ * supports it so unaffected by changes to the system time
+ * Args: None
+ * Returns: Milliseconds since some unspecified starting point
+ */
+int64_t msclock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC,&ts) == 0)
+        return((int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return((int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
+/*
+ * Wall clock time in milliseconds, used to timestamp sentences as they are
+ * read
+ * Args: None
+ * Returns: Milliseconds since the epoch
+ */
+int64_t mstime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return((int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000);
+}
+
 /* functions */
 
 /*
@@ -93,19 +131,134 @@ int checkcksum (senblk_t *sptr)
         return(1);
 }
 
+/*
+ * Check whether a sentence is an AIS VDM/VDO sentence and extract its
+ * fragmentation details
+ * Args: pointer to sentence data, sentence length, pointers to fragment count,
+ * fragment number and sequential message id to be filled in
+ * Returns: 1 if the sentence is AIS, 0 otherwise
+ */
+int is_ais(char *sptr,size_t len,size_t *nfrag, size_t *frag, unsigned int *seq)
+{
+    int i;
+
+    if (len < 13)
+        return(0);
+
+    if (!(sptr[3] == 'V' && sptr[4] == 'D' &&
+            (sptr[5] == 'M' || sptr[5] == 'O')))
+        return(0);
+    sptr+=6;
+
+    if ((*sptr++) != ',')
+        return(0);
+
+    for (i=7,*nfrag=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
+        *nfrag = *nfrag*10+*sptr-'0';
+
+    if (*sptr++ != ',' || i > len)
+        return(0);
+
+    for (*frag=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
+        *frag = *frag*10+*sptr-'0';
+
+    if (*sptr++ != ',' || i > len)
+        return(0);
+
+    for (*seq=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
+        *seq = *seq*10+*sptr-'0';
+
+    if (*sptr != ',' || i > len)
+        return(0);
+
+    return(1);
+}
+
+/*
+ * Check a sentence against a rate limit rule
+ * Args: senblk to be checked, pointer to rule and interface doing the filtering
+ * Returns: 0 if the sentence passes, -1 if it should be dropped
+ * Side Effects: The interface's table of rate limit state is allocated if
+ * necessary and updated.
+ * State is kept separately for each (rule, source, sentence id) so a rule such
+ * as "~GPGSV" limits each source independently.  Output subscriptions are
+ * applied by engine and rewinder threads as well as by the interface's own
+ * thread so the table is locked while it is searched and updated
+ */
+static int ratelimited(senblk_t *sptr, sf_rule_t *rule, iface_t *ifa)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    struct ratetable *rtab;
+    struct ratestate *rptr,*slot=NULL;
+    unsigned char *cptr;
+    int64_t now;
+    int i,ret=0;
+
+    if ((rtab=ifa->ratelimits) == NULL) {
+        if ((rtab = (struct ratetable *) calloc(1,sizeof(struct ratetable)))
+                == NULL) {
+            logwarn("Failed to allocate rate limit state: not limiting");
+            return(0);
+        }
+        pthread_mutex_init(&rtab->lock,NULL);
+        /* Another thread may have got there first */
+        if (!__sync_bool_compare_and_swap(&ifa->ratelimits,NULL,rtab)) {
+            pthread_mutex_destroy(&rtab->lock);
+            free(rtab);
+            rtab=ifa->ratelimits;
+        }
+    }
+
+    for (cptr=(unsigned char *) &rule,i=0;i<sizeof(rule);i++)
+        hash = (hash ^ cptr[i]) * 1099511628211ULL;
+    for (cptr=(unsigned char *) &sptr->src,i=0;i<sizeof(sptr->src);i++)
+        hash = (hash ^ cptr[i]) * 1099511628211ULL;
+    for (cptr=(unsigned char *) sptr->data+1,i=0;i<5;i++)
+        hash = (hash ^ cptr[i]) * 1099511628211ULL;
+
+    now=msclock();
+
+    pthread_mutex_lock(&rtab->lock);
+    for (i=0;i<RATEPROBES;i++) {
+        rptr=&rtab->slot[(hash+i)&(RATESLOTS-1)];
+        if (rptr->rule == NULL) {
+            if (!slot)
+                slot=rptr;
+            break;
+        }
+        if (rptr->rule == rule && rptr->src == sptr->src &&
+                !memcmp(rptr->id,sptr->data+1,5)) {
+            if (now - rptr->last < (int64_t) rule->info.limit->timeout * 1000)
+                ret=-1;
+            else
+                rptr->last=now;
+            pthread_mutex_unlock(&rtab->lock);
+            return(ret);
+        }
+        /* Reuse the least recently passed entry if there is no room */
+        if (!slot || (slot->rule && rptr->last < slot->last))
+            slot=rptr;
+    }
+
+    slot->rule=rule;
+    slot->src=sptr->src;
+    memcpy(slot->id,sptr->data+1,5);
+    slot->last=now;
+    pthread_mutex_unlock(&rtab->lock);
+    return(0);
+}
+
 /*
  * Perform filtering on sentences
- * Args: senblk to be filtered, pointer to filter
+ * Args: senblk to be filtered, pointer to filter, interface doing the filtering
  * Returns: 0 if contents of senblk passes filter, -1 otherwise
  */
-int senfilter(senblk_t *sptr, sfilter_t *filter)
+int senfilter(senblk_t *sptr, sfilter_t *filter, iface_t *ifa)
 {
-    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    srcid_t mask = ~IDMINORMASK;
     sf_rule_t *fptr;
     char *cptr;
     int i;
-    time_t tsecs;
-    struct timeval tv;
 
     /* We shouldn't actually be filtering any NULL packets, but check anyway */
     if (sptr == NULL || filter == NULL || filter->rules == NULL)
@@ -132,18 +285,7 @@ int senfilter(senblk_t *sptr, sfilter_t *filter)
             return(-1);
         }
         /* type is limit. Hopefully. */
-        (void) gettimeofday(&tv,NULL);
-        if (tv.tv_sec < fptr->info.limit->timeout)
-            return(-1);
-        if ((tsecs=(tv.tv_sec - fptr->info.limit->timeout)) <
-                fptr->info.limit->last.tv_sec)
-            return(-1);
-        if (tsecs == fptr->info.limit->last.tv_sec &&
-                (tv.tv_usec < fptr->info.limit->last.tv_usec ))
-            return(-1);
-        /* at least timeout since last seen: Update info and pass */
-        memcpy(&fptr->info.limit->last,&tv,sizeof(struct timeval));
-        return(0);
+        return(ratelimited(sptr,fptr,ifa));
     }
     return(0);
 }
@@ -186,11 +328,16 @@ void free_filter(sfilter_t *fptr)
     if (fptr->rules)
         for (rptr=fptr->rules;rptr;rptr=trptr) {
             trptr=rptr->next;
-            if (fptr->type == FAILOVER)
+            if (fptr->type == FAILOVER) {
                 free_srclist(rptr->info.source);
+                if (rptr->srcindex)
+                    free(rptr->srcindex);
+            }
             free(rptr);
         }
 
+    if (fptr->cache)
+        free(fptr->cache);
     free(fptr);
 }
 
@@ -210,47 +357,74 @@ void link_src_to_rule (struct srclist **list, struct srclist *src)
 }
 
 /*
- * Test if a sentence came from a failover input that is active
- * Args: Pointer to filter head, pointer to senblk to be tested
- * Returns: 1 if  senblk should be passed, 0 if not
+ * Find the failover rule applying to a sentence
+ * Args: Pointer to failover filter, pointer to senblk
+ * Returns: Pointer to the first rule matching the sentence id, NULL if none
+ * Side Effects: Result is cached by sentence id so rules are normally only
+ * scanned the first time a sentence id is seen
  */
-int isactive(sfilter_t *filter,senblk_t *sptr)
+static sf_rule_t *failover_rule(sfilter_t *filter, senblk_t *sptr)
 {
-    time_t now=time(NULL);
-    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
-    unsigned int src;
-    char *cptr,*mptr;
+    struct failcache *cptr;
     sf_rule_t *rule;
-    struct srclist *rptr;
-    time_t last;
+    unsigned int hash;
+    char *mptr,*dptr;
     int i;
 
-    if (filter == NULL || sptr == NULL)
-        return(1);
+    for (hash=0,i=1;i<=5;i++)
+        hash=hash*31+(unsigned char) sptr->data[i];
+    cptr=&filter->cache[hash&(FAILCACHESLOTS-1)];
 
-    src = sptr->src & mask;
+    if (*cptr->id && !memcmp(cptr->id,sptr->data+1,5))
+        return(cptr->rule);
 
     for(rule=filter->rules;rule;rule=rule->next) {
-        for (i=0,cptr=sptr->data+1,mptr=rule->match;i<5;i++,cptr++,mptr++)
-            if(*mptr && *cptr != *mptr)
+        for (i=0,dptr=sptr->data+1,mptr=rule->match;i<5;i++,dptr++,mptr++)
+            if(*mptr && *dptr != *mptr)
                 break;
         if (i == 5)
             break;
     }
-    if (!rule)
+
+    memcpy(cptr->id,sptr->data+1,5);
+    cptr->rule=rule;
+    return(rule);
+}
+
+/*
+ * Test if a sentence came from a failover input that is active
+ * Args: Pointer to filter head, pointer to senblk to be tested
+ * Returns: 1 if  senblk should be passed, 0 if not
+ * Only called from the engine thread.  Each bus has its own copy of the
+ * failover rules
+ */
+int isactive(sfilter_t *filter,senblk_t *sptr)
+{
+    unsigned int idx;
+    sf_rule_t *rule;
+    struct srclist *rptr,*tptr;
+    int64_t now,last;
+
+    if (filter == NULL || sptr == NULL)
         return(1);
-    for (last=0,rptr=rule->info.source;rptr;rptr=rptr->next) {
-        if (rptr->src.id == src) {
-            rptr->lasttime = now;
-            if (last+rptr->failtime < now)
-                return(1);
-            else
-                return(0);
-        }
-        if (rptr->lasttime > last)
-            last = rptr->lasttime;
-    }
-    return(0);
+
+    if ((rule=failover_rule(filter,sptr)) == NULL)
+        return(1);
+
+    idx = (unsigned int) (sptr->src >> IDMINORBITS);
+    if (idx >= rule->nsrcs || (rptr=rule->srcindex[idx]) == NULL)
+        return(0);
+
+    now=msclock();
+    rptr->lasttime = now;
+
+    /* Sources are ordered by failover time.  This one is active if no
+     * preceding source has been heard from within its failover time */
+    for (last=0,tptr=rule->info.source;tptr!=rptr;tptr=tptr->next)
+        if (tptr->lasttime > last)
+            last = tptr->lasttime;
+
+    return(last+rptr->failtime < now);
 }
 /*
  *  Add a failover specification
@@ -265,12 +439,14 @@ int addfailover(sfilter_t **head,char *spec)
     struct srclist *src;
     char *cptr,*nptr;
     int n,done;
-    time_t now;
+    int64_t now,scale;
 
     if ((newrule=(sf_rule_t *)malloc(sizeof(sf_rule_t))) == NULL) {
         return(-1);
     }
     newrule->info.source=NULL;
+    newrule->srcindex=NULL;
+    newrule->nsrcs=0;
 
     for (errno=0,cptr=spec,n=0;n<5;spec++,n++,cptr++) {
         if (!*cptr || *cptr== ':') {
@@ -284,13 +460,20 @@ int addfailover(sfilter_t **head,char *spec)
         free(newrule);
         return(-1);
     }
-    for (now=time(NULL),done=0;!done && *cptr;src=NULL,cptr++) {
+    for (now=msclock(),done=0;!done && *cptr;src=NULL,cptr++) {
         if ((src=(struct srclist *)malloc(sizeof(struct srclist))) == NULL) {
             free(newrule);
             return(-1);
         }
+        /* Failover time is in seconds with up to 3 decimal places */
         for(src->failtime=0;*cptr && *cptr >= '0' && *cptr <= '9';cptr++)
             src->failtime=src->failtime*10+(*cptr - '0');
+        src->failtime*=1000;
+        if (*cptr == '.')
+            for(scale=100,cptr++;*cptr && *cptr >= '0' && *cptr <= '9';cptr++) {
+                src->failtime+=scale*(*cptr - '0');
+                scale/=10;
+            }
 
         if (*cptr++ != ':')
             break;
@@ -318,6 +501,11 @@ int addfailover(sfilter_t **head,char *spec)
                 (*head)->refcount=1;
                 pthread_mutex_init(&(*head)->lock,NULL);
                 (*head)->rules=NULL;
+                if (((*head)->cache=(struct failcache *)calloc(FAILCACHESLOTS,
+                        sizeof(struct failcache))) == NULL) {
+                    free(*head);
+                    *head=NULL;
+                }
             }
         }
         if (*head) {
@@ -333,6 +521,66 @@ int addfailover(sfilter_t **head,char *spec)
     return(-1);
 }
 
+/*
+ * Copy a failover filter
+ * Args: Pointer to failover filter (before interface names are translated to
+ * ids)
+ * Returns: Pointer to the copy, or NULL if there is nothing to copy or on
+ * error
+ * Used to give the engine of each bus its own failover state
+ */
+static sfilter_t *copy_failover(sfilter_t *filter)
+{
+    sfilter_t *newf;
+    sf_rule_t *rptr,*nrule,**rtail;
+    struct srclist *sptr,*nsrc,**stail;
+
+    if (filter == NULL)
+        return(NULL);
+
+    if ((newf=(sfilter_t *)malloc(sizeof(sfilter_t))) == NULL)
+        return(NULL);
+    newf->type=FAILOVER;
+    newf->refcount=1;
+    pthread_mutex_init(&newf->lock,NULL);
+    newf->rules=NULL;
+    if ((newf->cache=(struct failcache *)calloc(FAILCACHESLOTS,
+            sizeof(struct failcache))) == NULL) {
+        free(newf);
+        return(NULL);
+    }
+
+    for (rtail=&newf->rules,rptr=filter->rules;rptr;rptr=rptr->next) {
+        if ((nrule=(sf_rule_t *)malloc(sizeof(sf_rule_t))) == NULL) {
+            free_filter(newf);
+            return(NULL);
+        }
+        memcpy(nrule->match,rptr->match,sizeof(nrule->match));
+        nrule->info.source=NULL;
+        nrule->srcindex=NULL;
+        nrule->nsrcs=0;
+        nrule->next=NULL;
+        *rtail=nrule;
+        rtail=&nrule->next;
+
+        for (stail=&nrule->info.source,sptr=rptr->info.source;sptr;
+                sptr=sptr->next) {
+            if ((nsrc=(struct srclist *)malloc(sizeof(struct srclist)))
+                    == NULL || (nsrc->src.name=strdup(sptr->src.name)) == NULL) {
+                if (nsrc)
+                    free(nsrc);
+                free_filter(newf);
+                return(NULL);
+            }
+            nsrc->failtime=sptr->failtime;
+            nsrc->lasttime=sptr->lasttime;
+            nsrc->next=NULL;
+            *stail=nsrc;
+            stail=&nsrc->next;
+        }
+    }
+    return(newf);
+}
 
 /*
  * Exit function used by interface handlers.  Interface objects are cleaned
@@ -380,10 +628,28 @@ int init_q(iface_t *ifa, size_t size)
     sptr->next = NULL;
 
     newq->qhead = newq->qtail = NULL;
+    newq->size=size+1;
     newq->owner=ifa;
+    newq->drops=0;
+    newq->norphans=newq->orphanidx=0;
+    memset(newq->orphans,0,sizeof(newq->orphans));
+
+    if (ifa->decimation) {
+        if ((newq->decimate=(struct decimator *)
+                calloc(1,sizeof(struct decimator))) == NULL) {
+            free(newq->base);
+            free(newq);
+            return(-1);
+        }
+        newq->decimate->period=ifa->decimation;
+    } else
+        newq->decimate=NULL;
+    newq->spill=NULL;
 
     pthread_mutex_init(&newq->q_mutex,NULL);
     pthread_cond_init(&newq->freshmeat,NULL);
+    pthread_cond_init(&newq->roomfree,NULL);
+    newq->waiting=0;
 
     newq->active=1;
     ifa->q=newq;
@@ -399,185 +665,1520 @@ senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
 {
     dptr->len=sptr->len;
     dptr->src=sptr->src;
+    dptr->ts=sptr->ts;
+    dptr->seq=sptr->seq;
     dptr->next=NULL;
+
+    /* Encoded data held by a reused senblk is released here rather than
+     * when the senblk is returned to its free list */
+    if (dptr->enc)
+        encbuf_release(dptr->enc);
+    if ((dptr->enc=sptr->enc) != NULL)
+        (void) __sync_add_and_fetch(&dptr->enc->refs,1);
     return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
             sptr->len);
 }
 
 /*
- * Add an senblk to an ioqueue
- * Args: Pointer to senblk and Pointer to queue it is to be added to
- * Returns: None
+ * Drop a reference to an encoded sentence, freeing it if no longer used
+ * Args: pointer to encoded sentence
+ * Returns: Nothing
  */
-void push_senblk(senblk_t *sptr, ioqueue_t *q)
+void encbuf_release(struct encbuf *eptr)
 {
-    senblk_t *tptr;
+    if (__sync_sub_and_fetch(&eptr->refs,1) == 0)
+        free(eptr);
+}
 
-    pthread_mutex_lock(&q->q_mutex);
+/*
+ * Check whether a senblk is one fragment of a multi-fragment AIS message
+ * Args: pointer to senblk, pointers to fragment count, fragment number and
+ * sequential message id to be filled in
+ * Returns: 1 if senblk is a fragment of a multi-fragment message, 0 otherwise
+ */
+static int ais_fragment(senblk_t *sptr, size_t *nfrags, size_t *frag,
+        unsigned int *seq)
+{
+    if (*sptr->data != '!')
+        return(0);
+    return(is_ais(sptr->data,sptr->len,nfrags,frag,seq) && *nfrags > 1);
+}
 
-    if (sptr == NULL) {
-        /* NULL senblk pointer is magic "off" switch for a queue */
-        q->active = 0;
-    } else {
-        /* Get a senblk from the queue's free list if possible...*/
-        if (q->free) {
-            tptr=q->free;
-            q->free=q->free->next;
-        } else {
-            /* ...if not steal from the head of the queue, dropping previous
-               contents. */
-            tptr=q->qhead;
-            q->qhead=q->qhead->next;
-            if (q->drops < 0)
-                q->drops++;
-            DEBUG(4,"Dropped senblk q=0x%x",q);
+/*
+ * Check whether a senblk belongs to an AIS message which has already had
+ * fragments dropped from a queue
+ * Args: Pointer to senblk and pointer to queue (q_mutex held)
+ * Returns: 1 if the senblk should be dropped, 0 otherwise
+ * Side Effects: orphan record is updated, and removed once its last fragment
+ * has been seen
+ */
+static int is_orphan(senblk_t *sptr, ioqueue_t *q)
+{
+    struct aisorphan *optr;
+    size_t nfrags,frag;
+    unsigned int seq;
+    int i;
+
+    if (!ais_fragment(sptr,&nfrags,&frag,&seq))
+        return(0);
+
+    for (i=0,optr=q->orphans;i<AISORPHANS;i++,optr++) {
+        if (optr->nfrags != nfrags || optr->src != sptr->src ||
+                optr->seq != seq)
+            continue;
+        if (frag <= optr->frag) {
+            /* Start of a new message re-using the sequence id */
+            optr->nfrags=0;
+            q->norphans--;
+            return(0);
         }
-    
-        (void) senblk_copy(tptr,sptr);
-    
-        /* If there is anything on the queue already, set it's "next" member
-           to point to the new senblk */
-        if (q->qtail)
-            q->qtail->next=tptr;
-    
-        /* Set tail pointer to the new senblk */
-        q->qtail=tptr;
-    
-        /* queue head needs to point to new senblk if there was nothing
-           previously on the queue */
-        if (q->qhead == NULL)
-            q->qhead=tptr;
-    
+        if ((optr->frag=frag) == nfrags) {
+            optr->nfrags=0;
+            q->norphans--;
+        }
+        DEBUG(4,"Dropped orphaned AIS fragment q=0x%x",q);
+        return(1);
     }
-    pthread_cond_broadcast(&q->freshmeat);
-    pthread_mutex_unlock(&q->q_mutex);
+    return(0);
 }
 
 /*
- *  Get the next senblk from the head of a queue
- *  Args: Queue to retrieve from
- *  Returns: Pointer to next senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
+ * Remove the oldest senblk from a full queue to make room for a new one.
+ * Remaining fragments of an AIS message whose first fragment has already
+ * been dequeued are passed over so that the message can be completed.  If
+ * the senblk removed is a fragment of a multi-fragment AIS message, the rest
+ * of that message is removed from the queue too and any fragments yet to
+ * arrive are remembered so they can be discarded
+ * Args: Pointer to queue (q_mutex held)
+ * Returns: Pointer to the senblk removed from the queue
  */
-senblk_t *next_senblk(ioqueue_t *q)
+static senblk_t *drop_head(ioqueue_t *q)
 {
-    senblk_t *tptr;
+    senblk_t *tptr,*nptr,*prev,*last,**pptr;
+    struct aisorphan *optr;
+    size_t nfrags,frag,n,f;
+    unsigned int seq,s;
+    int i;
 
-    pthread_mutex_lock(&q->q_mutex);
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
+    prev=NULL;
+    if (ais_fragment(q->qhead,&nfrags,&frag,&seq) && frag > 1) {
+        /* Skip the tail of a message which is already being sent */
+        for (tptr=q->qhead;tptr;prev=tptr,tptr=tptr->next)
+            if (!(tptr->src == q->qhead->src && ais_fragment(tptr,&n,&f,&s) &&
+                    s == seq && n == nfrags && f > 1))
+                break;
+        if (tptr == NULL)
+            prev=NULL;
+    }
+
+    if (prev) {
+        tptr=prev->next;
+        if ((prev->next=tptr->next) == NULL)
+            q->qtail=prev;
+    } else {
+        tptr=q->qhead;
+        if ((q->qhead=tptr->next) == NULL)
+            q->qtail=NULL;
+    }
+    if (q->drops < 0)
+        q->drops++;
+    DEBUG(4,"Dropped senblk q=0x%x",q);
+
+    if (!ais_fragment(tptr,&nfrags,&frag,&seq))
+        return(tptr);
+
+    /* Return the rest of the message to the free list */
+    for (last=NULL,pptr=&q->qhead;(nptr=*pptr);) {
+        if (nptr->src == tptr->src && ais_fragment(nptr,&n,&f,&s) &&
+                s == seq && n == nfrags && f > frag) {
+            *pptr=nptr->next;
+            nptr->next=q->free;
+            q->free=nptr;
+            frag=f;
+            DEBUG(4,"Dropped AIS fragment %u/%u q=0x%x",(unsigned) f,
+                    (unsigned) n,q);
+        } else {
+            last=nptr;
+            pptr=&nptr->next;
         }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
     }
+    q->qtail=last;
 
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
+    if (frag == nfrags)
+        return(tptr);
+
+    /* Some of the message is still to come. Use a free orphan slot if there
+     * is one, otherwise recycle the oldest */
+    for (i=0,optr=q->orphans;i<AISORPHANS;i++,optr++)
+        if (optr->nfrags == 0)
+            break;
+    if (i == AISORPHANS) {
+        optr=q->orphans+q->orphanidx;
+        q->orphanidx=(q->orphanidx+1)%AISORPHANS;
+    } else
+        q->norphans++;
+
+    optr->src=tptr->src;
+    optr->seq=seq;
+    optr->nfrags=nfrags;
+    optr->frag=frag;
     return(tptr);
 }
 
 /*
- *  Get the last senblk from a queue, discarding all before it
- *  Args: Queue to retrieve from
- *  Returns: Pointer to last senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
+ * Spill file writer thread: write staged sentences to the file and empty it
+ * when asked
+ * Args: Queue (cast to void *)
+ * Returns: NULL when told to stop, having written anything still staged
+ * The spill is only locked while taking staged sentences and updating the
+ * file's state afterwards, not while writing
  */
-senblk_t *last_senblk(ioqueue_t *q)
+static void *spill_writer(void *arg)
 {
-    senblk_t *tptr,*nptr;
+    ioqueue_t *q = (ioqueue_t *) arg;
+    struct spill *sp = q->spill;
+    unsigned char hdr[SPILLSTAGE][SPILLHDRLEN];
+    struct iovec iov[SPILLSTAGE*2];
+    senblk_t *sptr;
+    size_t i,n,first;
+    ssize_t len;
 
-    pthread_mutex_lock(&q->q_mutex);
-    /* Move all but last senblk on the queue to the free list */
-    if ((tptr=q->qhead) != NULL) {
-        for (nptr=tptr->next;nptr;tptr=nptr,nptr=nptr->next) {
-            tptr->next=q->free;
-            q->free=tptr;
+    pthread_mutex_lock(&sp->mutex);
+    for (;;) {
+        while (!sp->stop && !sp->nstaged && !sp->trunc)
+            pthread_cond_wait(&sp->cond,&sp->mutex);
+
+        if (sp->trunc) {
+            /* Everything in the file has been sent.  Nothing is written to
+             * it but by this thread and nothing is read once it is all sent
+             * so the lock need not be held */
+            sp->trunc=0;
+            if (sp->wr > SPILLMAGICLEN && sp->rd >= sp->wr) {
+                pthread_mutex_unlock(&sp->mutex);
+                if (ftruncate(sp->fd,SPILLMAGICLEN) < 0)
+                    logerr(errno,"Failed to truncate spill file");
+                pthread_mutex_lock(&sp->mutex);
+                sp->rd=sp->wr=SPILLMAGICLEN;
+            }
+            continue;
         }
-        q->qhead=tptr;
-    }
 
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
+        if (sp->nstaged == 0)
+            break;
+
+        first=sp->first;
+        sp->writing=n=sp->nstaged;
+        pthread_mutex_unlock(&sp->mutex);
+
+        for (len=0,i=0;i<n;i++) {
+            sptr=&sp->stage[(first+i)%SPILLSTAGE];
+            put_le64(hdr[i],(uint64_t) sptr->src);
+            put_le32(hdr[i]+8,(uint32_t) sptr->len);
+            put_le64(hdr[i]+12,(uint64_t) sptr->ts);
+            put_le64(hdr[i]+20,sptr->seq);
+            iov[i*2].iov_base=hdr[i];
+            iov[i*2].iov_len=SPILLHDRLEN;
+            iov[i*2+1].iov_base=sptr->data;
+            iov[i*2+1].iov_len=sptr->len;
+            len+=SPILLHDRLEN+sptr->len;
+        }
+        if (writev(sp->fd,iov,n*2) != len) {
+            logerr(errno,"Failed to write to spill file: %lu sentences lost",
+                    (unsigned long) n);
+            /* Don't leave part of a record behind.  Only this thread changes
+             * wr */
+            if (ftruncate(sp->fd,sp->wr) < 0)
+                logerr(errno,"Failed to truncate spill file");
+            len=-len;
         }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
-    }
 
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
+        pthread_mutex_lock(&sp->mutex);
+        if (len > 0)
+            sp->wr+=len;
+        sp->staged-=(len > 0)?len:-len;
+        sp->first=(first+n)%SPILLSTAGE;
+        sp->nstaged-=n;
+        sp->writing=0;
+        /* The output may be waiting for these to reach the file */
+        pthread_cond_broadcast(&sp->written);
+    }
+    pthread_mutex_unlock(&sp->mutex);
+    return(NULL);
 }
 
 /*
- * Flush a queue, returning anything on it to the free list
- * Args: Queue to be flushed
- * Returns: Nothing
- * Side Effect: Returns anything on the queue to the free list
+ * Check the magic at the start of a spill file, writing it to an empty file
+ * Args: Spill file descriptor (opened for appending), name of spill file
+ * Returns: Length of the file or -1 on error
+ * Side effects: A file from another version of kplex is emptied
  */
-void flush_queue(ioqueue_t *q)
+static off_t spill_open(int fd, char *name)
 {
-    pthread_mutex_lock(&q->q_mutex);
-    if (q->qhead != NULL) {
-        q->qtail->next = q->free;
-        q->free=q->qhead;
-        q->qhead=q->qtail=NULL;
+    unsigned char magic[SPILLMAGICLEN];
+    off_t len;
+
+    if ((len=lseek(fd,0,SEEK_END)) < 0)
+        return(-1);
+    if (len && (pread(fd,magic,SPILLMAGICLEN,0) != SPILLMAGICLEN ||
+            memcmp(magic,SPILLMAGIC,SPILLMAGICLEN-1) ||
+            magic[SPILLMAGICLEN-1] != SPILLVERSION)) {
+        logwarn("Discarding %s: not a spill file from this version of kplex",
+                name);
+        if (ftruncate(fd,0) < 0)
+            return(-1);
+        len=0;
     }
-    pthread_mutex_unlock(&q->q_mutex);
+    if (len == 0) {
+        memcpy(magic,SPILLMAGIC,SPILLMAGICLEN-1);
+        magic[SPILLMAGICLEN-1]=SPILLVERSION;
+        if (write(fd,magic,SPILLMAGICLEN) != SPILLMAGICLEN)
+            return(-1);
+        len=SPILLMAGICLEN;
+    }
+    return(len);
 }
 
 /*
- * Return a senblk to a queue's free list
- * Args: pointer to senblk, and pointer to the queue whose free list it is to
- * be added to
- * Returns: Nothing
+ * Attach a spill file to a queue
+ * Args: Queue, name of spill file, maximum size of spill file, maximum
+ * rate (sentences per second) at which to send spilled sentences (0 for no
+ * limit)
+ * Returns: 0 on success, -1 on error
+ * Sentences already in the file (from before a restart) are sent first.  A
+ * file without the current magic and version is emptied
  */
-void senblk_free(senblk_t *sptr, ioqueue_t *q)
+int init_spill(ioqueue_t *q, char *name, off_t max, int rate)
 {
-    pthread_mutex_lock(&q->q_mutex);
-    /* Adding to head of free list is quicker than tail */
-    sptr->next = q->free;
-    q->free=sptr;
-    pthread_mutex_unlock(&q->q_mutex);
-}
+    struct spill *sp;
+    sigset_t set,saved;
+    int i,err;
 
-iface_t *get_default_global()
-{
-    iface_t *ifp;
+    if ((sp=(struct spill *) malloc(sizeof(struct spill))) == NULL)
+        return(-1);
+    if ((sp->fd=open(name,O_RDWR|O_CREAT|O_APPEND,0644)) < 0) {
+        free(sp);
+        return(-1);
+    }
+    if ((sp->wr=spill_open(sp->fd,name)) < 0) {
+        err=errno;
+        close(sp->fd);
+        free(sp);
+        errno=err;
+        return(-1);
+    }
+    sp->rd=SPILLMAGICLEN;
+    sp->max=max;
+    sp->interval=rate?1000/rate:0;
+    sp->due=0;
+    sp->reclen=0;
+    sp->out=0;
+    sp->sblk.enc=NULL;
+    sp->sblk.next=NULL;
+    for (i=0;i<SPILLSTAGE;i++)
+        sp->stage[i].enc=NULL;
+    sp->first=sp->nstaged=sp->writing=0;
+    sp->staged=0;
+    sp->trunc=sp->stop=0;
+    pthread_mutex_init(&sp->mutex,NULL);
+    pthread_cond_init(&sp->cond,NULL);
+    pthread_cond_init(&sp->written,NULL);
+    q->spill=sp;
+
+    /* Signals are for interface threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK,&set,&saved);
+    err=pthread_create(&sp->tid,NULL,spill_writer,(void *) q);
+    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    if (err) {
+        q->spill=NULL;
+        pthread_cond_destroy(&sp->cond);
+        pthread_cond_destroy(&sp->written);
+        pthread_mutex_destroy(&sp->mutex);
+        close(sp->fd);
+        free(sp);
+        errno=err;
+        return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Stop a queue's spill file writer and free the spill file's data
+ * Args: Queue
+ * Returns: Nothing
+ * Anything still staged is written before the writer exits so it is sent
+ * after a restart.  Called from the output's thread-exit path, when it may
+ * hold the queue's q_mutex, so only the spill's own lock is taken
+ */
+static void free_spill(ioqueue_t *q)
+{
+    struct spill *sp=q->spill;
+    int i;
+
+    pthread_mutex_lock(&sp->mutex);
+    sp->stop=1;
+    pthread_cond_signal(&sp->cond);
+    pthread_mutex_unlock(&sp->mutex);
+    pthread_join(sp->tid,NULL);
+
+    close(sp->fd);
+    for (i=0;i<SPILLSTAGE;i++)
+        if (sp->stage[i].enc)
+            encbuf_release(sp->stage[i].enc);
+    if (sp->sblk.enc)
+        encbuf_release(sp->sblk.enc);
+    pthread_cond_destroy(&sp->cond);
+    pthread_cond_destroy(&sp->written);
+    pthread_mutex_destroy(&sp->mutex);
+    free(sp);
+    q->spill=NULL;
+}
+
+/*
+ * Stage a senblk to be appended to a queue's spill file
+ * Args: Pointer to senblk, spill file (q_mutex held)
+ * Returns: 0 on success, -1 if the file or the staging area is full
+ */
+static int spill(senblk_t *sptr, struct spill *sp)
+{
+    off_t len=SPILLHDRLEN+sptr->len;
+    int ret=-1;
+
+    pthread_mutex_lock(&sp->mutex);
+    if (sp->nstaged < SPILLSTAGE && sp->wr + sp->staged + len <= sp->max) {
+        (void) senblk_copy(&sp->stage[(sp->first+sp->nstaged)%SPILLSTAGE],
+                sptr);
+        sp->nstaged++;
+        sp->staged+=len;
+        pthread_cond_signal(&sp->cond);
+        ret=0;
+    }
+    pthread_mutex_unlock(&sp->mutex);
+    return(ret);
+}
+
+/*
+ * Check whether a queue has spilled sentences still to be sent
+ * Args: Queue (q_mutex held)
+ * Returns: 1 if there are, 0 if not
+ */
+static int spilled(ioqueue_t *q)
+{
+    int ret;
+
+    pthread_mutex_lock(&q->spill->mutex);
+    ret=(q->spill->rd < q->spill->wr || q->spill->nstaged);
+    pthread_mutex_unlock(&q->spill->mutex);
+    return(ret);
+}
+
+/*
+ * Get the oldest spilled sentence for a queue
+ * Args: Queue
+ * Returns: Pointer to senblk holding the sentence or NULL if there are none
+ * Sentences in the file are older than those staged to be written to it,
+ * which are taken directly from the staging area once the file has been
+ * sent.  A sentence is only removed from the file when the senblk is freed,
+ * and is not returned again until then.  Spilled sentences are returned no
+ * faster than the spill rate
+ */
+static senblk_t *unspill(ioqueue_t *q)
+{
+    struct spill *sp=q->spill;
+    unsigned char hdr[SPILLHDRLEN];
+    senblk_t *sptr;
+    int64_t now;
+    uint32_t len;
+    off_t rd;
+
+    pthread_mutex_lock(&sp->mutex);
+    /* Sentences being written are older than any still staged.  Writes
+     * finish without waiting for anything else so there's no need to watch
+     * for the queue being shut down meanwhile */
+    while (!sp->out && sp->rd >= sp->wr && sp->writing)
+        pthread_cond_wait(&sp->written,&sp->mutex);
+    if (!q->active || sp->out || (sp->rd >= sp->wr && !sp->nstaged)) {
+        pthread_mutex_unlock(&sp->mutex);
+        return(NULL);
+    }
+    sp->out=1;
+
+    if (sp->rd >= sp->wr) {
+        sptr=&sp->stage[sp->first];
+        (void) senblk_copy(&sp->sblk,sptr);
+        sp->first=(sp->first+1)%SPILLSTAGE;
+        sp->nstaged--;
+        sp->staged-=SPILLHDRLEN+sptr->len;
+        sp->reclen=0;
+        pthread_mutex_unlock(&sp->mutex);
+    } else {
+        /* Only this thread reads the file and nothing before wr changes
+         * until the sentence is freed, so it is read without the lock */
+        rd=sp->rd;
+        pthread_mutex_unlock(&sp->mutex);
+        if (pread(sp->fd,hdr,SPILLHDRLEN,rd) != SPILLHDRLEN ||
+                (len=get_le32(hdr+8)) > SENBUFSZ ||
+                pread(sp->fd,sp->sblk.data,len,rd+SPILLHDRLEN) != len) {
+            /* Truncated or corrupt: discard the rest */
+            logwarn("Discarding unreadable spilled data");
+            pthread_mutex_lock(&sp->mutex);
+            sp->rd=sp->wr;
+            sp->trunc=1;
+            sp->out=0;
+            pthread_cond_signal(&sp->cond);
+            pthread_mutex_unlock(&sp->mutex);
+            return(NULL);
+        }
+        if (sp->sblk.enc) {
+            encbuf_release(sp->sblk.enc);
+            sp->sblk.enc=NULL;
+        }
+        sp->sblk.src=(srcid_t) get_le64(hdr);
+        sp->sblk.len=len;
+        sp->sblk.ts=(int64_t) get_le64(hdr+12);
+        sp->sblk.seq=get_le64(hdr+20);
+        sp->reclen=SPILLHDRLEN+len;
+    }
+
+    if (sp->interval) {
+        if ((now=msclock()) < sp->due)
+            usleep((sp->due-now)*1000);
+        else
+            sp->due=now;
+        sp->due+=sp->interval;
+    }
+    return(&sp->sblk);
+}
+
+/*
+ * Append a copy of an senblk to the tail of a queue
+ * Args: Pointer to senblk and pointer to queue (q_mutex held)
+ * Returns: None
+ * Side Effects: If the queue is full, the oldest senblk is dropped
+ */
+static void enqueue(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    /* Get a senblk from the queue's free list if possible...*/
+    if (q->free) {
+        tptr=q->free;
+        q->free=q->free->next;
+    } else if (q->spill && q->qhead && spill(q->qhead,q->spill) == 0) {
+        /* ...if not stage the head of the queue for the spill file... */
+        tptr=q->qhead;
+        if ((q->qhead=tptr->next) == NULL)
+            q->qtail=NULL;
+    } else {
+        /* ...or steal from the head of the queue, dropping previous
+           contents along with the rest of any AIS message it was part
+           of */
+        tptr=drop_head(q);
+    }
+
+    (void) senblk_copy(tptr,sptr);
+
+    /* If there is anything on the queue already, set it's "next" member
+       to point to the new senblk */
+    if (q->qtail)
+        q->qtail->next=tptr;
+
+    /* Set tail pointer to the new senblk */
+    q->qtail=tptr;
+
+    /* queue head needs to point to new senblk if there was nothing
+       previously on the queue */
+    if (q->qhead == NULL)
+        q->qhead=tptr;
+}
+
+/*
+ * Find the sentence number of a sentence which is part of a multi-sentence
+ * group (GSV, RTE, TXT or ALM, whose first two fields are the number of
+ * sentences in the group and the sentence number)
+ * Args: Pointer to senblk, pointer to where to store the group size
+ * Returns: Sentence number (from 1), or 0 if not part of a valid group
+ */
+static int group_part(senblk_t *sptr, int *total)
+{
+    static const char *grouptypes[] = { "GSV", "RTE", "TXT", "ALM", NULL };
+    const char *type;
+    char *ptr,*eptr;
+    int i,n[2];
+
+    for (i=0;(type=grouptypes[i]) != NULL;i++)
+        if (!strncmp(sptr->data+3,type,3))
+            break;
+    if (type == NULL || sptr->data[6] != ',')
+        return(0);
+
+    ptr=sptr->data+7;
+    eptr=sptr->data+sptr->len;
+    for (i=0;i<2;i++) {
+        for (n[i]=0;ptr < eptr && *ptr >= '0' && *ptr <= '9' && n[i] < 1000;
+                ptr++)
+            n[i]=n[i]*10 + *ptr - '0';
+        if (ptr == eptr || *ptr++ != ',')
+            return(0);
+    }
+
+    if (n[0] == 0 || n[1] == 0 || n[1] > n[0])
+        return(0);
+    *total=n[0];
+    return(n[1]);
+}
+
+/*
+ * Find a decimating queue's slot for a sentence type, sentence number and
+ * state, optionally adding it if it does not exist
+ * Args: Pointer to decimator, sentence, sentence number, pending flag,
+ * whether to add a new slot
+ * Returns: Slot index or -1 if not found (or the table is full)
+ */
+static int find_slot(struct decimator *dptr, const char *data, int part,
+        int pending, int add)
+{
+    int i;
+
+    for (i=0;i<dptr->ntypes;i++)
+        if (dptr->part[i] == part && dptr->pending[i] == pending &&
+                !memcmp(dptr->latest[i].data,data,6))
+            return(i);
+
+    if (!add || i == DECIMATETYPES)
+        return(-1);
+
+    dptr->ntypes++;
+    dptr->part[i]=part;
+    dptr->pending[i]=pending;
+    return(i);
+}
+
+/*
+ * Hold back a sentence on a decimating queue, replacing any sentence of the
+ * same type not yet released
+ * Args: Pointer to senblk and pointer to queue (q_mutex held)
+ * Returns: 1 if the sentence has been held (or discarded), 0 if it should be
+ * queued as normal
+ * AIS and other encapsulated sentences are never held, nor are sentences
+ * when the table of sentence types is full.  Sentences of multi-sentence
+ * groups are collected until the group is complete, which then replaces the
+ * whole of the previous group so that sentences from different groups are
+ * never mixed.  Sentences from incomplete groups are discarded
+ */
+static int decimate(senblk_t *sptr, ioqueue_t *q)
+{
+    struct decimator *dptr = q->decimate;
+    int i,part,total;
+
+    if (*sptr->data != '$' || sptr->len < 7)
+        return(0);
+
+    if ((part=group_part(sptr,&total)) == 0) {
+        if ((i=find_slot(dptr,sptr->data,0,0,1)) < 0)
+            return(0);
+        (void) senblk_copy(&dptr->latest[i],sptr);
+        return(1);
+    }
+
+    /* A first sentence starts a new group: forget any partial one */
+    if (part == 1) {
+        for (i=0;i<dptr->ntypes;i++)
+            if (dptr->pending[i] && !memcmp(dptr->latest[i].data,sptr->data,6))
+                dptr->latest[i].len=0;
+    } else if ((i=find_slot(dptr,sptr->data,part-1,1,0)) < 0 ||
+            dptr->latest[i].len == 0)
+        return(1);
+
+    if ((i=find_slot(dptr,sptr->data,part,1,1)) < 0)
+        return(0);
+    (void) senblk_copy(&dptr->latest[i],sptr);
+
+    if (part < total)
+        return(1);
+
+    /* Group complete: it becomes the one to be released and the slots of
+     * the one it replaces are free for the next */
+    for (i=0;i<dptr->ntypes;i++) {
+        if (dptr->part[i] == 0 || memcmp(dptr->latest[i].data,sptr->data,6))
+            continue;
+        if (dptr->pending[i] && dptr->latest[i].len)
+            dptr->pending[i]=0;
+        else if (!dptr->pending[i]) {
+            dptr->pending[i]=1;
+            dptr->latest[i].len=0;
+        }
+    }
+    return(1);
+}
+
+/*
+ * Release held sentences on a decimating queue if the current period is over
+ * Args: Pointer to queue (q_mutex held)
+ * Returns: None
+ * Side Effects: The latest sentence of each type (or latest complete group
+ * of multi-sentence types) received during the period is added to the queue
+ * and the deadline for the next period is set
+ */
+static void release_decimated(ioqueue_t *q)
+{
+    struct decimator *dptr = q->decimate;
+    struct timeval tv;
+    int64_t now,due;
+    int i,j,part;
+
+    gettimeofday(&tv,NULL);
+    now = (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    due = (int64_t) dptr->due.tv_sec * 1000 + dptr->due.tv_nsec / 1000000;
+
+    if (now < due && due - now <= dptr->period)
+        return;
+
+    for (i=0;i<dptr->ntypes;i++) {
+        if (dptr->latest[i].len == 0 || dptr->pending[i] || dptr->part[i] > 1)
+            continue;
+        if (dptr->part[i] == 0) {
+            enqueue(&dptr->latest[i],q);
+            dptr->latest[i].len=0;
+            continue;
+        }
+        /* Send a multi-sentence group in order when we get to its first
+         * sentence */
+        for (part=1;(j=find_slot(dptr,dptr->latest[i].data,part,0,0)) >= 0 &&
+                dptr->latest[j].len;part++) {
+            enqueue(&dptr->latest[j],q);
+            dptr->latest[j].len=0;
+        }
+    }
+
+    /* Keep to a fixed cadence unless we have fallen behind by more than a
+     * period or the clock has been changed */
+    if (now - due < dptr->period && due <= now)
+        due += dptr->period;
+    else
+        due = now + dptr->period;
+
+    dptr->due.tv_sec = due / 1000;
+    dptr->due.tv_nsec = (due % 1000) * 1000000;
+}
+
+/*
+ * Add an senblk to an ioqueue
+ * Args: Pointer to senblk and pointer to queue (q_mutex held)
+ * Returns: None
+ */
+static void queue_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    if (sptr == NULL) {
+        /* NULL senblk pointer is magic "off" switch for a queue */
+        q->active = 0;
+        if (q->waiting)
+            pthread_cond_broadcast(&q->roomfree);
+    } else if (!(q->norphans && is_orphan(sptr,q)) &&
+            !(q->decimate && decimate(sptr,q))) {
+        enqueue(sptr,q);
+    }
+    pthread_cond_broadcast(&q->freshmeat);
+}
+
+/*
+ * Add an senblk to an ioqueue
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ */
+void push_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    pthread_mutex_lock(&q->q_mutex);
+    queue_senblk(sptr,q);
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Add an senblk to an ioqueue, waiting for a free senblk rather than dropping
+ * the oldest one if the queue is full
+ * Args: Pointer to senblk and pointer to queue it is to be added to
+ * Returns: None
+ * Used by inputs which aren't live (files) so they are paced by the engine.
+ * SIGUSR1 is blocked whilst waiting so the thread isn't terminated holding
+ * q_mutex: if one arrives the senblk is queued as usual and the signal is
+ * taken once the mutex has been released
+ */
+static void push_senblk_wait(senblk_t *sptr, ioqueue_t *q)
+{
+    sigset_t set,saved,pending;
+    struct timespec due;
+    int blocked=0;
+
+    pthread_mutex_lock(&q->q_mutex);
+    if (!q->free && !q->spill && q->active) {
+        sigemptyset(&set);
+        sigaddset(&set,SIGUSR1);
+        pthread_sigmask(SIG_BLOCK,&set,&saved);
+        blocked=1;
+        q->waiting++;
+        while (!q->free && q->active) {
+            clock_gettime(CLOCK_REALTIME,&due);
+            if ((due.tv_nsec+=ROOMCHECK*1000000) >= 1000000000) {
+                due.tv_sec++;
+                due.tv_nsec-=1000000000;
+            }
+            pthread_cond_timedwait(&q->roomfree,&q->q_mutex,&due);
+            if (sigpending(&pending) == 0 && sigismember(&pending,SIGUSR1))
+                break;
+        }
+        q->waiting--;
+    }
+    queue_senblk(sptr,q);
+    pthread_mutex_unlock(&q->q_mutex);
+    if (blocked)
+        pthread_sigmask(SIG_SETMASK,&saved,NULL);
+}
+
+/*
+ *  Get the next senblk from the head of a queue
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to next senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ */
+senblk_t *next_senblk(ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    /* Spilled sentences are older than anything on the queue */
+    if (q->spill && (tptr=unspill(q)) != NULL)
+        return(tptr);
+
+    pthread_mutex_lock(&q->q_mutex);
+    if (q->decimate)
+        release_decimated(q);
+    while ((tptr = q->qhead) == NULL) {
+        /* No data available for reading */
+        if (!q->active) {
+            /* Return NULL if the queue has been shut down */
+            pthread_mutex_unlock(&q->q_mutex);
+            return ((senblk_t *)NULL);
+        }
+        /* Wait until something is available or (for decimating queues)
+         * until the end of the current period */
+        if (q->decimate) {
+            pthread_cond_timedwait(&q->freshmeat,&q->q_mutex,&q->decimate->due);
+            release_decimated(q);
+        } else
+            pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    }
+
+    /* set qhead to next element (which may be NULL)
+       If the last element in the queue, set the tail pointer to NULL too */
+    if ((q->qhead=tptr->next) == NULL)
+        q->qtail=NULL;
+    pthread_mutex_unlock(&q->q_mutex);
+    return(tptr);
+}
+
+/*
+ *  Get the next senblk from the head of a queue, waiting no longer than a
+ *  given time
+ *  Args: Queue to retrieve from, maximum time to wait in ms, pointer to flag
+ *  set if the time ran out
+ *  Returns: Pointer to next senblk on the queue or NULL if there was none in
+ *  time or the queue is no longer active
+ *  Only for queues without spill files or decimation (engine queues)
+ */
+static senblk_t *timed_senblk(ioqueue_t *q, int64_t wait, int *timedout)
+{
+    senblk_t *tptr;
+    struct timespec due;
+
+    clock_gettime(CLOCK_REALTIME,&due);
+    due.tv_sec+=wait/1000;
+    if ((due.tv_nsec+=(wait%1000)*1000000) >= 1000000000) {
+        due.tv_sec++;
+        due.tv_nsec-=1000000000;
+    }
+
+    *timedout=0;
+    pthread_mutex_lock(&q->q_mutex);
+    while ((tptr = q->qhead) == NULL) {
+        if (!q->active || *timedout) {
+            pthread_mutex_unlock(&q->q_mutex);
+            return ((senblk_t *)NULL);
+        }
+        if (pthread_cond_timedwait(&q->freshmeat,&q->q_mutex,&due) ==
+                ETIMEDOUT)
+            *timedout=1;
+    }
+
+    if ((q->qhead=tptr->next) == NULL)
+        q->qtail=NULL;
+    pthread_mutex_unlock(&q->q_mutex);
+    return(tptr);
+}
+
+/*
+ *  Get the next senblk from the head of a queue without waiting
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to next senblk on the queue or NULL if there is none
+ *  Used to batch up sentences which are already waiting to be sent
+ */
+senblk_t *try_senblk(ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    pthread_mutex_lock(&q->q_mutex);
+    if (q->spill && spilled(q)) {
+        /* Spilled sentences must be sent first */
+        pthread_mutex_unlock(&q->q_mutex);
+        return(NULL);
+    }
+    if (q->decimate)
+        release_decimated(q);
+    if ((tptr = q->qhead) != NULL && (q->qhead=tptr->next) == NULL)
+        q->qtail=NULL;
+    pthread_mutex_unlock(&q->q_mutex);
+    return(tptr);
+}
+
+/*
+ *  Get the last senblk from a queue, discarding all before it
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to last senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ */
+senblk_t *last_senblk(ioqueue_t *q)
+{
+    senblk_t *tptr,*nptr;
+
+    pthread_mutex_lock(&q->q_mutex);
+    /* Move all but last senblk on the queue to the free list */
+    if ((tptr=q->qhead) != NULL) {
+        for (nptr=tptr->next;nptr;tptr=nptr,nptr=nptr->next) {
+            tptr->next=q->free;
+            q->free=tptr;
+        }
+        q->qhead=tptr;
+    }
+
+    while ((tptr = q->qhead) == NULL) {
+        /* No data available for reading */
+        if (!q->active) {
+            /* Return NULL if the queue has been shut down */
+            pthread_mutex_unlock(&q->q_mutex);
+            return ((senblk_t *)NULL);
+        }
+        /* Wait until something is available */
+        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    }
+
+    /* set qhead to next element (which may be NULL)
+       If the last element in the queue, set the tail pointer to NULL too */
+    if ((q->qhead=tptr->next) == NULL)
+        q->qtail=NULL;
+    pthread_mutex_unlock(&q->q_mutex);
+    return(tptr);
+}
+
+/*
+ * Flush a queue, returning anything on it to the free list
+ * Args: Queue to be flushed
+ * Returns: Nothing
+ * Side Effect: Returns anything on the queue to the free list
+ */
+void flush_queue(ioqueue_t *q)
+{
+    pthread_mutex_lock(&q->q_mutex);
+    if (q->qhead != NULL) {
+        q->qtail->next = q->free;
+        q->free=q->qhead;
+        q->qhead=q->qtail=NULL;
+    }
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Return a senblk to a queue's free list
+ * Args: pointer to senblk, and pointer to the queue whose free list it is to
+ * be added to
+ * Returns: Nothing
+ */
+void senblk_free(senblk_t *sptr, ioqueue_t *q)
+{
+    pthread_mutex_lock(&q->q_mutex);
+    if (q->spill && sptr == &q->spill->sblk) {
+        /* Done with a spilled sentence: have the file emptied once all are
+         * sent */
+        pthread_mutex_lock(&q->spill->mutex);
+        if (q->spill->reclen &&
+                (q->spill->rd+=q->spill->reclen) >= q->spill->wr) {
+            q->spill->trunc=1;
+            pthread_cond_signal(&q->spill->cond);
+        }
+        q->spill->reclen=0;
+        q->spill->out=0;
+        pthread_mutex_unlock(&q->spill->mutex);
+        pthread_mutex_unlock(&q->q_mutex);
+        return;
+    }
+    /* Adding to head of free list is quicker than tail */
+    sptr->next = q->free;
+    q->free=sptr;
+    if (q->waiting)
+        pthread_cond_signal(&q->roomfree);
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Set up the engine for a bus
+ * Args: Pointer to the engine to initialise, engine to copy configuration
+ * from or NULL for defaults
+ * Returns: Nothing
+ * Per-bus state (output list, failover, AIS and duplicate tables) is never
+ * copied: it always starts empty
+ */
+void init_engine(struct if_engine *ifg, struct if_engine *from)
+{
+    if (from)
+        memcpy(ifg,from,sizeof(struct if_engine));
+    else {
+        ifg->flags=0;
+        ifg->logto=LOG_DAEMON;
+        ifg->bus=0;
+        ifg->qsize=DEFQUEUESZ;
+        ifg->aistimeout=DEFREASSEMBLYTIME;
+        ifg->dedupwindow=0;
+        ifg->histsize=0;
+        ifg->initwait=-1;
+        ifg->initthreads=DEFINITTHREADS;
+    }
+    ifg->aisgroups=NULL;
+    ifg->dedup=NULL;
+    pthread_mutex_init(&ifg->olock,NULL);
+    ifg->outputs=NULL;
+    ifg->nout=ifg->maxout=0;
+}
+
+iface_t *get_default_global()
+{
+    iface_t *ifp;
+    struct if_engine *ifg;
+
+    if ((ifp = (iface_t *) malloc(sizeof(iface_t))) == NULL)
+        return(NULL);
+
+    memset((void *) ifp,0,sizeof(iface_t));
+
+    ifp->type = GLOBAL;
+    ifp->options = NULL;
+    if ((ifg = (struct if_engine *)malloc(sizeof(struct if_engine))) == NULL) {
+        free(ifp);
+        return(NULL);
+    }
+    init_engine(ifg,NULL);
+    ifp->strict=1;
+    ifp->initwait=-1;
+    ifp->info = (void *)ifg;
+
+    return(ifp);
+}
+
+/*
+ * Lock the output lists of all the buses an output is on
+ * Args: Output interface
+ * Returns: Nothing
+ * Used when changing anything the engines look at when forwarding to the
+ * output.  Lists are locked in bus order; engines only ever hold one
+ */
+static void lock_buses(iface_t *optr)
+{
+    int i;
+
+    for (i=0;i<MAXBUSES;i++)
+        if ((optr->buses & (1U << i)) && optr->lists->bus[i])
+            pthread_mutex_lock(&((struct if_engine *)
+                    optr->lists->bus[i]->info)->olock);
+}
+
+/*
+ * Unlock the output lists locked by lock_buses()
+ * Args: Output interface
+ * Returns: Nothing
+ */
+static void unlock_buses(iface_t *optr)
+{
+    int i;
+
+    for (i=MAXBUSES-1;i>=0;i--)
+        if ((optr->buses & (1U << i)) && optr->lists->bus[i])
+            pthread_mutex_unlock(&((struct if_engine *)
+                    optr->lists->bus[i]->info)->olock);
+}
+
+/*
+ * Add an output to the output list of each bus it is on
+ * Args: Output interface
+ * Returns: 0 on success, -1 on failure to allocate memory
+ * io_mutex must be held by the caller
+ */
+static int bus_attach(iface_t *optr)
+{
+    struct if_engine *ifg;
+    iface_t **nptr;
+    int i,ret=0;
+
+    lock_buses(optr);
+    for (i=0;i<MAXBUSES && ret == 0;i++) {
+        if (!(optr->buses & (1U << i)) || optr->lists->bus[i] == NULL)
+            continue;
+        ifg=(struct if_engine *) optr->lists->bus[i]->info;
+        if (ifg->nout == ifg->maxout) {
+            if ((nptr=(iface_t **) realloc(ifg->outputs,
+                    (ifg->maxout+16)*sizeof(iface_t *))) == NULL) {
+                ret=-1;
+                break;
+            }
+            ifg->outputs=nptr;
+            ifg->maxout+=16;
+        }
+        ifg->outputs[ifg->nout++]=optr;
+    }
+    unlock_buses(optr);
+    return(ret);
+}
+
+/*
+ * Remove an output from the output lists of the buses it is on
+ * Args: Output interface
+ * Returns: Nothing
+ * io_mutex must be held by the caller.  Once this returns no engine will
+ * push anything more to the output's queue
+ */
+static void bus_detach(iface_t *optr)
+{
     struct if_engine *ifg;
+    size_t j;
+    int i;
 
-    if ((ifp = (iface_t *) malloc(sizeof(iface_t))) == NULL)
-        return(NULL);
+    lock_buses(optr);
+    for (i=0;i<MAXBUSES;i++) {
+        if (!(optr->buses & (1U << i)) || optr->lists->bus[i] == NULL)
+            continue;
+        ifg=(struct if_engine *) optr->lists->bus[i]->info;
+        for (j=0;j<ifg->nout;j++)
+            if (ifg->outputs[j] == optr) {
+                memmove(&ifg->outputs[j],&ifg->outputs[j+1],
+                        (ifg->nout-j-1)*sizeof(iface_t *));
+                ifg->nout--;
+                break;
+            }
+    }
+    unlock_buses(optr);
+}
 
-    memset((void *) ifp,0,sizeof(iface_t));
+/*
+ * Set the subscription of a tcp server connection from a "$PKPXC,SUB" command
+ * Args: senblk containing the command, iface_t pointing to engine
+ * Returns: 1 if the subscription was set, -1 if the command was invalid or
+ * did not come from a connection accepting subscriptions
+ * The command is of the form $PKPXC,SUB,<match>[:<match>]... where each
+ * <match> is a sentence id which may contain "*" wildcards and may be
+ * truncated (e.g. "GP" matches any GPS sentence).  Only matching sentences
+ * are queued for the connection.  An empty list cancels the subscription.
+ */
+static int subscribe(senblk_t *sptr, iface_t *eptr)
+{
+    char spec[SENBUFSZ*2];
+    char *cptr,*end,*sptr2;
+    sfilter_t *filter=NULL,*old;
+    iface_t *optr;
 
-    ifp->type = GLOBAL;
-    ifp->options = NULL;
-    if ((ifg = (struct if_engine *)malloc(sizeof(struct if_engine))) == NULL) {
-        free(ifp);
-        return(NULL);
+    end=sptr->data+sptr->len-2;
+    if (end-sptr->data > 14 && *(end-3) == '*' && isxdigit(*(end-2)) &&
+            isxdigit(*(end-1)))
+        end-=3;
+
+    for (cptr=sptr->data+11,sptr2=spec;cptr<end;) {
+        *sptr2++='+';
+        for (;cptr<end && *cptr != ':';cptr++) {
+            if (!(isupper(*cptr) || isdigit(*cptr) || *cptr == '*') ||
+                    sptr2-spec >= sizeof(spec)-6)
+                return(-1);
+            *sptr2++=*cptr;
+        }
+        if (*(sptr2-1) == '+')
+            return(-1);
+        *sptr2++=':';
+        if (cptr<end)
+            cptr++;
     }
-    ifg->flags=0;
-    ifg->logto=LOG_DAEMON;
-    ifp->strict=1;
-    ifp->info = (void *)ifg;
 
-    return(ifp);
+    if (sptr2 != spec) {
+        strcpy(sptr2,"-all");
+        if ((filter=getfilter(spec)) == NULL)
+            return(-1);
+    }
+
+    pthread_mutex_lock(&eptr->lists->io_mutex);
+    for (optr=eptr->lists->outputs;optr;optr=optr->next)
+        if (optr->id == sptr->src && flag_test(optr,F_SUBSCRIBE))
+            break;
+    if (optr == NULL) {
+        pthread_mutex_unlock(&eptr->lists->io_mutex);
+        free_filter(filter);
+        return(-1);
+    }
+    lock_buses(optr);
+    old=optr->subscription;
+    optr->subscription=filter;
+    unlock_buses(optr);
+    pthread_mutex_unlock(&eptr->lists->io_mutex);
+
+    DEBUG(3,"%s: subscription %s",optr->name,filter?spec:"cancelled");
+    free_filter(old);
+    return(1);
+}
+
+/*
+ * Encode a sentence in an output format
+ * Args: Format and senblk to be encoded
+ * Returns: Pointer to encoded sentence with a single reference, or NULL on
+ * failure
+ * JSON is one object per line: {"src":"<interface>","time":<ms>,"nmea":"..."}
+ * where time is when the sentence was received.  Binary format is a length byte followed by the sentence without <CR><LF>
+ */
+static struct encbuf *encode(enum oformat format, senblk_t *sptr)
+{
+    struct encbuf *eptr;
+    size_t len=sptr->len-2;
+    char *name,*cptr,*dptr;
+
+    if (format == FMT_JSON) {
+        if ((name=idlookup(sptr->src)) == NULL || *name == '_')
+            name=DEFSRCNAME;
+        if ((eptr=(struct encbuf *) malloc(sizeof(struct encbuf) + 6*len +
+                strlen(name) + 64)) == NULL)
+            return(NULL);
+        dptr=eptr->data+sprintf(eptr->data,"{\"src\":\"%s\",\"time\":%lld,\"nmea\":\"",
+                name,(long long) sptr->ts);
+        for (cptr=sptr->data;cptr<sptr->data+len;cptr++) {
+            if ((unsigned char) *cptr < 0x20)
+                dptr+=sprintf(dptr,"\\u%04x",(unsigned char) *cptr);
+            else {
+                if (*cptr == '"' || *cptr == '\\')
+                    *dptr++='\\';
+                *dptr++=*cptr;
+            }
+        }
+        memcpy(dptr,"\"}\n",3);
+        eptr->len=dptr+3-eptr->data;
+    } else {
+        if ((eptr=(struct encbuf *) malloc(sizeof(struct encbuf) + len + 1))
+                == NULL)
+            return(NULL);
+        *eptr->data=(unsigned char) len;
+        memcpy(eptr->data+1,sptr->data,len);
+        eptr->len=len+1;
+    }
+    eptr->refs=1;
+    return(eptr);
+}
+
+/*
+ * Queue a sentence from the history for an output, as if it had been
+ * forwarded to it by the engine
+ * Args: Output interface, history entry
+ * Returns: Nothing
+ * hist_mutex must be held by the caller
+ */
+static void push_history(iface_t *optr, struct histent *hptr)
+{
+    struct encbuf *enc;
+
+    if (!(optr->buses & hptr->bus) ||
+            !((hptr->sblk.src != optr->id) || flag_test(optr,F_LOOPBACK)) ||
+            (optr->subscription &&
+            senfilter(&hptr->sblk,optr->subscription,optr)))
+        return;
+    if (optr->format != FMT_NMEA) {
+        if ((enc=encode(optr->format,&hptr->sblk)) == NULL)
+            return;
+        hptr->sblk.enc=enc;
+        push_senblk(&hptr->sblk,optr->q);
+        hptr->sblk.enc=NULL;
+        encbuf_release(enc);
+    } else
+        push_senblk(&hptr->sblk,optr->q);
+}
+
+/*
+ * Get the sequence number of the oldest sentence in the history
+ * Args: Pointer to iolists
+ * Returns: Sequence number
+ */
+static uint64_t history_first(struct iolists *lists)
+{
+    return((lists->seq >= lists->histsize)?lists->seq-lists->histsize+1:1);
+}
+
+/*
+ * Find the first sentence in the history received at or after a given time
+ * Args: Pointer to iolists, time in ms since the epoch
+ * Returns: Sequence number of the sentence, or one more than the latest
+ * sentence if all are older
+ * hist_mutex must be held by the caller.  Sentences are held in the order in
+ * which they were processed so the history is its own time index and is
+ * searched by bisection.  The search is on the monotonic time each was added
+ * so that steps in the system clock don't upset the order
+ */
+static uint64_t history_seek(struct iolists *lists, int64_t when)
+{
+    uint64_t lo,hi,mid;
+    struct histent *hptr;
+
+    when=msclock()-(mstime()-when);
+    for (lo=history_first(lists),hi=lists->seq+1;lo<hi;) {
+        mid=lo+(hi-lo)/2;
+        hptr=&lists->history[mid % lists->histsize];
+        if (hptr->sblk.seq == mid && hptr->clock < when)
+            lo=mid+1;
+        else
+            hi=mid;
+    }
+    return(lo);
+}
+
+/*
+ * Queue sentences from the history for an output
+ * Args: Output interface, sequence number of the last sentence already
+ * received
+ * Returns: Nothing
+ * hist_mutex must be held by the caller.  At most as many sentences as the
+ * output's queue holds are replayed
+ */
+static void replay(iface_t *optr, uint64_t from)
+{
+    struct iolists *lists = optr->lists;
+    struct histent *hptr;
+    uint64_t seq,first;
+
+    first=history_first(lists);
+    if (lists->seq >= optr->q->size && first < lists->seq - optr->q->size + 1)
+        first=lists->seq - optr->q->size + 1;
+    if (from >= first)
+        first=from+1;
+
+    for (seq=first;seq<=lists->seq;seq++) {
+        hptr=&lists->history[seq % lists->histsize];
+        if (hptr->sblk.seq == seq)
+            push_history(optr,hptr);
+    }
+}
+
+/*
+ * Check whether a queue has room for another senblk without discarding one
+ * Args: Queue
+ * Returns: 1 if the queue is full, 0 otherwise
+ */
+static int queue_full(ioqueue_t *q)
+{
+    int full;
+
+    pthread_mutex_lock(&q->q_mutex);
+    full=(q->free == NULL);
+    pthread_mutex_unlock(&q->q_mutex);
+    return(full);
+}
+
+/*
+ * Thread replaying the history to an output from a "$PKPXC,REWIND" command
+ * Args: struct rewind describing the replay (cast to void *)
+ * Returns: Nothing
+ * Sentences are sent at their original pace scaled by the requested speed,
+ * or as fast as the output accepts them for speed 0.  The output receives no
+ * live sentences until the replay catches up with them.  The replay ends
+ * early if the output goes away or another REWIND or RESUME is received
+ */
+static void *rewinder(void *info)
+{
+    struct rewind *rptr = (struct rewind *) info;
+    struct iolists *lists = rptr->lists;
+    struct histent *hptr;
+    iface_t *optr;
+    int64_t start,base=0,due,now;
+    int n,wait,done=0;
+
+    (void) pthread_detach(pthread_self());
+
+    for (start=msclock();!done;) {
+        /* The output is looked up (in case it has gone away) once for each
+         * batch of sentences rather than for every one */
+        pthread_mutex_lock(&lists->io_mutex);
+        for (optr=lists->outputs;optr;optr=optr->next)
+            if (optr->id == rptr->id && optr->rewind == rptr->token)
+                break;
+        if (optr == NULL) {
+            pthread_mutex_unlock(&lists->io_mutex);
+            break;
+        }
+        pthread_mutex_lock(&lists->hist_mutex);
+        for (n=0,wait=0;n<REWINDBATCH && !wait;n++) {
+            if (rptr->seq > lists->seq) {
+                /* Caught up: the engine takes over */
+                DEBUG(3,"%s: Replay complete",optr->name);
+                optr->rewind=0;
+                done=1;
+                break;
+            }
+            if (rptr->seq < history_first(lists))
+                rptr->seq=history_first(lists);
+            hptr=&lists->history[rptr->seq % lists->histsize];
+            if (hptr->sblk.seq == rptr->seq) {
+                if (rptr->speed > 0) {
+                    if (!base)
+                        base=hptr->clock;
+                    due=start+(int64_t) ((hptr->clock-base)/rptr->speed);
+                    if ((now=msclock()) < due)
+                        wait=(due-now > 100)?100:(int) (due-now);
+                }
+                if (!wait && queue_full(optr->q))
+                    wait=10;
+                if (!wait)
+                    push_history(optr,hptr);
+            }
+            if (!wait)
+                rptr->seq++;
+        }
+        pthread_mutex_unlock(&lists->hist_mutex);
+        pthread_mutex_unlock(&lists->io_mutex);
+        if (wait)
+            usleep(wait*1000);
+    }
+
+    free(rptr);
+    return(NULL);
+}
+
+/*
+ * Replay the history to a connection from a "$PKPXC,REWIND" command
+ * Args: senblk containing the command, iface_t pointing to engine
+ * Returns: 1 if the replay was started or cancelled, -1 if the command was
+ * invalid, there is no history or it did not come from a bi-directional
+ * interface
+ * The command is of the form $PKPXC,REWIND,<time>[,<speed>] where <time> is
+ * in seconds since the epoch or, if zero or negative, relative to now and
+ * <speed> is a multiple of the original rate (default 1) or 0 to send as fast
+ * as possible.  An empty <time> cancels a replay in progress
+ */
+static int rewind_output(senblk_t *sptr, iface_t *eptr)
+{
+    struct iolists *lists = eptr->lists;
+    struct rewind *rptr=NULL;
+    char *cptr,*eptr2;
+    double when,speed=1;
+    iface_t *optr;
+    pthread_t tid;
+    uint64_t seq;
+
+    if (!lists->history)
+        return(-1);
+
+    cptr=sptr->data+14;
+    if (*cptr == '*' || *cptr == '\r')
+        when=0;
+    else {
+        when=strtod(cptr,&eptr2);
+        if (eptr2 == cptr)
+            return(-1);
+        if (when <= 0)
+            when+=mstime()/1000.0;
+        if (*(cptr=eptr2) == ',') {
+            speed=strtod(++cptr,&eptr2);
+            if (eptr2 == cptr || speed < 0)
+                return(-1);
+            cptr=eptr2;
+        }
+        if (*cptr != '*' && *cptr != '\r')
+            return(-1);
+    }
+
+    if (when && (rptr=(struct rewind *) malloc(sizeof(struct rewind))) == NULL)
+        return(-1);
+
+    pthread_mutex_lock(&lists->io_mutex);
+    for (optr=lists->outputs;optr;optr=optr->next)
+        if (optr->id == sptr->src && optr->q)
+            break;
+    pthread_mutex_lock(&lists->hist_mutex);
+    if (optr == NULL || !when) {
+        if (optr)
+            optr->rewind=0;
+        pthread_mutex_unlock(&lists->hist_mutex);
+        pthread_mutex_unlock(&lists->io_mutex);
+        if (when)
+            free(rptr);
+        return(optr?1:-1);
+    }
+    rptr->lists=lists;
+    rptr->id=optr->id;
+    rptr->token=optr->rewind=++lists->rewinds;
+    rptr->seq=seq=history_seek(lists,(int64_t) (when*1000));
+    rptr->speed=speed;
+    flush_queue(optr->q);
+    if (pthread_create(&tid,NULL,rewinder,(void *) rptr) != 0) {
+        optr->rewind=0;
+        pthread_mutex_unlock(&lists->hist_mutex);
+        pthread_mutex_unlock(&lists->io_mutex);
+        free(rptr);
+        return(-1);
+    }
+    pthread_mutex_unlock(&lists->hist_mutex);
+    pthread_mutex_unlock(&lists->io_mutex);
+
+    DEBUG(3,"%s: replaying from sentence %llu at speed %g",optr->name,
+            (unsigned long long) seq,speed);
+    return(1);
+}
+
+/*
+ * Resume the output of a connection from a "$PKPXC,RESUME" command
+ * Args: senblk containing the command, iface_t pointing to engine
+ * Returns: 1 if sentences were replayed, -1 if the command was invalid, there
+ * is no history or it did not come from a bi-directional interface
+ * The command is of the form $PKPXC,RESUME,<seq> where <seq> is the sequence
+ * number of the last sentence the client received (as sent in the "n:" field
+ * of TAG blocks).  Anything queued for the connection is discarded and
+ * replaced by all retained sentences following <seq>
+ */
+static int resume(senblk_t *sptr, iface_t *eptr)
+{
+    uint64_t from=0;
+    char *cptr;
+    iface_t *optr;
+
+    for (cptr=sptr->data+14;isdigit(*cptr);cptr++)
+        from=from*10+(*cptr-'0');
+    if (cptr == sptr->data+14 || (*cptr != '*' && *cptr != '\r') ||
+            !eptr->lists->history)
+        return(-1);
+
+    pthread_mutex_lock(&eptr->lists->io_mutex);
+    for (optr=eptr->lists->outputs;optr;optr=optr->next)
+        if (optr->id == sptr->src && optr->q)
+            break;
+    if (optr == NULL) {
+        pthread_mutex_unlock(&eptr->lists->io_mutex);
+        return(-1);
+    }
+    pthread_mutex_lock(&eptr->lists->hist_mutex);
+    optr->rewind=0;
+    flush_queue(optr->q);
+    replay(optr,from);
+    pthread_mutex_unlock(&eptr->lists->hist_mutex);
+    pthread_mutex_unlock(&eptr->lists->io_mutex);
+
+    DEBUG(3,"%s: resuming after sentence %llu",optr->name,
+            (unsigned long long) from);
+    return(1);
 }
 
 /* Process proprietary sentence.  Anything starting $PKPX
@@ -601,17 +2202,391 @@ int process_prop(senblk_t *sptr, iface_t *eptr)
             return -1;
         break;
     case 'C':
-        /* Command: None currently defined */
+        /* Command */
+        if (!strncmp(sptr->data+7,"SUB,",4))
+            return(subscribe(sptr,eptr));
+        if (!strncmp(sptr->data+7,"RESUME,",7))
+            return(resume(sptr,eptr));
+        if (!strncmp(sptr->data+7,"REWIND,",7))
+            return(rewind_output(sptr,eptr));
+        return -1;
     case 'R':
         /* Response: shouldn't get this */
     default:
         return -1;
     }
 
-    sptr->len+=sprintf(sptr->data+sptr->len,"*%02X\r\n",
-            calcsum(sptr->data+1,sptr->len-1));
-    sptr->src=0;
-    return(0);
+    sptr->len+=sprintf(sptr->data+sptr->len,"*%02X\r\n",
+            calcsum(sptr->data+1,sptr->len-1));
+    sptr->src=0;
+    return(0);
+}
+
+/*
+ * Check whether sentences duplicate those recently received from another source
+ * Args: Engine info, pointer to array of senblks and number of senblks (more
+ * than one for a reassembled AIS message, which is treated as a unit)
+ * Returns: 1 if the sentences are a duplicate and should be dropped, 0 if not
+ * Side Effects: Sentences which are not duplicates are recorded
+ * The hash covers the sentence body without its checksum or line termination.
+ * The sequential message id and radio channel of AIS sentences are not
+ * included: the id is assigned independently by each receiver and the same
+ * message may be heard on channel A by one receiver and B by another
+ */
+static int isdup(struct if_engine *ifg, senblk_t *sptr, size_t count)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    struct dedupent *dptr,*slot=NULL;
+    int64_t now = msclock();
+    char *cptr,*end;
+    int field,ais;
+    size_t i;
+
+    for (i=0;i<count;i++) {
+        ais=(*sptr[i].data == '!');
+        for (cptr=sptr[i].data,end=cptr+sptr[i].len,field=0;cptr<end;cptr++) {
+            if (*cptr == '*' || *cptr == '\r' || *cptr == '\n')
+                break;
+            if (*cptr == ',')
+                field++;
+            else if (ais && (field == 3 || field == 4))
+                continue;
+            hash ^= (unsigned char) *cptr;
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    for (i=0;i<DEDUPPROBES;i++) {
+        dptr=&ifg->dedup[(hash+i)&(DEDUPSLOTS-1)];
+        if (dptr->seen && now - dptr->seen <= ifg->dedupwindow) {
+            if (dptr->hash != hash) {
+                if (!slot || (slot->seen && dptr->seen < slot->seen))
+                    slot=dptr;
+                continue;
+            }
+            if (dptr->src != sptr->src) {
+                DEBUG(7,"Dropping duplicate from %llx",
+                        (unsigned long long) sptr->src);
+                return(1);
+            }
+            slot=dptr;
+            break;
+        }
+        /* Expired or unused entry */
+        if (!slot || slot->seen)
+            slot=dptr;
+    }
+
+    slot->hash=hash;
+    slot->seen=now;
+    slot->src=sptr->src;
+    return(0);
+}
+
+/*
+ * Push sentences to all outputs on a bus
+ * Args: Engine interface, pointer to array of senblks, number of senblks
+ * Returns: Nothing
+ * Side Effects: Sentences are pushed onto the queue of each output (other than
+ * their source unless it has loopback set). Sentences are pushed under a
+ * single acquisition of the bus's output list lock so that they remain
+ * contiguous.  hist_mutex is only taken when a history is kept, to keep it in
+ * step with what outputs being replayed to have been sent
+ */
+static void forward(iface_t *eptr, senblk_t *sptr, size_t count)
+{
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    struct iolists *lists = eptr->lists;
+    uint32_t bus = 1U << ifg->bus;
+    struct encbuf *enc[AISMAXFRAGS][NFORMATS];
+    struct histent *hptr;
+    iface_t *optr;
+    int64_t now;
+    size_t i,j;
+    int f;
+
+    /* Sentences are encoded (once) for each format the first time an output
+     * using the format is found */
+    memset(enc,0,sizeof(enc[0])*count);
+
+    /* Number sentences and retain them for clients resuming after a break */
+    if (lists->history) {
+        now=msclock();
+        pthread_mutex_lock(&lists->hist_mutex);
+        for (i=0;i<count;i++) {
+            sptr[i].seq=++lists->seq;
+            hptr=&lists->history[sptr[i].seq % lists->histsize];
+            hptr->bus=bus;
+            hptr->clock=now;
+            (void) senblk_copy(&hptr->sblk,&sptr[i]);
+        }
+    } else
+        for (i=0;i<count;i++)
+            sptr[i].seq=__sync_add_and_fetch(&lists->seq,1);
+
+    /* Push a copy of each senblk to each output subscribed to this engine's
+     * bus */
+    pthread_mutex_lock(&ifg->olock);
+    for (j=0;j<ifg->nout;j++) {
+        optr=ifg->outputs[j];
+        if (!optr->q || optr->rewind)
+            continue;
+        for (i=0;i<count;i++) {
+            if (!((sptr[i].src != optr->id) || (flag_test(optr,F_LOOPBACK))) ||
+                    (optr->subscription &&
+                    senfilter(&sptr[i],optr->subscription,optr)))
+                continue;
+            if ((f=optr->format) != FMT_NMEA) {
+                if (!enc[i][f] && (enc[i][f]=encode(f,&sptr[i])) == NULL) {
+                    logwarn("Failed to encode sentence for %s",optr->name);
+                    continue;
+                }
+                sptr[i].enc=enc[i][f];
+            }
+            push_senblk(&sptr[i],optr->q);
+            sptr[i].enc=NULL;
+        }
+    }
+    pthread_mutex_unlock(&ifg->olock);
+    if (lists->history)
+        pthread_mutex_unlock(&lists->hist_mutex);
+
+    for (i=0;i<count;i++)
+        for (f=1;f<NFORMATS;f++)
+            if (enc[i][f])
+                encbuf_release(enc[i][f]);
+}
+
+/*
+ * Pass on the fragments received of an AIS message which won't be completed
+ * Args: Engine interface, message being reassembled
+ * Returns: Nothing
+ * Fragments are forwarded one by one in order, as they would have been
+ * without reassembly
+ */
+static void release_aisgroup(iface_t *eptr, struct aisgroup *gptr)
+{
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    size_t i;
+
+    DEBUG(4,"AIS message %u from %llx incomplete with %lu of %lu fragments",
+            gptr->seq,(unsigned long long) gptr->src,(unsigned long) gptr->count,
+            (unsigned long) gptr->nfrags);
+    for (i=0;i<gptr->nfrags;i++)
+        if (gptr->frags[i].len &&
+                !(ifg->dedup && isdup(ifg,&gptr->frags[i],1)))
+            forward(eptr,&gptr->frags[i],1);
+    gptr->nfrags=0;
+}
+
+/*
+ * Pass on AIS messages not completed within the reassembly time
+ * Args: Engine interface
+ * Returns: Time in ms until the next pending message is due to time out, or
+ * -1 if there are none pending
+ */
+static int64_t expire_aisgroups(iface_t *eptr)
+{
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    struct aisgroup *gptr;
+    int64_t now=msclock(),wait=-1,left;
+
+    for (gptr=ifg->aisgroups;gptr<ifg->aisgroups+AISPENDING;gptr++) {
+        if (gptr->nfrags == 0)
+            continue;
+        if ((left=gptr->started+ifg->aistimeout+1-now) <= 0)
+            release_aisgroup(eptr,gptr);
+        else if (wait < 0 || left < wait)
+            wait=left;
+    }
+    return(wait);
+}
+
+/*
+ * Add a fragment of a multi-fragment AIS message to those being reassembled
+ * Args: Engine interface, senblk containing the fragment and its fragment
+ * count, fragment number and sequential message id, pointer to be set to the
+ * completed message if this was its last outstanding fragment, NULL otherwise
+ * Returns: 0 if the fragment was taken, -1 if it can't be reassembled and
+ * should be passed on as it stands
+ * Side Effects: Messages whose fragments have not all arrived within the
+ * reassembly time are passed on as they stand. If no slot is free, the
+ * oldest pending message is passed on to make room
+ */
+static int reassemble(iface_t *eptr, senblk_t *sptr, size_t nfrags,
+        size_t frag, unsigned int seq, struct aisgroup **done)
+{
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    struct aisgroup *gptr,*match=NULL,*slot=NULL;
+    int64_t now = msclock();
+    size_t i;
+
+    *done=NULL;
+
+    /* Too many fragments to hold or a bad fragment number */
+    if (nfrags > AISMAXFRAGS || frag == 0 || frag > nfrags) {
+        DEBUG(3,"Not reassembling AIS fragment %lu of %lu",(unsigned long) frag,
+                (unsigned long) nfrags);
+        return(-1);
+    }
+
+    for (gptr=ifg->aisgroups;gptr<ifg->aisgroups+AISPENDING;gptr++) {
+        if (gptr->nfrags && now - gptr->started > ifg->aistimeout)
+            release_aisgroup(eptr,gptr);
+        if (gptr->nfrags == 0) {
+            if (!slot || slot->nfrags)
+                slot=gptr;
+            continue;
+        }
+        if (gptr->src == sptr->src && gptr->seq == seq &&
+                gptr->nfrags == nfrags)
+            match=gptr;
+        else if (!slot || (slot->nfrags && gptr->started < slot->started))
+            slot=gptr;
+    }
+
+    /* A repeated fragment means the old message will never be completed */
+    if (match && match->frags[frag-1].len) {
+        DEBUG(4,"AIS message %u from %llx restarted",seq,
+                (unsigned long long) sptr->src);
+        release_aisgroup(eptr,match);
+        slot=match;
+        match=NULL;
+    }
+
+    if (!match) {
+        if (slot->nfrags)
+            release_aisgroup(eptr,slot);
+        match=slot;
+        match->src=sptr->src;
+        match->seq=seq;
+        match->nfrags=nfrags;
+        match->count=0;
+        match->started=now;
+        for (i=0;i<nfrags;i++)
+            match->frags[i].len=0;
+    }
+
+    (void) senblk_copy(&match->frags[frag-1],sptr);
+
+    if (++match->count == match->nfrags)
+        *done=match;
+    return(0);
+}
+
+/*
+ * Get the engine queue for the first bus an input publishes to
+ * Args: Pointer to interface
+ * Returns: Pointer to queue
+ */
+ioqueue_t *bus_queue(iface_t *ifa)
+{
+    int i;
+
+    for (i=0;i<MAXBUSES;i++)
+        if (ifa->buses & (1U << i))
+            return(ifa->lists->bus[i]->q);
+    return(ifa->lists->engine->q);
+}
+
+/*
+ * Pass a sentence read from an input to the engines of the buses it
+ * publishes to
+ * Args: Pointer to senblk and input interface
+ * Returns: Nothing
+ */
+void publish(senblk_t *sptr, iface_t *ifa)
+{
+    void (*push)(senblk_t *, ioqueue_t *) = push_senblk;
+    int i;
+
+    /* Inputs which aren't live (files) wait for the engine rather than
+     * losing data */
+    if (flag_test(ifa,F_NODROP))
+        push=push_senblk_wait;
+
+    /* Most inputs are on a single bus */
+    if (!(ifa->buses & (ifa->buses - 1))) {
+        (*push)(sptr,ifa->q);
+        return;
+    }
+
+    for (i=0;i<MAXBUSES;i++)
+        if (ifa->buses & (1U << i))
+            (*push)(sptr,ifa->lists->bus[i]->q);
+}
+
+/*
+ * Create the engine for a routing bus other than the default
+ * Args: Pointer to the default engine, index of the new bus
+ * Returns: Pointer to the new engine or NULL on error
+ * New engines take their configuration from the default engine but keep
+ * their own queue, output list, failover state and AIS reassembly and
+ * duplicate suppression state
+ */
+static iface_t *new_bus(iface_t *engine, int bus)
+{
+    iface_t *ifp;
+    struct if_engine *ifg,*defg=(struct if_engine *) engine->info;
+
+    if ((ifp = (iface_t *) malloc(sizeof(iface_t))) == NULL)
+        return(NULL);
+    memset((void *) ifp,0,sizeof(iface_t));
+
+    if ((ifg = (struct if_engine *)malloc(sizeof(struct if_engine))) == NULL) {
+        free(ifp);
+        return(NULL);
+    }
+    init_engine(ifg,defg);
+    ifg->bus=bus;
+
+    if ((defg->aisgroups && (ifg->aisgroups = (struct aisgroup *)
+            calloc(AISPENDING,sizeof(struct aisgroup))) == NULL) ||
+            (defg->dedup && (ifg->dedup = (struct dedupent *)
+            calloc(DEDUPSLOTS,sizeof(struct dedupent))) == NULL)) {
+        if (ifg->aisgroups)
+            free(ifg->aisgroups);
+        free(ifg);
+        free(ifp);
+        return(NULL);
+    }
+
+    ifp->type=GLOBAL;
+    ifp->info=(void *)ifg;
+    ifp->lists=engine->lists;
+    ifp->checksum=engine->checksum;
+    ifp->strict=engine->strict;
+    if ((engine->ofilter && (ifp->ofilter=copy_failover(engine->ofilter))
+            == NULL) || init_q(ifp,ifg->qsize) < 0) {
+        free_filter(ifp->ofilter);
+        if (ifg->aisgroups)
+            free(ifg->aisgroups);
+        if (ifg->dedup)
+            free(ifg->dedup);
+        free(ifg);
+        free(ifp);
+        return(NULL);
+    }
+    return(ifp);
+}
+
+/*
+ * Shut down the engine queues of all buses
+ * Args: Pointer to iolists
+ * Returns: Nothing
+ */
+static void stop_buses(struct iolists *lists)
+{
+    int i;
+
+    for (i=0;i<MAXBUSES;i++) {
+        if (lists->bus[i] == NULL)
+            continue;
+        pthread_mutex_lock(&lists->bus[i]->q->q_mutex);
+        lists->bus[i]->q->active=0;
+        pthread_cond_broadcast(&lists->bus[i]->q->freshmeat);
+        pthread_mutex_unlock(&lists->bus[i]->q->q_mutex);
+    }
 }
 
 /*
@@ -624,14 +2599,24 @@ int process_prop(senblk_t *sptr, iface_t *eptr)
 void *run_engine(void *info)
 {
     senblk_t *sptr;
-    iface_t *optr;
     iface_t *eptr = (iface_t *)info;
-    int retval=0;
+    struct if_engine *ifg = (struct if_engine *) eptr->info;
+    struct aisgroup *gptr;
+    size_t nfrags,frag;
+    unsigned int seq;
+    int64_t wait;
+    int retval=0,timedout;
 
     (void) pthread_detach(pthread_self());
 
     for (;;) {
-        sptr = next_senblk(eptr->q);
+        /* Wake up to pass on AIS messages which time out incomplete */
+        if (ifg->aisgroups && (wait=expire_aisgroups(eptr)) >= 0) {
+            if ((sptr = timed_senblk(eptr->q,wait,&timedout)) == NULL &&
+                    timedout)
+                continue;
+        } else
+            sptr = next_senblk(eptr->q);
 
         if (sptr==NULL)
             /* Queue has been marked inactive */
@@ -645,15 +2630,15 @@ void *run_engine(void *info)
         }
 
         if (isactive(eptr->ofilter,sptr)) {
-            pthread_mutex_lock(&eptr->lists->io_mutex);
-            /* Traverse list of outputs and push a copy of senblk to each */
-            for (optr=eptr->lists->outputs;optr;optr=optr->next) {
-                if ((optr->q) && ((!sptr) ||
-                        ((sptr->src != optr->id) || (flag_test(optr,F_LOOPBACK))))) {
-                    push_senblk(sptr,optr->q);
+            if (ifg->aisgroups && ais_fragment(sptr,&nfrags,&frag,&seq) &&
+                    reassemble(eptr,sptr,nfrags,frag,seq,&gptr) == 0) {
+                if (gptr) {
+                    if (!(ifg->dedup && isdup(ifg,gptr->frags,gptr->nfrags)))
+                        forward(eptr,gptr->frags,gptr->nfrags);
+                    gptr->nfrags=0;
                 }
-            }
-            pthread_mutex_unlock(&eptr->lists->io_mutex);
+            } else if (!(ifg->dedup && isdup(ifg,sptr,1)))
+                forward(eptr,sptr,1);
         }
         senblk_free(sptr,eptr->q);
     }
@@ -707,6 +2692,12 @@ void start_interface(void *ptr)
         ifa->next=NULL;
     (*lptr)=ifa;
 
+    if (ifa->direction != IN && bus_attach(ifa) < 0) {
+        logerr(errno,"Failed to add %s to its buses",ifa->name);
+        pthread_mutex_unlock(&ifa->lists->io_mutex);
+        iface_thread_exit(0);
+    }
+
     if (ifa->lists->initialized == NULL)
         pthread_cond_broadcast(&ifa->lists->init_cond);
     else 
@@ -739,6 +2730,135 @@ int link_to_initialized(iface_t *ifa)
     return(0);
 }
 
+/*
+ * Shut down if there are no inputs left and none still being initialised
+ * Args: Pointer to iolists
+ * Returns: Nothing
+ * io_mutex should be held
+ */
+static void check_inputs(struct iolists *lists)
+{
+    iface_t *tptr;
+
+    if (lists->inputs || lists->pending)
+        return;
+    for(tptr=lists->outputs;tptr;tptr=tptr->next)
+        if (tptr->direction == BOTH)
+            return;
+    stop_buses(lists);
+    if (timetodie == 0)
+        timetodie++;
+}
+
+/*
+ * Apply engine defaults to an interface once its type specific initialisation
+ * is done
+ * Args: Interface pointer
+ * Returns: Nothing
+ */
+static void ready_iface(iface_t *ifa)
+{
+    iface_t *engine=ifa->lists->engine;
+
+    if (!ifa->buses)
+        ifa->buses=1;
+    if (ifa->format != FMT_NMEA && ifa->tagflags) {
+        logwarn("TAG blocks are only output in nmea format: ignoring srctag and timestamp options for %s",
+                ifa->name);
+        ifa->tagflags=0;
+    }
+    if (ifa->direction == IN)
+        ifa->q=bus_queue(ifa);
+
+    if (ifa->checksum <0)
+        ifa->checksum = engine->checksum;
+    if (ifa->strict <0)
+        ifa->strict = engine->strict;
+}
+
+/*
+ * Start an interface whose initialisation finished after startup stopped
+ * waiting for it
+ * Args: Initialisation job
+ * Returns: Nothing
+ * Failure of an interface which isn't optional shuts kplex down, as it would
+ * have done at startup
+ */
+static void start_late(struct initjob *job)
+{
+    iface_t *ifa=job->ifa;
+    iface_t *tptr,*nptr,**iptr;
+    struct iolists *lists=ifa->lists;
+    pthread_t tid;
+    sigset_t set,saved;
+
+    if (job->ret) {
+        for (tptr=job->ret;tptr;tptr=tptr->next) {
+            ready_iface(tptr);
+            if (tptr->ofilter && name2id(tptr->ofilter))
+                logterm(errno,"Name to interface translation failed");
+        }
+    } else
+        logerr(0,"Failed to initialize Interface %s",ifa->name);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    pthread_mutex_lock(&lists->io_mutex);
+    lists->pending--;
+    if (job->ret == NULL) {
+        if (!flag_test(ifa,F_OPTIONAL) && timetodie == 0)
+            timetodie++;
+        check_inputs(lists);
+    } else if (timetodie == 0) {
+        for (iptr=&lists->initialized;(*iptr);iptr=&(*iptr)->next);
+        for (tptr=job->ret;tptr;tptr=nptr) {
+            nptr=tptr->next;
+            (*iptr)=tptr;
+            tptr->next=NULL;
+            iptr=&tptr->next;
+        }
+        for (tptr=job->ret;tptr;tptr=tptr->next)
+            pthread_create(&tid,NULL,(void *)start_interface,(void *) tptr);
+        DEBUG(3,"%s: initialised after startup",ifa->name);
+    }
+    pthread_mutex_unlock(&lists->io_mutex);
+    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    /* Have the reaper look at the interface lists again */
+    (void) pthread_kill(reaper,SIGUSR2);
+}
+
+/*
+ * Thread taking interfaces from the startup list and initialising them
+ * Args: Pointer to initialisation pool (cast to void *)
+ * Returns: NULL
+ */
+static void *init_worker(void *arg)
+{
+    struct initpool *pool = (struct initpool *) arg;
+    struct initjob *job;
+    iface_t *ret;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->next < pool->njobs) {
+        job=&pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->mutex);
+        ret=(*iftypes[job->ifa->type].init_func)(job->ifa);
+        pthread_mutex_lock(&pool->mutex);
+        job->ret=ret;
+        job->done=1;
+        pool->left--;
+        if (pool->started) {
+            pthread_mutex_unlock(&pool->mutex);
+            start_late(job);
+            pthread_mutex_lock(&pool->mutex);
+        } else
+            pthread_cond_signal(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return(NULL);
+}
+
 /*
  * Free all the data associated with an interface except the iface_t itself
  * Args: Pointer to iface_t to be freed
@@ -750,14 +2870,34 @@ int link_to_initialized(iface_t *ifa)
  */
 void free_if_data(iface_t *ifa)
 {
+    senblk_t *sptr;
+    int i;
+
     if ((ifa->direction == OUT) && ifa->q) {
-        /* output interfaces have queues which need freeing */
+        /* output interfaces have queues which need freeing, along with
+         * any encoded sentences they still refer to */
+        for (sptr=ifa->q->base;sptr<ifa->q->base+ifa->q->size;sptr++)
+            if (sptr->enc)
+                encbuf_release(sptr->enc);
+        if (ifa->q->decimate)
+            for (i=0;i<ifa->q->decimate->ntypes;i++)
+                if (ifa->q->decimate->latest[i].enc)
+                    encbuf_release(ifa->q->decimate->latest[i].enc);
         free(ifa->q->base);
+        if (ifa->q->decimate)
+            free(ifa->q->decimate);
+        if (ifa->q->spill)
+            free_spill(ifa->q);
         free(ifa->q);
     }
 
     free_filter(ifa->ifilter);
     free_filter(ifa->ofilter);
+    if (ifa->ratelimits) {
+        pthread_mutex_destroy(&ifa->ratelimits->lock);
+        free(ifa->ratelimits);
+    }
+    free_filter(ifa->subscription);
 
     if (ifa->info) {
         if (ifa->cleanup)
@@ -778,10 +2918,10 @@ void free_if_data(iface_t *ifa)
             else
                 ifa->pair->direction = NONE;
         }
-    } else
-        if (ifa->name && !(ifa->id & IDMINORMASK)) {
-            free(ifa->name);
-       }
+    }
+    /* The name isn't freed as the name to id mapping still refers to it:
+     * sentences from the interface may be looked up by id after it has gone
+     * (e.g. when a capture block naming it is written) */
 }
 
 /*
@@ -809,21 +2949,11 @@ int unlink_interface(iface_t *ifa)
             for (tptr=(*lptr);tptr->next != ifa;tptr=tptr->next);
             tptr->next = ifa->next;
         }
+        if (ifa->direction != IN)
+            bus_detach(ifa);
     
         if (ifa->direction != OUT)
-            if (!ifa->lists->inputs) {
-                for(tptr=ifa->lists->outputs;tptr;tptr=tptr->next)
-                    if (tptr->direction == BOTH)
-                        break;
-                if (tptr == NULL) {
-                    pthread_mutex_lock(&ifa->lists->engine->q->q_mutex);
-                    ifa->lists->engine->q->active=0;
-                    pthread_cond_broadcast(&ifa->lists->engine->q->freshmeat);
-                    pthread_mutex_unlock(&ifa->lists->engine->q->q_mutex);
-                    if (timetodie == 0)
-                        timetodie++;
-                }
-            }
+            check_inputs(ifa->lists);
     }
 
     free_if_data(ifa);
@@ -849,9 +2979,9 @@ void iface_destroy(void *ifptr)
 {
     iface_t *ifa = (iface_t *) ifptr;
 
-    DEBUG(3,"Cleaning up data for exiting %s %s %s id %x",
-            (ifa->direction == IN)?"input":"output",(ifa->id & IDMINORBITS)?
-            "connection":"interface",ifa->name,ifa->id);
+    DEBUG(3,"Cleaning up data for exiting %s %s %s id %llx",
+            (ifa->direction == IN)?"input":"output",(ifa->id & IDMINORMASK)?
+            "connection":"interface",ifa->name,(unsigned long long) ifa->id);
     sigset_t set,saved;
     sigemptyset(&set);
     sigaddset(&set, SIGUSR1);
@@ -920,8 +3050,15 @@ iface_t *ifdup (iface_t *ifa)
     newif->options=NULL;
     newif->ifilter=addfilter(ifa->ifilter);
     newif->ofilter=addfilter(ifa->ofilter);
+    newif->ratelimits=NULL;
+    newif->subscription=NULL;
+    newif->lastseq=0;
+    newif->rewind=0;
     newif->checksum=ifa->checksum;
     newif->strict=ifa->strict;
+    newif->decimation=ifa->decimation;
+    newif->buses=ifa->buses;
+    newif->format=ifa->format;
     return(newif);
 }
 
@@ -1007,7 +3144,7 @@ int string2facility(char *fac)
  */
 int name2id(sfilter_t *filter)
 {
-    unsigned int id;
+    srcid_t id;
     sf_rule_t *rptr;
     struct srclist *sptr;
 
@@ -1028,7 +3165,7 @@ int name2id(sfilter_t *filter)
         return(0);
     }
     
-    for (rptr=filter->rules;rptr;rptr=rptr->next)
+    for (rptr=filter->rules;rptr;rptr=rptr->next) {
         for (sptr=rptr->info.source;sptr;sptr=sptr->next) {
             if (!(id=namelookup(sptr->src.name))) {
                logwarn("Unknown interface \'%s\' in failover rules",sptr->src.name);
@@ -1036,7 +3173,18 @@ int name2id(sfilter_t *filter)
             }
             free(sptr->src.name);
             sptr->src.id=id;
+            if ((id >> IDMINORBITS) >= rptr->nsrcs)
+                rptr->nsrcs=(unsigned int) (id >> IDMINORBITS) + 1;
         }
+
+        /* Index sources by interface index for lookup by isactive() */
+        if ((rptr->srcindex=(struct srclist **) calloc(rptr->nsrcs,
+                sizeof(struct srclist *))) == NULL)
+            return(-1);
+        for (sptr=rptr->info.source;sptr;sptr=sptr->next)
+            if (rptr->srcindex[sptr->src.id >> IDMINORBITS] == NULL)
+                rptr->srcindex[sptr->src.id >> IDMINORBITS]=sptr;
+    }
     return(0);
 }
 
@@ -1044,6 +3192,9 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
 {
     struct kopts *optr;
     size_t qsize=DEFQUEUESZ;
+    int reassemble=0;
+    double initwait;
+    char *ptr;
     struct if_engine *ifg = (struct if_engine *) e_info->info;
 
     if (e_info->options) {
@@ -1053,6 +3204,11 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
         e_info->options = options;
     }
 
+    /* "initwait" in the global section of a config file is parsed as an
+     * option common to all interfaces */
+    if (e_info->initwait >= 0)
+        ifg->initwait=e_info->initwait;
+
     for (optr=e_info->options;optr;optr=optr->next) {
         if (!strcasecmp(optr->var,"qsize")) {
             if(!(qsize = atoi(optr->val))) {
@@ -1095,6 +3251,47 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
                 fprintf(stderr,"Strict option must be either \'yes\' or \'no\'\n");
                 exit(1);
             }
+        } else if (!strcasecmp(optr->var,"reassemble")) {
+            if (!strcasecmp(optr->val,"yes"))
+                reassemble=1;
+            else if (!strcasecmp(optr->val,"no"))
+                reassemble=0;
+            else {
+                fprintf(stderr,"Reassemble option must be either \'yes\' or \'no\'\n");
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"reassemblytime")) {
+            errno=0;
+            ifg->aistimeout=(int64_t) strtoumax(optr->val,&ptr,0);
+            if (errno || ptr == optr->val || *ptr) {
+                fprintf(stderr,"Bad value for reassemblytime: %s\n",optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"dedup")) {
+            errno=0;
+            if (((ifg->dedupwindow=(int64_t) strtoumax(optr->val,NULL,0)) == 0)
+                    && (errno)) {
+                fprintf(stderr,"Bad value for dedup: %s\n",optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"history")) {
+            errno=0;
+            if (((ifg->histsize=(size_t) strtoumax(optr->val,NULL,0)) == 0)
+                    && (errno)) {
+                fprintf(stderr,"Bad value for history: %s\n",optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"initwait")) {
+            if ((initwait=strtod(optr->val,&ptr)) < 0 || *ptr) {
+                fprintf(stderr,"Bad value for initwait: %s\n",optr->val);
+                exit(1);
+            }
+            ifg->initwait=(int64_t) (initwait*1000);
+        } else if (!strcasecmp(optr->var,"initthreads")) {
+            if ((ifg->initthreads=atoi(optr->val)) <= 0) {
+                fprintf(stderr,"Bad value for initthreads: %s\n",optr->val);
+                exit(1);
+            }
         } else if (!strcasecmp(optr->var,"failover")) {
             if (addfailover(&e_info->ofilter,optr->val) != 0) {
                 fprintf(stderr,"Failed to add failover %s\n",optr->val);
@@ -1106,6 +3303,19 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
         }
     }
 
+    if (reassemble && (ifg->aisgroups = (struct aisgroup *)
+            calloc(AISPENDING,sizeof(struct aisgroup))) == NULL) {
+        perror("failed to allocate AIS reassembly buffers");
+        exit(1);
+    }
+
+    if (ifg->dedupwindow && (ifg->dedup = (struct dedupent *)
+            calloc(DEDUPSLOTS,sizeof(struct dedupent))) == NULL) {
+        perror("failed to allocate duplicate suppression table");
+        exit(1);
+    }
+
+    ifg->qsize=qsize;
     if (init_q(e_info, qsize) < 0) {
         perror("failed to initiate queue");
         exit(1);
@@ -1161,108 +3371,331 @@ size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
         if (ifa->tagflags & TAG_MS)
             ptr += sprintf(ptr,"%03u",((unsigned) tv.tv_usec+500)/1000);
     }
+
+    if (ifa->tagflags & TAG_SEQ) {
+        if (ptr != buf+1)
+            *ptr++=',';
+        ptr+=sprintf(ptr,"n:%llu",(unsigned long long) sptr->seq);
+    }
     /* Don't include initial '/' */
     cksum=calcsum(buf+1,(len=ptr-buf)-1);
     len+=sprintf(ptr,"*%02X\\",cksum);
     return(len);
 }
 
-/* generic read routine
- * Args: Interface Pointer
- * Returns: nothing
- */ 
-void do_read(iface_t *ifa)
+/*
+ * Find the sequence number ("n:" field) in a received TAG block
+ * Args: Pointer to start of TAG block and to the end of it
+ * Returns: Sequence number or 0 if there is none
+ */
+static uint64_t tagseq(char *tag, char *end)
 {
-    senblk_t sblk;
-    char buf[BUFSIZ];
-    char tbuf[TAGMAX];
-    char *bptr,*eptr,*ptr;
-    int nread,countmax,count=0;
-    enum sstate senstate;
-    int nocr=flag_test(ifa,F_NOCR)?1:0;
-    int loose = (ifa->strict)?0:1;
-    sblk.src=ifa->id;
-    senstate=SEN_NODATA;
+    uint64_t seq=0;
 
-    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
-        for(bptr=buf,eptr=buf+nread;bptr<eptr;bptr++) {
-            switch (*bptr) {
-            case '$':
-            case '!':
-                ptr=sblk.data;
-                countmax=SENMAX-(nocr|loose);
-                count=1;
+    for (tag++;tag < end-1;tag++) {
+        if (*tag == 'n' && *(tag+1) == ':' && (*(tag-1) == '\\' ||
+                *(tag-1) == ',')) {
+            for (tag+=2;tag < end && isdigit(*tag);tag++)
+                seq=seq*10+(*tag-'0');
+            break;
+        }
+    }
+    return(seq);
+}
+
+/*
+ * Find the time ("c:" field) in a received TAG block
+ * Args: Pointer to start of TAG block and to the end of it
+ * Returns: Time in ms since the epoch or -1 if there is none
+ * The standard specifies seconds but some equipment gives milliseconds
+ */
+static int64_t tagtime(char *tag, char *end)
+{
+    int64_t t=-1;
+
+    for (tag++;tag < end-1;tag++) {
+        if (*tag == 'c' && *(tag+1) == ':' && (*(tag-1) == '\\' ||
+                *(tag-1) == ',')) {
+            for (t=0,tag+=2;tag < end && isdigit(*tag);tag++)
+                t=t*10+(*tag-'0');
+            if (t < 100000000000LL)
+                t*=1000;
+            break;
+        }
+    }
+    return(t);
+}
+
+/*
+ * Monotonic clock in nanoseconds for scheduling replay
+ * Args: None
+ * Returns: Time in ns
+ */
+static int64_t nsclock(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC,&ts) == 0)
+        return((int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+    return(msclock() * 1000000);
+}
+
+/*
+ * Wait until a sentence being replayed is due
+ * Args: Replay state, time of the sentence in ms since the epoch (-1 if not
+ * known)
+ * Returns: Nothing
+ * Sentences are scheduled against absolute deadlines measured from the
+ * first so that errors don't accumulate.  Sentences without a time, or with
+ * a time earlier than the one before, are sent straight away.  In the latter
+ * case timing restarts from that sentence
+ */
+void replay_wait(struct replay *rp, int64_t when)
+{
+    int64_t offset,due;
+    struct timespec ts;
+
+    if (rp->speed == 0)
+        return;
+
+    if (rp->rate)
+        offset=(int64_t) (rp->count++ * 1e9 / (rp->rate * rp->speed));
+    else {
+        if (when < 0)
+            return;
+        if (rp->started && when < rp->last)
+            rp->started=0;
+        if (!rp->started)
+            rp->first=when;
+        rp->last=when;
+        offset=(int64_t) ((when - rp->first) * 1e6 / rp->speed);
+    }
+
+    if (!rp->started) {
+        rp->base=nsclock();
+        rp->started=1;
+        return;
+    }
+
+    due=rp->base+offset;
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+    ts.tv_sec=due/1000000000;
+    ts.tv_nsec=due%1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL) == EINTR);
+#else
+    if ((offset=due-nsclock()) > 0) {
+        ts.tv_sec=offset/1000000000;
+        ts.tv_nsec=offset%1000000000;
+        while (nanosleep(&ts,&ts) < 0 && errno == EINTR);
+    }
+#endif
+}
+
+/*
+ * Initialise the sentence parsing state for an input
+ * Args: Interface pointer, pointer to state
+ * Returns: Nothing
+ */
+void init_rdstate(iface_t *ifa, struct rdstate *rs)
+{
+    rs->sblk.src=ifa->id;
+    rs->sblk.enc=NULL;
+    rs->sblk.ts=0;
+    rs->ptr=NULL;
+    rs->count=rs->countmax=0;
+    rs->seq=0;
+    rs->tagtime=-1;
+    rs->senstate=SEN_NODATA;
+    rs->nocr=flag_test(ifa,F_NOCR)?1:0;
+    rs->loose=(ifa->strict)?0:1;
+    rs->replay=NULL;
+    rs->hold=rs->ready=0;
+}
+
+/*
+ * Extract sentences from input data and pass them on
+ * Args: Interface pointer, parsing state, data, length of data
+ * Returns: Number of bytes of data consumed
+ * Sentences may span calls.  Timestamps are taken from the state's senblk,
+ * which the caller sets.  If the state's "hold" flag is set, parsing stops
+ * after each complete sentence, which is left in the state's senblk with
+ * "ready" set, unfiltered, for the caller to take
+ */
+size_t parse_input(iface_t *ifa, struct rdstate *rs, char *buf, size_t len)
+{
+    senblk_t *sptr=&rs->sblk;
+    char *bptr,*eptr;
+    char *ptr=rs->ptr;
+    int count=rs->count;
+    int countmax=rs->countmax;
+    enum sstate senstate=rs->senstate;
+    int nocr=rs->nocr;
+    int loose=rs->loose;
+
+    for(bptr=buf,eptr=buf+len;bptr<eptr && !rs->ready;bptr++) {
+        switch (*bptr) {
+        case '$':
+        case '!':
+            rs->seq=(senstate == SEN_TAGSEEN)?tagseq(rs->tbuf,ptr):0;
+            if (rs->replay || rs->hold)
+                rs->tagtime=(senstate == SEN_TAGSEEN)?
+                        tagtime(rs->tbuf,ptr):-1;
+            ptr=sptr->data;
+            countmax=SENMAX-(nocr|loose);
+            count=1;
+            *ptr++=*bptr;
+            senstate=SEN_SENPROC;
+            continue;
+        case '\\':
+            if (senstate==SEN_TAGPROC) {
                 *ptr++=*bptr;
-                senstate=SEN_SENPROC;
-                continue;
-            case '\\':
-                if (senstate==SEN_TAGPROC) {
-                    *ptr++=*bptr;
-                    senstate=SEN_TAGSEEN;
+                senstate=SEN_TAGSEEN;
+            } else {
+                senstate=SEN_TAGPROC;
+                ptr=rs->tbuf;
+                countmax=TAGMAX-1;
+                *ptr++=*bptr;
+                count=1;
+            }
+            continue;
+        case '\r':
+        case '\n':
+        case '\0':
+            if (senstate == SEN_SENPROC || senstate == SEN_TAGSEEN) {
+                if (loose || (nocr && *bptr == '\n')) {
+                    *ptr++='\r';
+                    *ptr='\n';
+                    sptr->len = count+2;
                 } else {
-                    senstate=SEN_TAGPROC;
-                    ptr=tbuf;
-                    countmax=TAGMAX-1;
-                    *ptr++=*bptr;
-                    count=1;
-                }
-                continue;
-            case '\r':
-            case '\n':
-            case '\0':
-                if (senstate == SEN_SENPROC || senstate == SEN_TAGSEEN) {
-                    if (loose || (nocr && *bptr == '\n')) {
-                        *ptr++='\r';
-                        *ptr='\n';
-                        sblk.len = count+2;
+                    if ((!nocr) && *bptr == '\r') {
+                        senstate = SEN_CR;
+                        *ptr++=*bptr;
+                        ++count;
                     } else {
-                        if ((!nocr) && *bptr == '\r') {
-                            senstate = SEN_CR;
-                            *ptr++=*bptr;
-                            ++count;
-                        } else {
-                            senstate = SEN_NODATA;
-                        }
-                        continue;
-                    }
-                } else if (senstate == SEN_CR) {
-                    if (*bptr != '\n') {
                         senstate = SEN_NODATA;
-                        continue;
                     }
-                    *ptr=*bptr;
-                    sblk.len = ++count;
-                } else {
-                    senstate = SEN_NODATA;
                     continue;
                 }
-                if (!(ifa->checksum && checkcksum(&sblk) && (sblk.len > 0 )) &&
-                        senfilter(&sblk,ifa->ifilter) == 0) {
-                    push_senblk(&sblk,ifa->q);
+            } else if (senstate == SEN_CR) {
+                if (*bptr != '\n') {
+                    senstate = SEN_NODATA;
+                    continue;
                 }
-                senstate=SEN_NODATA;
+                *ptr=*bptr;
+                sptr->len = ++count;
+            } else {
+                senstate = SEN_NODATA;
                 continue;
-            default:
-                break;
             }
-
-            if (senstate != SEN_SENPROC && senstate != SEN_TAGPROC) {
-                if (senstate != SEN_NODATA )
-                    senstate=SEN_NODATA;
-                continue;
+            if (!(ifa->checksum && checkcksum(sptr) && (sptr->len > 0 ))) {
+                if (rs->hold)
+                    rs->ready=1;
+                else if (senfilter(sptr,ifa->ifilter,ifa) == 0) {
+                    if (rs->replay) {
+                        replay_wait(rs->replay,rs->tagtime);
+                        sptr->ts=mstime();
+                    }
+                    publish(sptr,ifa);
+                    if (rs->seq)
+                        ifa->lastseq=rs->seq;
+                }
             }
+            senstate=SEN_NODATA;
+            continue;
+        default:
+            break;
+        }
 
-            if (count++ > countmax) {
+        if (senstate != SEN_SENPROC && senstate != SEN_TAGPROC) {
+            if (senstate != SEN_NODATA )
                 senstate=SEN_NODATA;
-                continue;
-            }
+            continue;
+        }
 
-            *ptr++=*bptr;
+        if (count++ > countmax) {
+            senstate=SEN_NODATA;
+            continue;
         }
+
+        *ptr++=*bptr;
+    }
+
+    rs->ptr=ptr;
+    rs->count=count;
+    rs->countmax=countmax;
+    rs->senstate=senstate;
+    return(bptr-buf);
+}
+
+/* generic read routine
+ * Args: Interface Pointer
+ * Returns: nothing
+ */ 
+void do_read(iface_t *ifa)
+{
+    struct rdstate rs;
+    char buf[BUFSIZ];
+    int nread;
+
+    init_rdstate(ifa,&rs);
+    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
+        rs.sblk.ts=mstime();
+        parse_input(ifa,&rs,buf,nread);
     }
     iface_thread_exit(errno);
 }
 
+/*
+ * Allocate an id for a source of sentences which is not an interface in its
+ * own right, e.g. one of the files merged by a file input
+ * Args: Name of the source (not copied)
+ * Returns: id on success, 0 on failure
+ * May be called from any thread once interfaces have been given their ids.
+ * The id can be used in filters like that of any interface, but only sources
+ * added during initialisation can be named in filter rules
+ */
+srcid_t new_srcid(char *name)
+{
+    static pthread_mutex_t idx_mutex = PTHREAD_MUTEX_INITIALIZER;
+    srcid_t id;
+
+    pthread_mutex_lock(&idx_mutex);
+    if (lastidx == MAXINTERFACES) {
+        pthread_mutex_unlock(&idx_mutex);
+        logerr(0,"Too many interfaces");
+        return(0);
+    }
+    id=(srcid_t) ++lastidx<<IDMINORBITS;
+    pthread_mutex_unlock(&idx_mutex);
+    if (insertname(name,id) < 0)
+        return(0);
+    return(id);
+}
+
+/*
+ * Allocate an id for a new connection to or from an interface
+ * Args: Interface pointer
+ * Returns: id
+ * Connections are numbered in turn rather than by file descriptor so that a
+ * new connection doesn't take the id of a recently closed one.  May be called
+ * from any thread
+ */
+srcid_t new_connid(iface_t *ifa)
+{
+    static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static srcid_t lastconn=0;
+    srcid_t conn;
+
+    pthread_mutex_lock(&conn_mutex);
+    /* 0 is the interface itself */
+    if ((conn=++lastconn & IDMINORMASK) == 0)
+        conn=++lastconn & IDMINORMASK;
+    pthread_mutex_unlock(&conn_mutex);
+    return(ifa->id+conn);
+}
+
 /* Make an interface name based on file type and index
  * Args: Pointer to interface structure and index
  * Returns: Pointer to newly malloced string containing constructed name
@@ -1315,10 +3748,19 @@ int main(int argc, char ** argv)
     int opt,err=0;
     void *ret;
     struct kopts *options=NULL;
-    sigset_t set;
+    sigset_t set,saved;
+    struct initpool pool = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    struct initjob *job;
+    pthread_attr_t attr;
+    struct timespec ts;
+    int64_t start,deadline;
     struct iolists lists = {
         /* initialize io_mutex separately below */
         .init_mutex = PTHREAD_MUTEX_INITIALIZER,
+        .hist_mutex = PTHREAD_MUTEX_INITIALIZER,
         .init_cond = PTHREAD_COND_INITIALIZER,
         .dead_cond = PTHREAD_COND_INITIALIZER,
     .initialized = NULL,
@@ -1391,6 +3833,14 @@ int main(int argc, char ** argv)
 
     engine->lists = &lists;
     lists.engine=engine;
+    lists.bus[0]=engine;
+
+    if ((lists.histsize=((struct if_engine *) engine->info)->histsize) &&
+            (lists.history=(struct histent *) calloc(lists.histsize,
+            sizeof(struct histent))) == NULL) {
+        perror("failed to allocate sentence history");
+        exit(1);
+    }
 
     for (tiptr=&engine->next;optind < argc;optind++) {
         if (!(ifptr=parse_arg(argv[optind]))) {
@@ -1403,6 +3853,13 @@ int main(int argc, char ** argv)
         tiptr=&ifptr->next;
     }
 
+    /* Create an engine for each additional bus named in the interface specs */
+    for (i=1;i<MAXBUSES && bus_name(i);i++)
+        if ((lists.bus[i]=new_bus(engine,i)) == NULL) {
+            fprintf(stderr,"Failed to create bus %s\n",bus_name(i));
+            exit(1);
+        }
+
     /* We choose to go into the background here before interface initialzation
      * rather than later. Disadvantage: Errors don't get fed back on stderr.
      * Advantage: We can close all the file descriptors now rather than pulling
@@ -1444,18 +3901,15 @@ int main(int argc, char ** argv)
     /* log to stderr or syslog, as appropriate */
     initlog((ifg->flags & K_NOSTDERR)?ifg->logto:-1);
 
-    /* Lower max open files if necessary. We do this to ensure that ids for
-     * all connections can be represented in IDMINORBITS. Actually we only
-     * need to do that per server, so this is a bit of a hack and should be
-     * corrected
-     */
+    /* Connection ids don't depend on file descriptors, so allow as many
+     * open files (and hence connections) as the hard limit permits */
     if (getrlimit(RLIMIT_NOFILE,&lim) < 0)
             logterm(errno,"Couldn't get resource limits");
-    if (lim.rlim_cur > 1<<IDMINORBITS) {
-        logwarn("Lowering NOFILE from %u to %u",lim.rlim_cur,1<<IDMINORBITS);
-        lim.rlim_cur=1<<IDMINORBITS;
+    if (lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur=lim.rlim_max;
         if(setrlimit(RLIMIT_NOFILE,&lim) < 0)
-            logterm(errno,"Could not set file descriptor limit");
+            DEBUG(2,"Could not raise file descriptor limit to %llu",
+                    (unsigned long long) lim.rlim_max);
     }
 
     DEBUG(1,"kplex starting, config file %s",
@@ -1463,18 +3917,25 @@ int main(int argc, char ** argv)
 
     /* our list of "real" interfaces starts after the first which is the
      * dummy "interface" specifying the multiplexing engine
-     * walk the list, initialising the interfaces.  Sometimes "BOTH" interfaces
-     * are initialised to one IN and one OUT which then need to be linked back
-     * into the list
+     * walk the list, naming the interfaces and making a job to initialise
+     * each one.  All the names are known before any initialisation so that
+     * filters can refer to any interface
      */
-    for (ifptr=engine->next,tiptr=&lists.initialized,i=0;ifptr;ifptr=ifptr2) {
+    for (ifptr=engine->next;ifptr;ifptr=ifptr->next)
+        pool.njobs++;
+    if (pool.njobs && (pool.jobs=(struct initjob *) calloc(pool.njobs,
+            sizeof(struct initjob))) == NULL)
+        logterm(errno,"Could not allocate memory");
+
+    start=mstime();
+    for (ifptr=engine->next,job=pool.jobs;ifptr;ifptr=ifptr2,job++) {
         ifptr2 = ifptr->next;
 
-        if (i == MAXINTERFACES)
+        if (lastidx == MAXINTERFACES)
             logterm(0,"Too many interfaces");
-        ifptr->id=++i<<IDMINORBITS;
+        ifptr->id=(srcid_t) ++lastidx<<IDMINORBITS;
         if (!ifptr->name) {
-            if (!(ifptr->name=mkname(ifptr,i)))
+            if (!(ifptr->name=mkname(ifptr,lastidx)))
                 logterm(errno,"Failed to make interface name");
         }
 
@@ -1482,8 +3943,83 @@ int main(int argc, char ** argv)
             logterm(errno,"Failed to associate interface name and id");
 
         ifptr->lists = &lists;
+        /* Interfaces initialised as an IN/OUT pair are linked to each other */
+        ifptr->next = NULL;
+        job->ifa=ifptr;
+        if (ifptr->initwait < 0)
+            ifptr->initwait=ifg->initwait;
+        job->deadline=(ifptr->initwait < 0)?-1:start+ifptr->initwait;
+    }
+
+    /* Interfaces which finish initialising late notify the reaper, so it
+     * must be known before any initialisation thread is created */
+    reaper=pthread_self();
+
+    /* Initialise interfaces concurrently with signals blocked as they will
+     * be for interface threads */
+    pool.left=pool.njobs;
+    sigemptyset(&set);
+    sigaddset(&set,SIGUSR1);
+    sigaddset(&set,SIGUSR2);
+    sigaddset(&set,SIGALRM);
+    sigaddset(&set,SIGTERM);
+    sigaddset(&set,SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, &saved);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+    for (i=0;i<pool.njobs && i<ifg->initthreads;i++)
+        if (pthread_create(&tid,&attr,init_worker,(void *) &pool))
+            logterm(errno,"Could not create initialisation thread");
+    pthread_attr_destroy(&attr);
+    /* Keep late start notifications pending until we sigwait() for them */
+    pthread_sigmask(SIG_SETMASK,&saved,NULL);
+    sigemptyset(&set);
+    sigaddset(&set,SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    /* Wait until all interfaces are initialised or those which aren't have
+     * passed their deadlines.  Late interfaces are started by the thread
+     * initialising them, which needs io_mutex to do so */
+    pthread_mutex_lock(&lists.io_mutex);
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.left) {
+        for (deadline=0,job=pool.jobs;job<pool.jobs+pool.njobs;job++)
+            if (!job->done && (job->deadline < 0 ||
+                    job->deadline > deadline))
+                if ((deadline=job->deadline) < 0)
+                    break;
+        if (deadline < 0)
+            pthread_cond_wait(&pool.cond,&pool.mutex);
+        else if (deadline <= mstime())
+            break;
+        else {
+            ts.tv_sec=deadline/1000;
+            ts.tv_nsec=(deadline%1000)*1000000;
+            (void) pthread_cond_timedwait(&pool.cond,&pool.mutex,&ts);
+        }
+    }
+    for (job=pool.jobs;job<pool.jobs+pool.njobs;job++)
+        if (!(job->ready=job->done)) {
+            DEBUG(2,"%s: still initialising: starting without it",
+                    job->ifa->name);
+            lists.pending++;
+        }
+    pool.started=1;
+    pthread_mutex_unlock(&pool.mutex);
+
+    /* Sometimes "BOTH" interfaces are initialised to one IN and one OUT
+     * which then both need to be linked into the list */
+    for (job=pool.jobs,tiptr=&lists.initialized;job<pool.jobs+pool.njobs;
+            job++) {
+        ifptr=job->ifa;
+        if (!job->ready) {
+            /* Assume an input until we know otherwise */
+            if (ifptr->direction != OUT)
+                gotinputs=1;
+            continue;
+        }
 
-        if ((rptr=(*iftypes[ifptr->type].init_func)(ifptr)) == NULL) {
+        if ((rptr=job->ret) == NULL) {
             logerr(0,"Failed to initialize Interface %s",(ifptr->name)?
                     ifptr->name:"(unnamed)");
             if (!flag_test(ifptr,F_OPTIONAL)) {
@@ -1504,17 +4040,9 @@ int main(int argc, char ** argv)
          * interfaces where the initialisation routine has expanded them to an
          * IN/OUT pair.
          */
-            if (ifptr->direction == IN)
-                ifptr->q=engine->q;
-
-            if (ifptr->checksum <0)
-                ifptr->checksum = engine->checksum;
-            if (ifptr->strict <0)
-                ifptr->strict = engine->strict;
+            ready_iface(ifptr);
             (*tiptr)=ifptr;
             tiptr=&ifptr->next;
-            if (ifptr->next==ifptr2)
-                ifptr->next=NULL;
         }
     }
 
@@ -1536,6 +4064,7 @@ int main(int argc, char ** argv)
     }
 
     if (timetodie) {
+        pthread_mutex_unlock(&lists.io_mutex);
         for (ifptr=lists.initialized;ifptr;ifptr=ifptr2) {
             ifptr2=ifptr->next;
             iface_destroy(ifptr);
@@ -1543,14 +4072,14 @@ int main(int argc, char ** argv)
         exit(1);
     }
 
-    if (name2id(engine->ofilter))
+    for (i=0;i<MAXBUSES;i++)
+        if (lists.bus[i] && name2id(lists.bus[i]->ofilter))
             logterm(errno,"Failed to translate interface names to IDs");
 
     if (engine->options)
         free_options(engine->options);
 
     pthread_setspecific(ifkey,(void *)&lists);
-    reaper=pthread_self();
 
     sigemptyset(&set);
     sigemptyset(&sa.sa_mask);
@@ -1565,9 +4094,11 @@ int main(int argc, char ** argv)
     pthread_sigmask(SIG_BLOCK, &set, NULL);
     sigdelset(&set,SIGUSR1);
     signal(SIGPIPE,SIG_IGN);
-    pthread_create(&tid,NULL,run_engine,(void *) engine);
+    for (i=0;i<MAXBUSES;i++)
+        if (lists.bus[i])
+            pthread_create(&tid,NULL,run_engine,(void *) lists.bus[i]);
 
-    pthread_mutex_lock(&lists.io_mutex);
+    /* io_mutex is already held */
     for (ifptr=lists.initialized;ifptr;ifptr=ifptr->next) {
         /* Check we've got at least one input */
         if ((ifptr->direction == IN ) || (ifptr->direction == BOTH))
@@ -1584,10 +4115,7 @@ int main(int argc, char ** argv)
      */
     if (!gotinputs) {
         logerr(0,"No Inputs!");
-        pthread_mutex_lock(&engine->q->q_mutex);
-        engine->q->active=0;
-        pthread_cond_broadcast(&engine->q->freshmeat);
-        pthread_mutex_unlock(&engine->q->q_mutex);
+        stop_buses(&lists);
         timetodie++;
     }
 
@@ -1597,8 +4125,10 @@ int main(int argc, char ** argv)
      * Note that when there are no more inputs, we set the
      * engine's queue inactive causing it to set all the outputs' queues
      * inactive and shutting them down. Thus the last input exiting also shuts
-     * everything down */
-    while (lists.outputs || lists.inputs || lists.dead) {
+     * everything down.  Interfaces still being initialised are waited for
+     * unless we're shutting down */
+    while (lists.outputs || lists.inputs || lists.dead ||
+            (lists.pending && !timetodie)) {
         if (lists.dead  == NULL && (timetodie <= 0)) {
             pthread_mutex_unlock(&lists.io_mutex);
             /* Here we're waiting for SIGTERM/SIGINT (user shutdown requests),
@@ -1609,7 +4139,10 @@ int main(int argc, char ** argv)
             pthread_mutex_lock(&lists.io_mutex);
         }
 
-        if ((timetodie > 0) || ( lists.outputs == NULL && (timetodie == 0)) ||
+        /* Interfaces started late are on the initialized list until their
+         * threads have moved them to the input or output list */
+        if ((timetodie > 0) || (lists.outputs == NULL && lists.pending == 0 &&
+                lists.initialized == NULL && (timetodie == 0)) ||
                 rcvdsig == SIGTERM || rcvdsig == SIGINT) {
             timetodie=-1;
             /* Once we've caught a user shutdown address we don't need to be
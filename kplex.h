@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #ifdef __APPLE__
 #include <AvailabilityMacros.h>
@@ -39,12 +40,19 @@
 
 #define SENMAX 80
 #define SENBUFSZ 84
+/* Largest frame on a kplex protocol link */
+#define KPMAXFRAME 4096
 #define TAGMAX 80
+/* Number of interfaces initialised at once */
+#define DEFINITTHREADS 8
 #define DEFPORT 10110
 #define DEFPORTSTRING "10110"
-#define IDMINORBITS 16
-#define IDMINORMASK ((1<<IDMINORBITS)-1)
-#define MAXINTERFACES 65535
+/* Source ids: interface index in the upper bits, connection number in the
+ * lower */
+typedef uint64_t srcid_t;
+#define IDMINORBITS 32
+#define IDMINORMASK ((((srcid_t) 1)<<IDMINORBITS)-1)
+#define MAXINTERFACES 0xffffffffU
 
 #define BUFSIZE 1024
 
@@ -54,6 +62,9 @@
 #define F_LOOPBACK 4
 #define F_OPTIONAL 8
 #define F_NOCR 16
+#define F_SUBSCRIBE 32
+#define F_KPLEX 64
+#define F_NODROP 128
 
 #define flag_test(a,b) (a->flags & b)
 #define flag_set(a,b) (a->flags |= b)
@@ -64,6 +75,7 @@
 #define TAG_MS 2
 #define TAG_SRC 4
 #define TAG_ISRC 8
+#define TAG_SEQ 16
 
 extern int debuglevel;
 #define DEBUG(level,...) if (debuglevel >= level) logdebug(0, __VA_ARGS__)
@@ -111,6 +123,14 @@ enum iotype {
     BOTH
 };
 
+/* Output formats. FMT_NMEA (unencoded) must be first */
+enum oformat {
+    FMT_NMEA,
+    FMT_JSON,
+    FMT_BIN
+};
+#define NFORMATS 3
+
 enum udptype {
     UDP_UNSPEC,
     UDP_UNICAST,
@@ -118,32 +138,228 @@ enum udptype {
     UDP_MULTICAST
 };
 
+/* Number of partially dropped AIS messages a queue remembers */
+#define AISORPHANS 4
+/* AIS reassembly: max fragments per message, messages pending at once and
+ * default time (ms) to wait for outstanding fragments */
+#define AISMAXFRAGS 9
+/* How often (ms) an input waiting for room on a queue checks for SIGUSR1 */
+#define ROOMCHECK 100
+#define AISPENDING 16
+#define DEFREASSEMBLYTIME 2000
+/* Rate limiter state table size (power of 2) and probe limit */
+#define RATESLOTS 256
+#define RATEPROBES 8
+/* Maximum number of routing buses, including the default bus */
+#define MAXBUSES 32
+/* Number of sentence ids for which failover rule lookups are cached */
+#define FAILCACHESLOTS 64
+/* Maximum number of sentences held by a decimating queue.  Each sentence of a
+ * multi-sentence group (e.g. GSV) takes a slot, two while a newer group is
+ * being collected */
+#define DECIMATETYPES 64
+/* Duplicate suppression hash table size (power of 2) and probe limit */
+#define DEDUPSLOTS 4096
+#define DEDUPPROBES 8
+/* Most sentences replayed by a REWIND per acquisition of the io_mutex */
+#define REWINDBATCH 64
+/* Sentences waiting to be written to a spill file */
+#define SPILLSTAGE 64
+
+/* Sentence encoded in a format other than NMEA, shared by reference count
+ * between the queues of all outputs using that format */
+struct encbuf {
+    int refs;
+    size_t len;
+    char data[];
+};
+
 struct senblk {
     size_t len;
-    unsigned int src;
+    srcid_t src;
     struct senblk *next;
+    struct encbuf *enc;
+    int64_t ts;
+    uint64_t seq;
     char data[SENBUFSZ];
 };
 typedef struct senblk senblk_t;
 
+/* Pacing of sentences replayed from a file */
+struct replay {
+    double speed;
+    double rate;
+    int started;
+    uint64_t count;
+    int64_t first;
+    int64_t last;
+    int64_t base;
+};
+
+/* State of sentence parsing for an input, kept between reads */
+struct rdstate {
+    senblk_t sblk;
+    char tbuf[TAGMAX];
+    char *ptr;
+    int count;
+    int countmax;
+    uint64_t seq;
+    int64_t tagtime;
+    enum sstate senstate;
+    int nocr;
+    int loose;
+    int hold;
+    int ready;
+    struct replay *replay;
+};
+
+/* Data to be output for a senblk: encoded form if there is one */
+#define senblk_out(s) ((s)->enc?(s)->enc->data:(s)->data)
+#define senblk_outlen(s) ((s)->enc?(s)->enc->len:(s)->len)
+
 typedef struct iface iface_t;
 
+/* Multi-fragment AIS message from which fragments have been dropped */
+struct aisorphan {
+    srcid_t src;
+    unsigned int seq;
+    size_t nfrags;
+    size_t frag;
+};
+
+/* Multi-fragment AIS message being reassembled by the engine */
+struct aisgroup {
+    srcid_t src;
+    unsigned int seq;
+    size_t nfrags;
+    size_t count;
+    int64_t started;
+    senblk_t frags[AISMAXFRAGS];
+};
+
+/* Recently seen sentence for duplicate suppression */
+struct dedupent {
+    uint64_t hash;
+    int64_t seen;
+    srcid_t src;
+};
+
+/* Sentence retained in the history for resuming clients.  "clock" is the
+ * monotonic time (msclock()) at which it was added, as the time the
+ * sentence was received may step */
+struct histent {
+    uint32_t bus;
+    int64_t clock;
+    senblk_t sblk;
+};
+
+/* A spill file is the 8 byte magic "KPLXSPL" <version> followed by a
+ * header and data for each sentence.  The header is:
+ *   <u64 source id> <u32 length> <i64 time (ms since epoch)> <u64 seq>
+ * with all integers little-endian.  Files which don't start with the
+ * current magic and version are discarded */
+#define SPILLMAGIC "KPLXSPL"
+#define SPILLVERSION 2
+#define SPILLMAGICLEN 8
+#define SPILLHDRLEN 28
+
+/* File holding sentences which overflowed an output queue.  Sentences are
+ * staged in memory and written by a thread of their own so that no disk i/o
+ * is done by the engines.  Fields other than the file descriptor are
+ * protected by the spill's own mutex, taken after the queue's q_mutex when
+ * both are held.  The writer never takes q_mutex (an exiting output may hold
+ * it while waiting for the writer to finish) so signals that staged
+ * sentences have been written on a condition of the spill's own */
+struct spill {
+    pthread_mutex_t mutex;
+    int fd;
+    off_t rd;
+    off_t wr;
+    off_t max;
+    int64_t interval;
+    int64_t due;
+    size_t reclen;
+    int out;
+    senblk_t sblk;
+    pthread_t tid;
+    pthread_cond_t cond;
+    pthread_cond_t written;
+    senblk_t stage[SPILLSTAGE];
+    size_t first;
+    size_t nstaged;
+    size_t writing;
+    off_t staged;
+    int trunc;
+    int stop;
+};
+
+/* Replay of the history to an output from a given time */
+struct rewind {
+    struct iolists *lists;
+    srcid_t id;
+    uint64_t token;
+    uint64_t seq;
+    double speed;
+};
+
+/* Latest sentence of each type pending release from a decimating queue.
+ * Sentences from multi-sentence groups are kept by sentence number, with
+ * "pending" set for those of a group not yet complete */
+struct decimator {
+    struct timespec due;
+    int64_t period;
+    int ntypes;
+    senblk_t latest[DECIMATETYPES];
+    int part[DECIMATETYPES];
+    char pending[DECIMATETYPES];
+};
+
 struct ioqueue {
     iface_t *owner;
     pthread_mutex_t    q_mutex;
     pthread_cond_t    freshmeat;
+    pthread_cond_t    roomfree;
+    int waiting;
     int active;
     int drops;
     senblk_t *free;
     senblk_t *qhead;
     senblk_t *qtail;
     senblk_t *base;
+    size_t size;
+    int norphans;
+    int orphanidx;
+    struct aisorphan orphans[AISORPHANS];
+    struct decimator *decimate;
+    struct spill *spill;
 };
 typedef struct ioqueue ioqueue_t;
 
+/* Type specific initialisation of an interface at startup */
+struct initjob {
+    struct iface *ifa;
+    struct iface *ret;
+    int64_t deadline;
+    int done;
+    int ready;
+};
+
+/* Threads initialising interfaces at startup.  Interfaces which haven't
+ * finished by their deadline are started by the thread initialising them */
+struct initpool {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct initjob *jobs;
+    size_t njobs;
+    size_t next;
+    size_t left;
+    int started;
+};
+
 struct iolists {
     pthread_mutex_t io_mutex;
     pthread_mutex_t init_mutex;
+    pthread_mutex_t hist_mutex; /* Guards seq, history, rewinds and rewind */
     pthread_cond_t  dead_cond;
     pthread_cond_t  init_cond;
     struct iface *initialized;
@@ -151,6 +367,12 @@ struct iolists {
     struct iface *inputs;
     struct iface *dead;
     struct iface *engine;
+    struct iface *bus[MAXBUSES];
+    uint64_t seq;
+    struct histent *history;
+    size_t histsize;
+    uint64_t rewinds;
+    int pending;
 };
 
 struct kopts {
@@ -161,17 +383,16 @@ struct kopts {
 
 struct srclist {
     union {
-    unsigned int  id;
+    srcid_t id;
     char *name;
     } src;
-    time_t failtime;
-    time_t lasttime;
+    int64_t failtime;
+    int64_t lasttime;
     struct srclist *next;
 };
 
 struct ratelimit {
     time_t timeout;
-    struct timeval last;
 };
 
 struct sfilter_rule {
@@ -181,27 +402,52 @@ struct sfilter_rule {
         struct srclist *source;
     } info;
     union {
-        unsigned int id;
+        srcid_t id;
         char *name;
     } src;
     char match[5];
+    struct srclist **srcindex;
+    unsigned int nsrcs;
     struct sfilter_rule *next;
 };
 
 typedef struct sfilter_rule sf_rule_t;
 
+/* Failover rule found for a given sentence id */
+struct failcache {
+    char id[5];
+    sf_rule_t *rule;
+};
+
 struct sfilter {
     enum filtertype type;
     pthread_mutex_t lock;
     unsigned int refcount;
     sf_rule_t *rules;
+    struct failcache *cache;
 };
 
 typedef struct sfilter sfilter_t;
 
+/* Time a sentence type from a given source last passed a rate limit rule */
+struct ratestate {
+    sf_rule_t *rule;
+    srcid_t src;
+    char id[5];
+    int64_t last;
+};
+
+/* An interface's rate limit state.  Its subscription filter is applied by the
+ * engine and rewinder threads as well as the interface's own thread, so the
+ * slots are protected by a lock */
+struct ratetable {
+    pthread_mutex_t lock;
+    struct ratestate slot[RATESLOTS];
+};
+
 struct iface {
     pthread_t tid;
-    unsigned int id;
+    srcid_t id;
     char *name;
     struct iface *pair;
     enum iotype direction;
@@ -215,8 +461,16 @@ struct iface {
     int strict;
     unsigned int flags;
     unsigned int tagflags;
+    uint32_t buses;
+    enum oformat format;
+    int64_t decimation;
+    int64_t initwait;
     sfilter_t *ifilter;
     sfilter_t *ofilter;
+    struct ratetable *ratelimits;
+    sfilter_t *subscription;
+    uint64_t lastseq;
+    uint64_t rewind;
     void (*cleanup)(struct iface *);
     void (*read)(struct iface *);
     void (*write)(struct iface *);
@@ -240,9 +494,24 @@ struct iftypedef {
 struct if_engine {
     unsigned flags;
     int logto;
+    int bus;
+    size_t qsize;
+    int64_t aistimeout;
+    struct aisgroup *aisgroups;
+    int64_t dedupwindow;
+    struct dedupent *dedup;
+    size_t histsize;
+    int64_t initwait;
+    int initthreads;
+    pthread_mutex_t olock;
+    struct iface **outputs;
+    size_t nout;
+    size_t maxout;
 };
 
 int mysleep(time_t);
+int64_t msclock(void);
+int64_t mstime(void);
 
 iface_t *init_file( iface_t *);
 iface_t *init_serial(iface_t *);
@@ -264,15 +533,23 @@ void *ifdup_mcast(void *);
 void *ifdup_seatalk(void *);
 
 int init_q(iface_t *, size_t);
+int init_spill(ioqueue_t *, char *, off_t, int);
+int bus_lookup(char *);
+char *bus_name(int);
+ioqueue_t *bus_queue(iface_t *);
 
 senblk_t *next_senblk(ioqueue_t *);
 senblk_t *last_senblk(ioqueue_t *);
+senblk_t *try_senblk(ioqueue_t *);
 void push_senblk(senblk_t *, ioqueue_t *);
+void publish(senblk_t *, iface_t *);
 void senblk_free(senblk_t *, ioqueue_t *);
+void encbuf_release(struct encbuf *);
 void flush_queue(ioqueue_t *);
 int link_interface(iface_t *);
 int unlink_interface(iface_t *);
 int link_to_initialized(iface_t *);
+int name2id(sfilter_t *);
 void start_interface(void *);
 iface_t *ifdup(iface_t *);
 void iface_thread_exit(int);
@@ -282,6 +559,7 @@ int calcsum(const char *, size_t);
 iface_t *parse_file(char *);
 iface_t *parse_arg(char *);
 iface_t *get_default_global(void);
+void init_engine(struct if_engine *, struct if_engine *);
 void free_options(struct kopts *);
 void free_filter(sfilter_t *);
 void logerr(int,char *,...);
@@ -292,15 +570,45 @@ void logwarn(char *,...);
 void loginfo(char *,...);
 void initlog(int);
 sfilter_t *addfilter(sfilter_t *);
-int senfilter(senblk_t *,sfilter_t *);
+sfilter_t *getfilter(char *);
+int senfilter(senblk_t *,sfilter_t *,iface_t *);
 int checkcksum(senblk_t *);
-unsigned int namelookup(char *);
-char *idlookup(unsigned int);
-int insertname(char *, unsigned int);
+int is_ais(char *,size_t,size_t *,size_t *,unsigned int *);
+srcid_t namelookup(char *);
+char *idlookup(srcid_t);
+int insertname(char *, srcid_t);
 void freenames(void);
 int cmdlineopt(struct kopts **, char *);
+void init_rdstate(iface_t *, struct rdstate *);
+srcid_t new_srcid(char *);
+srcid_t new_connid(iface_t *);
+size_t parse_input(iface_t *, struct rdstate *, char *, size_t);
+void replay_wait(struct replay *, int64_t);
 void do_read(iface_t *);
 size_t gettag(iface_t *, char *, senblk_t *);
+void read_kplex(iface_t *);
+size_t kproto_batch(iface_t *, senblk_t *, unsigned char *, size_t, uint64_t *);
+unsigned char *put_varint(unsigned char *, uint64_t);
+void put_le32(unsigned char *, uint32_t);
+void put_le64(unsigned char *, uint64_t);
+uint32_t get_le32(const unsigned char *);
+uint64_t get_le64(const unsigned char *);
+int get_varint(unsigned char **, unsigned char *, uint64_t *);
+struct capture *capture_open(int, const char *, int, int64_t);
+int capture_add(struct capture *, senblk_t *);
+int capture_close(struct capture *);
+void read_capture(iface_t *, int, const char *, int64_t, int64_t,
+        struct replay *);
+struct capreader *capture_reader(int, const char *, int64_t, srcid_t);
+int capture_next(struct capreader *, senblk_t *);
+void capture_free(struct capreader *);
+void capture_names(int, const char *);
+struct resolver *resolver_add(const char *, const char *, int, int, time_t,
+        struct sockaddr *, socklen_t, int);
+void resolver_free(struct resolver *);
+int resolver_get(struct resolver *, struct sockaddr_storage *, socklen_t *,
+        int *, unsigned long *);
+void resolver_kick(struct resolver *);
 
 extern struct iftypedef iftypes[];
 
@@ -0,0 +1,274 @@
+/* kproto.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Compact binary protocol for links between kplex instances ("proto=kplex")
+ *
+ * Sentences are sent in frames:
+ *   'K' <version> <varint body length> <body>
+ * The body is:
+ *   <varint count> <varint sequence number of first sentence>
+ *   <varint ingress time (ms since epoch) of first sentence>
+ * followed by count sentences, each:
+ *   <zigzag varint time delta in ms from previous sentence> <varint length>
+ *   <sentence without <CR><LF>>
+ * Varints are unsigned LEB128: 7 bits per byte, least significant first, top
+ * bit set on all but the last byte.
+ * Received sentences take the id of the receiving interface, so the source
+ * interface index each sentence carried in version 1 is no longer sent.
+ */
+
+#include "kplex.h"
+
+#define KPMAGIC 'K'
+#define KPVERSION 2
+#define KPHDRMAX 12
+/* Longest sentence (without <CR><LF>) which fits in a senblk.  Used by both
+ * encoder and decoder */
+#define KPSENLEN (SENBUFSZ-2)
+/* Worst case encoded size of a single sentence */
+#define KPSENMAX (10+2+KPSENLEN)
+#define KPMAXCOUNT 255
+
+/*
+ * Store little-endian fixed size integers
+ * Args: Pointer to buffer, value to store
+ * Returns: Nothing
+ */
+void put_le32(unsigned char *ptr, uint32_t val)
+{
+    int i;
+
+    for (i=0;i<4;i++,val>>=8)
+        ptr[i]=(unsigned char) val;
+}
+
+void put_le64(unsigned char *ptr, uint64_t val)
+{
+    int i;
+
+    for (i=0;i<8;i++,val>>=8)
+        ptr[i]=(unsigned char) val;
+}
+
+/*
+ * Load little-endian fixed size integers
+ * Args: Pointer to data
+ * Returns: Value
+ */
+uint32_t get_le32(const unsigned char *ptr)
+{
+    return((uint32_t) ptr[0] | (uint32_t) ptr[1] << 8 |
+            (uint32_t) ptr[2] << 16 | (uint32_t) ptr[3] << 24);
+}
+
+uint64_t get_le64(const unsigned char *ptr)
+{
+    return((uint64_t) get_le32(ptr) | (uint64_t) get_le32(ptr+4) << 32);
+}
+
+/*
+ * Encode an unsigned varint
+ * Args: Pointer to buffer, value to encode
+ * Returns: Pointer to the byte following the encoded value
+ */
+unsigned char *put_varint(unsigned char *ptr, uint64_t val)
+{
+    while (val >= 0x80) {
+        *ptr++ = (unsigned char) (val | 0x80);
+        val >>= 7;
+    }
+    *ptr++ = (unsigned char) val;
+    return(ptr);
+}
+
+/*
+ * Decode an unsigned varint
+ * Args: Pointer to pointer to data (advanced past the value), end of data,
+ * pointer to result
+ * Returns: 0 on success, -1 if the data end before the value or the value is
+ * too long
+ */
+int get_varint(unsigned char **pptr, unsigned char *end, uint64_t *val)
+{
+    unsigned char *ptr=*pptr;
+    int shift;
+
+    for (*val=0,shift=0;ptr<end && shift < 64;shift+=7) {
+        *val |= (uint64_t) (*ptr & 0x7f) << shift;
+        if (!(*ptr++ & 0x80)) {
+            *pptr=ptr;
+            return(0);
+        }
+    }
+    return(-1);
+}
+
+/*
+ * Encode a batch of sentences as a frame
+ * Args: Output interface, first senblk (already taken from the queue and
+ * filtered), frame buffer, buffer size, pointer to link sequence number
+ * Returns: Length of frame
+ * Side Effects: Further senblks available on the interface's queue are taken
+ * and filtered to fill the frame, and returned to the free list once encoded.
+ * The senblk passed in is not freed. The sequence number is advanced by the
+ * number of sentences sent
+ */
+size_t kproto_batch(iface_t *ifa, senblk_t *sptr, unsigned char *frame,
+        size_t size, uint64_t *seq)
+{
+    unsigned char body[KPMAXFRAME];
+    unsigned char *bptr,*hptr;
+    senblk_t *tptr;
+    int64_t last;
+    size_t count,len;
+
+    if (size > KPMAXFRAME)
+        size=KPMAXFRAME;
+    size-=KPHDRMAX;
+
+    /* Leave room for the count (which goes first) at the start of the body */
+    bptr=put_varint(body+3,*seq);
+    bptr=put_varint(bptr,(uint64_t) sptr->ts);
+
+    for (last=sptr->ts,count=0,tptr=sptr;tptr;) {
+        if ((len=tptr->len-2) > KPSENLEN)
+            len=KPSENLEN;
+        bptr=put_varint(bptr,(uint64_t) ((tptr->ts-last) << 1) ^
+                (uint64_t) ((tptr->ts-last) >> 63));
+        bptr=put_varint(bptr,len);
+        memcpy(bptr,tptr->data,len);
+        bptr+=len;
+        last=tptr->ts;
+        if (tptr != sptr)
+            senblk_free(tptr,ifa->q);
+
+        if (++count == KPMAXCOUNT || (bptr-body) + KPSENMAX > size)
+            break;
+
+        while ((tptr=try_senblk(ifa->q)) != NULL &&
+                senfilter(tptr,ifa->ofilter,ifa))
+            senblk_free(tptr,ifa->q);
+    }
+    *seq+=count;
+
+    /* Count is at most KPMAXCOUNT so takes no more than the 3 bytes left */
+    hptr=put_varint(body,count);
+    len=bptr-body-3;
+    memmove(hptr,body+3,len);
+    len+=hptr-body;
+
+    frame[0]=KPMAGIC;
+    frame[1]=KPVERSION;
+    hptr=put_varint(frame+2,len);
+    memcpy(hptr,body,len);
+    return(hptr+len-frame);
+}
+
+/*
+ * Decode the body of a frame and pass the sentences in it on
+ * Args: Interface, pointer to body, length of body, pointer to expected
+ * sequence number
+ * Returns: 0 on success, -1 if the frame is invalid
+ * Sentences which are too long or too short are skipped without affecting
+ * the rest of the frame
+ */
+static int kproto_decode(iface_t *ifa, unsigned char *ptr, size_t len,
+        uint64_t *expected)
+{
+    unsigned char *end=ptr+len;
+    uint64_t count,seq,ts,val,slen;
+    senblk_t sblk;
+
+    if (get_varint(&ptr,end,&count) || get_varint(&ptr,end,&seq) ||
+            get_varint(&ptr,end,&ts))
+        return(-1);
+
+    if (*expected && seq != *expected)
+        DEBUG(3,"%s: kplex link sequence %llu, expected %llu",ifa->name,
+                (unsigned long long) seq, (unsigned long long) *expected);
+    *expected=seq+count;
+
+    sblk.src=ifa->id;
+    sblk.enc=NULL;
+    sblk.next=NULL;
+    for (;count;count--) {
+        if (get_varint(&ptr,end,&val) || get_varint(&ptr,end,&slen) ||
+                slen > (uint64_t) (end-ptr))
+            return(-1);
+        ts += (int64_t) (val >> 1) ^ -(int64_t) (val & 1);
+        if (slen > KPSENLEN || slen < 1) {
+            DEBUG(3,"%s: Skipping kplex record of length %llu",ifa->name,
+                    (unsigned long long) slen);
+            ptr+=slen;
+            continue;
+        }
+        memcpy(sblk.data,ptr,slen);
+        ptr+=slen;
+        sblk.data[slen++]='\r';
+        sblk.data[slen++]='\n';
+        sblk.len=slen;
+        sblk.ts=(int64_t) ts;
+        if (*sblk.data != '$' && *sblk.data != '!')
+            continue;
+        if (!(ifa->checksum && checkcksum(&sblk)) &&
+                senfilter(&sblk,ifa->ifilter,ifa) == 0)
+            publish(&sblk,ifa);
+    }
+    return(0);
+}
+
+/*
+ * Read routine for interfaces using the kplex protocol.  Used in place of
+ * do_read()
+ * Args: Interface Pointer
+ * Returns: nothing
+ */
+void read_kplex(iface_t *ifa)
+{
+    unsigned char buf[KPMAXFRAME+BUFSIZ];
+    unsigned char *ptr,*end,*bptr;
+    uint64_t expected=0,len;
+    ssize_t nread;
+    size_t used=0;
+
+    while ((nread=(*ifa->readbuf)(ifa,(char *) buf+used)) > 0) {
+        used+=nread;
+        for (ptr=buf,end=buf+used;ptr<end;) {
+            if (*ptr != KPMAGIC) {
+                /* Resynchronise */
+                ptr++;
+                continue;
+            }
+            if (end-ptr < 3)
+                break;
+            bptr=ptr+2;
+            if (ptr[1] != KPVERSION || get_varint(&bptr,end,&len)) {
+                if (end-ptr < KPHDRMAX && ptr[1] == KPVERSION)
+                    break;
+                ptr++;
+                continue;
+            }
+            if (len > KPMAXFRAME) {
+                ptr++;
+                continue;
+            }
+            if (bptr+len > end)
+                break;
+            if (kproto_decode(ifa,bptr,len,&expected) < 0) {
+                DEBUG(3,"%s: Bad kplex frame",ifa->name);
+                ptr++;
+                continue;
+            }
+            ptr=bptr+len;
+        }
+        used=end-ptr;
+        if (used > KPMAXFRAME) {
+            /* Can't be a valid frame: discard */
+            used=0;
+        } else if (used)
+            memmove(buf,ptr,used);
+    }
+    iface_thread_exit(errno);
+}
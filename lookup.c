@@ -14,30 +14,33 @@
 
 /* Structures holding the name to id mappings in a linked list */
 struct nameid {
-    unsigned int id;
+    srcid_t id;
     char * name;
     struct nameid *next;
 };
 
-/* This is used before we start multiple threads */
+/* Names may be added by interfaces initialised after others have started */
 static struct nameid *idlist;
+static pthread_rwlock_t idlock = PTHREAD_RWLOCK_INITIALIZER;
 
 /*
  * Return an interface name given an ID
  * Args: interface id
  * Returns: pointer to interface name if found, NULL otherwise
  */
-char * idlookup(unsigned int id)
+char * idlookup(srcid_t id)
 {
     struct nameid *nptr;
-    id&=~((unsigned int) IDMINORMASK);
+    id&=~IDMINORMASK;
 
+    pthread_rwlock_rdlock(&idlock);
     for (nptr=idlist;nptr;nptr=nptr->next) {
         if (nptr->id == id)
-            return(nptr->name);
+            break;
     }
+    pthread_rwlock_unlock(&idlock);
 
-    return(NULL);
+    return(nptr?nptr->name:NULL);
 }
 
 /*
@@ -45,7 +48,7 @@ char * idlookup(unsigned int id)
  * Args: Pointer to a name
  * Returns: Interface id on success, 0 otherwise
  */
-unsigned int namelookup(char *name)
+srcid_t namelookup(char *name)
 {
     int ret;
     struct nameid *nptr;
@@ -55,15 +58,18 @@ unsigned int namelookup(char *name)
         return(0);
     }
 
+    pthread_rwlock_rdlock(&idlock);
     for (nptr=idlist;nptr;nptr=nptr->next) {
         if((ret=strcasecmp(name,nptr->name))) {
-            if (ret<0)
-                return(0);
-        } else {
-            return(nptr->id);
-        }
+            if (ret<0) {
+                nptr=NULL;
+                break;
+            }
+        } else
+            break;
     }
-    return(0);
+    pthread_rwlock_unlock(&idlock);
+    return(nptr?nptr->id:0);
 }
 
 /*
@@ -72,25 +78,30 @@ unsigned int namelookup(char *name)
  * Returns: 0 on success, -1 otherwise
  * Side Effects: structure is created and linked into the list of mappings
  */
-int insertname(char *name, unsigned int id)
+int insertname(char *name, srcid_t id)
 {
     struct nameid *nptr,**nptrp;
     int ret;
 
+    if ((nptr = (struct nameid *)malloc(sizeof(struct nameid))) == NULL) {
+        logerr(errno,"Memory allocation failed");
+        return(-1);
+    }
+    nptr->name=name;
+    nptr->id=id;
+
+    pthread_rwlock_wrlock(&idlock);
     for (nptrp=&idlist;(*nptrp);nptrp=&(*nptrp)->next)
         if ((ret=strcasecmp(name,(*nptrp)->name)) == 0) {
+            pthread_rwlock_unlock(&idlock);
+            free(nptr);
             logwarn("%s used as name for more than one interface",name);
             return(-1);
         } else if (ret < 0 )
             break;
-    if ((nptr = (struct nameid *)malloc(sizeof(struct nameid))) < 0) {
-        logerr(errno,"Memory allocation failed");
-        return(-1);
-    }
-    nptr->name=name;
-    nptr->id=id;
     nptr->next=(*nptrp);
     *nptrp=nptr;
+    pthread_rwlock_unlock(&idlock);
     return(0);
 }
 
@@ -83,8 +83,8 @@ void write_mcast(struct iface *ifa)
 
     if (ifa->tagflags) {
         if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
+                logerr(errno,"Disabing tag output on interface id %llx (%s)",
+                        (unsigned long long) ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
         } else {
             msgh.msg_iovlen=2;
@@ -96,23 +96,23 @@ void write_mcast(struct iface *ifa)
         if ((sptr = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
+        if (senfilter(sptr,ifa->ofilter,ifa)) {
             senblk_free(sptr,ifa->q);
             continue;
         }
 
         if (ifa->tagflags)
             if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
+                logerr(errno,"Disabing tag output on interface id %llx (%s)",
+                        (unsigned long long) ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
                 msgh.msg_iovlen=1;
                 data=0;
                 free(iov[0].iov_base);
             }
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        iov[data].iov_base=senblk_out(sptr);
+        iov[data].iov_len=senblk_outlen(sptr);
 
         if (sendmsg(ifb->fd,&msgh,0) < 0)
             break;
@@ -214,10 +214,13 @@ struct iface *init_mcast(struct iface *ifa)
     }
 
     if (!service) {
+        /* getservbyname() isn't thread safe */
+        pthread_mutex_lock(&ifa->lists->init_mutex);
         if ((svent = getservbyname("nmea-0183","udp")) != NULL)
-            service=svent->s_name;
+            service="nmea-0183";
         else
             service=DEFPORTSTRING;
+        pthread_mutex_unlock(&ifa->lists->init_mutex);
     }
 
     memset((void *)&hints,0,sizeof(hints));
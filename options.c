@@ -19,6 +19,9 @@
 /* This is used before we start multiple threads */
 static char configbuf[BUFSIZE];
 
+/* Names of routing buses. Bus 0 is the default bus */
+static char *busnames[MAXBUSES] = { "default" };
+
 void lineerror(unsigned int line)
 {
     fprintf(stderr,"Error parsing config file at line %d\n",line);
@@ -229,6 +232,40 @@ struct kopts *add_option(char *var, char *val)
     return(vv);
 }
 
+/*
+ * Find the index of a routing bus, registering it if not already known
+ * Args: Bus name
+ * Returns: Index of the bus, -1 if there are too many buses or on error
+ * Only called during configuration, before multiple threads are started
+ */
+int bus_lookup(char *name)
+{
+    int i;
+
+    for (i=0;i<MAXBUSES && busnames[i];i++)
+        if (!strcasecmp(busnames[i],name))
+            return(i);
+
+    if (i == MAXBUSES || !*name)
+        return(-1);
+
+    if ((busnames[i]=strdup(name)) == NULL)
+        return(-1);
+    return(i);
+}
+
+/*
+ * Get the name of a routing bus
+ * Args: Bus index
+ * Returns: Bus name or NULL if there is no such bus
+ */
+char *bus_name(int bus)
+{
+    if (bus < 0 || bus >= MAXBUSES)
+        return(NULL);
+    return(busnames[bus]);
+}
+
 sfilter_t *getfilter(char *fstring)
 {
     char *sptr;
@@ -312,6 +349,7 @@ sfilter_t *getfilter(char *fstring)
             pthread_mutex_init(&head->lock,NULL);
             head->refcount=1;
             head->rules=filter;
+            head->cache=NULL;
             return(head);
         }
     }
@@ -328,6 +366,8 @@ sfilter_t *getfilter(char *fstring)
 int add_common_opt(char *var, char *val,iface_t *ifp)
 {
     char *ptr;
+    double period;
+    int bus;
 
     if (!strcasecmp(var,"direction")) {
         if (!strcasecmp(val,"in"))
@@ -379,6 +419,13 @@ int add_common_opt(char *var, char *val,iface_t *ifp)
             ifp->tagflags |= TAG_ISRC;
         } else
             return(-2);
+    } else if (!strcmp(var,"seqtag")) {
+        if (!strcasecmp(val,"yes")) {
+            ifp->tagflags |= TAG_SEQ;
+        } else if (!strcasecmp(val,"no")) {
+            ifp->tagflags &= ~TAG_SEQ;
+        } else
+            return(-2);
     } else if (!strcmp(var,"persist")) {
         if (!strcasecmp(val,"yes")) {
             flag_set(ifp,F_PERSIST);
@@ -412,11 +459,39 @@ int add_common_opt(char *var, char *val,iface_t *ifp)
             flag_clear(ifp,F_NOCR);
         } else
             return(-2);
+    } else if (!strcmp(var,"bus")) {
+        for (ifp->buses=0;*val;val=ptr) {
+            for (ptr=val;*ptr && *ptr != ':';ptr++);
+            if (*ptr)
+                *ptr++='\0';
+            if ((bus=bus_lookup(val)) < 0)
+                return(-2);
+            ifp->buses |= 1U << bus;
+        }
+    } else if (!strcmp(var,"format")) {
+        if (!strcasecmp(val,"nmea"))
+            ifp->format=FMT_NMEA;
+        else if (!strcasecmp(val,"json"))
+            ifp->format=FMT_JSON;
+        else if (!strcasecmp(val,"bin"))
+            ifp->format=FMT_BIN;
+        else
+            return(-2);
+    } else if (!strcmp(var,"decimate")) {
+        if ((period=strtod(val,&ptr)) <= 0 || *ptr)
+            return(-2);
+        if ((ifp->decimation=(int64_t) (period * 1000)) == 0)
+            ifp->decimation=1;
+    } else if (!strcmp(var,"initwait")) {
+        if ((period=strtod(val,&ptr)) < 0 || *ptr)
+            return(-2);
+        ifp->initwait=(int64_t) (period * 1000);
     } else if (!strcasecmp(var,"name")) {
         if ((ifp->name=(char *)malloc(strlen(val)+1)) == NULL)
             return(-1);
         for (ptr=ifp->name;*val;)
                 *ptr++= *val++;
+        *ptr='\0';
     } else
         return(1);
 
@@ -450,6 +525,7 @@ iface_t *get_config(FILE *fp, unsigned int *line, enum itype type)
     ifp->direction = BOTH;
     ifp->checksum=-1;
     ifp->strict=-1;
+    ifp->initwait=-1;
     ifp->type=type;
 
     /* Set defaults */
@@ -522,8 +598,7 @@ iface_t *parse_file(char *fname)
                 perror("Error creating interface");
                 exit(1);
             }
-            ifg->flags=0;
-            ifg->logto=LOG_DAEMON;
+            init_engine(ifg,NULL);
             ifp->info = (void *)ifg;
             if (ifp->strict <0)
                 ifp->strict = 1;
@@ -561,6 +636,7 @@ iface_t *parse_arg(char *arg)
     ifp->direction = BOTH;
     ifp->checksum=-1;
     ifp->strict=-1;
+    ifp->initwait=-1;
 
     for(ptr=arg;*ptr && *ptr != ':';ptr++);
     if (!*ptr) {
@@ -0,0 +1,272 @@
+/* resolve.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Background host name resolution ("resolve=" option for network clients)
+ *
+ * A single thread re-resolves registered host/service pairs periodically so
+ * that interfaces reconnecting to a host whose address has changed pick up
+ * the new address without doing lookups (which may block for some time) in
+ * their own threads.  Interfaces can ask for an early lookup when a
+ * connection attempt fails.
+ */
+
+#include "kplex.h"
+#include <netdb.h>
+#include <time.h>
+#include <signal.h>
+
+/* Minimum time between lookups of the same name when asked for early ones */
+#define RESMINGAP 1
+
+struct resolver {
+    char *host;
+    char *port;
+    int family;
+    int socktype;
+    time_t interval;
+    time_t due;
+    time_t last;
+    socklen_t sa_len;
+    struct sockaddr_storage sa;
+    int protocol;
+    unsigned long gen;
+    int busy;
+    int dead;
+    struct resolver *next;
+};
+
+static pthread_mutex_t res_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t res_cond = PTHREAD_COND_INITIALIZER;
+static struct resolver *resolvers;
+static int res_started;
+
+/*
+ * Look up a resolver's name and update its address if it has changed
+ * Args: resolver (marked busy by the caller, which must not hold res_mutex)
+ * Returns: Nothing
+ * Side effects: The current address is kept if it is still amongst those
+ * returned.  Otherwise the first suitable one replaces it and the generation
+ * count is incremented.  res_mutex is taken to make the update.
+ */
+static void refresh(struct resolver *r)
+{
+    struct addrinfo hints,*abase,*aptr;
+    char abuf[INET6_ADDRSTRLEN];
+    int err;
+
+    memset((void *)&hints,0,sizeof(hints));
+    hints.ai_family=r->family;
+    hints.ai_socktype=r->socktype;
+
+    if ((err=getaddrinfo(r->host,r->port,&hints,&abase))) {
+        DEBUG(3,"Lookup failed for host %s/service %s: %s",r->host,r->port,
+                gai_strerror(err));
+        return;
+    }
+
+    pthread_mutex_lock(&res_mutex);
+    for (aptr=abase;aptr;aptr=aptr->ai_next)
+        if (aptr->ai_addrlen == r->sa_len &&
+                !memcmp(aptr->ai_addr,&r->sa,r->sa_len))
+            break;
+
+    if (aptr == NULL && abase) {
+        aptr=abase;
+        r->sa_len=aptr->ai_addrlen;
+        (void) memcpy(&r->sa,aptr->ai_addr,aptr->ai_addrlen);
+        r->protocol=aptr->ai_protocol;
+        r->gen++;
+        if (getnameinfo(aptr->ai_addr,aptr->ai_addrlen,abuf,sizeof(abuf),
+                NULL,0,NI_NUMERICHOST) == 0)
+            DEBUG(3,"Address for %s now %s",r->host,abuf);
+    }
+    pthread_mutex_unlock(&res_mutex);
+    freeaddrinfo(abase);
+}
+
+/*
+ * Resolver thread: refresh each registered name when it is due
+ * Args: unused
+ * Returns: Never
+ */
+static void *resolve_loop(void *arg)
+{
+    struct resolver *r,*next,**rptr;
+    struct timespec ts;
+    time_t now;
+
+    pthread_mutex_lock(&res_mutex);
+    for (;;) {
+        for (next=NULL,r=resolvers;r;r=r->next)
+            if (!r->busy && (next == NULL || r->due < next->due))
+                next=r;
+
+        if (next == NULL) {
+            pthread_cond_wait(&res_cond,&res_mutex);
+            continue;
+        }
+
+        if ((now=time(NULL)) < next->due) {
+            ts.tv_sec=next->due;
+            ts.tv_nsec=0;
+            (void) pthread_cond_timedwait(&res_cond,&res_mutex,&ts);
+            continue;
+        }
+
+        next->busy=1;
+        pthread_mutex_unlock(&res_mutex);
+        refresh(next);
+        pthread_mutex_lock(&res_mutex);
+        next->busy=0;
+        next->last=time(NULL);
+        next->due=next->last+next->interval;
+
+        if (next->dead) {
+            for (rptr=&resolvers;*rptr != next;rptr=&(*rptr)->next);
+            *rptr=next->next;
+            free(next->host);
+            free(next->port);
+            free(next);
+        }
+    }
+    return(NULL);
+}
+
+/*
+ * Register a name for background resolution
+ * Args: host, service, address family and socket type to look up, interval
+ * (seconds) between lookups, initial address (may be NULL if not known),
+ * length of initial address, initial protocol
+ * Returns: Pointer to new resolver or NULL on error
+ * Side effects: Resolver thread is started if it is not already running
+ */
+struct resolver *resolver_add(const char *host, const char *port, int family,
+        int socktype, time_t interval, struct sockaddr *sa, socklen_t sa_len,
+        int protocol)
+{
+    struct resolver *r;
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t set,saved;
+
+    if ((r=(struct resolver *) malloc(sizeof(struct resolver))) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return(NULL);
+    }
+    memset(r,0,sizeof(struct resolver));
+
+    if ((r->host=strdup(host)) == NULL || (r->port=strdup(port)) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        if (r->host)
+            free(r->host);
+        free(r);
+        return(NULL);
+    }
+    r->family=family;
+    r->socktype=socktype;
+    r->interval=interval;
+    r->last=time(NULL);
+    if (sa) {
+        r->sa_len=sa_len;
+        (void) memcpy(&r->sa,sa,sa_len);
+        r->protocol=protocol;
+        r->gen=1;
+        r->due=r->last+interval;
+    } else
+        r->due=r->last;
+
+    pthread_mutex_lock(&res_mutex);
+    if (!res_started) {
+        /* Signals are for interface threads */
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK,&set,&saved);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid,&attr,resolve_loop,NULL) != 0) {
+            logerr(errno,"Could not start resolver thread");
+            pthread_mutex_unlock(&res_mutex);
+            pthread_attr_destroy(&attr);
+            pthread_sigmask(SIG_SETMASK,&saved,NULL);
+            free(r->host);
+            free(r->port);
+            free(r);
+            return(NULL);
+        }
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK,&saved,NULL);
+        res_started=1;
+    }
+    r->next=resolvers;
+    resolvers=r;
+    pthread_cond_signal(&res_cond);
+    pthread_mutex_unlock(&res_mutex);
+    return(r);
+}
+
+/*
+ * Stop resolving a name and free its resolver
+ * Args: resolver
+ * Returns: Nothing
+ * Side effects: If a lookup is in progress the resolver thread frees the
+ * resolver when it completes
+ */
+void resolver_free(struct resolver *r)
+{
+    struct resolver **rptr;
+
+    pthread_mutex_lock(&res_mutex);
+    if (r->busy) {
+        r->dead=1;
+    } else {
+        for (rptr=&resolvers;*rptr != r;rptr=&(*rptr)->next);
+        *rptr=r->next;
+        free(r->host);
+        free(r->port);
+        free(r);
+    }
+    pthread_mutex_unlock(&res_mutex);
+}
+
+/*
+ * Get the latest address for a name if it has changed.  Never blocks on a
+ * lookup
+ * Args: resolver, address buffer, pointer to address length, pointer to
+ * protocol, pointer to generation of the address the caller has
+ * Returns: 1 if a new address was copied to the caller, 0 otherwise
+ */
+int resolver_get(struct resolver *r, struct sockaddr_storage *sa,
+        socklen_t *sa_len, int *protocol, unsigned long *gen)
+{
+    int ret=0;
+
+    pthread_mutex_lock(&res_mutex);
+    if (r->gen != *gen) {
+        *sa_len=r->sa_len;
+        (void) memcpy(sa,&r->sa,r->sa_len);
+        if (protocol)
+            *protocol=r->protocol;
+        *gen=r->gen;
+        ret=1;
+    }
+    pthread_mutex_unlock(&res_mutex);
+    return(ret);
+}
+
+/*
+ * Ask for an early lookup of a name, e.g. after failing to connect to it
+ * Args: resolver
+ * Returns: Nothing
+ */
+void resolver_kick(struct resolver *r)
+{
+    time_t when;
+
+    pthread_mutex_lock(&res_mutex);
+    if ((when=r->last+RESMINGAP) < r->due) {
+        r->due=when;
+        pthread_cond_signal(&res_cond);
+    }
+    pthread_mutex_unlock(&res_mutex);
+}
@@ -220,8 +220,8 @@ void write_serial(struct iface *ifa)
 
     if (ifa->tagflags) {
         if ((tbuf=malloc(TAGMAX)) == NULL) {
-            logerr(errno,"Disabing tag output on interface id %u (%s)",
-                ifa->id,(ifa->name)?ifa->name:"unlabelled");
+            logerr(errno,"Disabing tag output on interface id %llx (%s)",
+                (unsigned long long) ifa->id,(ifa->name)?ifa->name:"unlabelled");
             ifa->tagflags=0;
         }
     }
@@ -232,15 +232,15 @@ void write_serial(struct iface *ifa)
         if ((senblk_p = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(senblk_p,ifa->ofilter)) {
+        if (senfilter(senblk_p,ifa->ofilter,ifa)) {
             senblk_free(senblk_p,ifa->q);
             continue;
         }
 
         if (ifa->tagflags) {
             if ((tlen = gettag(ifa,tbuf,senblk_p)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                    ifa->id,(ifa->name)?ifa->name:"unlabelled");
+                logerr(errno,"Disabing tag output on interface id %llx (%s)",
+                    (unsigned long long) ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
                 free(tbuf);
             }
@@ -257,8 +257,8 @@ void write_serial(struct iface *ifa)
             }
         }
 
-        ptr=senblk_p->data;
-        tlen=senblk_p->len;
+        ptr=senblk_out(senblk_p);
+        tlen=senblk_outlen(senblk_p);
         while(tlen) {
             if ((n=write(fd,ptr,tlen)) < 0)
                 break;
@@ -414,17 +414,23 @@ struct iface *init_pty (struct iface *ifa)
         else if (!strcasecmp(opt->var,"filename"))
             devname=opt->val;
         else if (!strcasecmp(opt->var,"owner")) {
-            if ((owner=getpwnam(opt->val)) == NULL) {
+            pthread_mutex_lock(&ifa->lists->init_mutex);
+            if ((owner=getpwnam(opt->val)) != NULL)
+                uid=owner->pw_uid;
+            pthread_mutex_unlock(&ifa->lists->init_mutex);
+            if (owner == NULL) {
                 logerr(0,"No such user '%s'",opt->val);
                 return(NULL);
             }
-            uid=owner->pw_uid;
         } else if (!strcasecmp(opt->var,"group")) {
-            if ((group=getgrnam(opt->val)) == NULL) {
+            pthread_mutex_lock(&ifa->lists->init_mutex);
+            if ((group=getgrnam(opt->val)) != NULL)
+                gid=group->gr_gid;
+            pthread_mutex_unlock(&ifa->lists->init_mutex);
+            if (group == NULL) {
                 logerr(0,"No such group '%s'",opt->val);
                 return(NULL);
             }
-            gid=group->gr_gid;
         }
         else if (!strcasecmp(opt->var,"perm")) {
             for (cp=opt->val;*cp;cp++) {
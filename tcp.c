@@ -12,6 +12,7 @@
 #include <signal.h>
 #include <sys/uio.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 /*
  * Duplicate struct if_tcp
@@ -44,6 +45,9 @@ void *ifdup_tcp(void *ift)
 void cleanup_tcp(iface_t *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *)ifa->info;
+    struct tcp_endpoint *ep;
+    int i;
+
     if (ift->shared) {
         /* io_mutex is held in cleanup routines to serialize this */
         /* unlock shared mutex in case we were interupted whilst holding it */
@@ -56,6 +60,10 @@ void cleanup_tcp(iface_t *ifa)
             free(ift->shared->port);
         if (ift->shared->host)
             free(ift->shared->host);
+        if (ift->shared->abase)
+            freeaddrinfo(ift->shared->abase);
+        if (ift->shared->res)
+            resolver_free(ift->shared->res);
         if (ift->shared->preamble) {
             free((void *) ift->shared->preamble->string);
             free((void *) ift->shared->preamble);
@@ -65,6 +73,19 @@ void cleanup_tcp(iface_t *ifa)
         free(ift->shared);
     }
 
+    if (ift->multi) {
+        for (i=0;i<ift->multi->n;i++) {
+            ep=&ift->multi->ep[i];
+            if (ep->fd >= 0)
+                close(ep->fd);
+            if (ep->res)
+                resolver_free(ep->res);
+            free(ep->host);
+            free(ep->port);
+        }
+        free(ift->multi);
+    }
+
     close(ift->fd);
 }
 
@@ -92,6 +113,30 @@ int do_preamble(struct if_tcp *ift, struct tcp_preamble *preamble)
     return(0);
 }
 
+/*
+ * Ask a kplex server to resume sending after the last sentence received
+ * Args: Pointer to an if_tcp structure, input interface of the connection
+ * Returns: 0 on success, -1 on error or if nothing has been received
+ * Side effects: "$PKPXC,RESUME" command written to the interface's file
+ * descriptor
+ */
+static int do_resume(struct if_tcp *ift, iface_t *ifa)
+{
+    char buf[SENBUFSZ];
+    int len;
+
+    if (ifa == NULL || ifa->lastseq == 0)
+        return(-1);
+
+    len=sprintf(buf,"$PKPXC,RESUME,%llu",(unsigned long long) ifa->lastseq);
+    len+=sprintf(buf+len,"*%02X\r\n",calcsum(buf+1,len-1));
+    DEBUG(3,"%s: Resuming after sentence %llu",ifa->name,
+            (unsigned long long) ifa->lastseq);
+    if (write(ift->fd,buf,len) != len)
+        return(-1);
+    return(0);
+}
+
 /*
  * Set socket options to enable keepalives as required
  * Args: Pointer to an if_tcp structure
@@ -150,6 +195,204 @@ int establish_keepalive(struct if_tcp *ift)
     return(err);
 }
 
+/*
+ * Pick up any new address found by the background resolver
+ * Args: Pointer to interface
+ * Returns: Nothing
+ * Side effects: ift->shared->sa is replaced if the server's address has
+ * changed. ift->shared->t_mutex should be held by the calling routine
+ */
+static void update_addr(iface_t *ifa)
+{
+    struct if_tcp *ift = (struct if_tcp *) ifa->info;
+
+    if (ift->shared->res && resolver_get(ift->shared->res,&ift->shared->sa,
+            &ift->shared->sa_len,&ift->shared->protocol,&ift->shared->resgen))
+        DEBUG(3,"%s: Server address has changed",ifa->name);
+}
+
+/*
+ * Order addresses for connection attempts as suggested by RFC 8305:
+ * alternating between address families so that a broken path in one family
+ * doesn't hold up trying the other
+ * Args: Preferred address to try first (may be NULL), list of addresses
+ *       from getaddrinfo() (may be NULL), array to fill
+ * Returns: Number of addresses in the array (at most TCPMAXADDRS)
+ */
+static int order_addrs(struct addrinfo *first, struct addrinfo *list,
+        struct addrinfo **addrs)
+{
+    struct addrinfo *rest[TCPMAXADDRS];
+    struct addrinfo *aptr;
+    int i,j,n=0,nrest=0;
+
+    if (first)
+        addrs[n++]=first;
+
+    for (aptr=list;aptr && nrest < TCPMAXADDRS-n;aptr=aptr->ai_next) {
+        if (first && aptr->ai_addrlen == first->ai_addrlen &&
+                !memcmp(aptr->ai_addr,first->ai_addr,first->ai_addrlen))
+            continue;
+        rest[nrest++]=aptr;
+    }
+
+    while (nrest) {
+        for (i=0;i<nrest;i++)
+            if (n == 0 || rest[i]->ai_family != addrs[n-1]->ai_family)
+                break;
+        if (i == nrest)
+            i=0;
+        addrs[n++]=rest[i];
+        for (j=i+1;j<nrest;j++)
+            rest[j-1]=rest[j];
+        nrest--;
+    }
+    return(n);
+}
+
+/*
+ * Connect to whichever of a list of addresses answers first.  Rather than
+ * waiting for each attempt to fail before trying the next, a new attempt is
+ * started every "stagger" milliseconds whilst earlier ones are still in
+ * progress (RFC 8305 "Happy Eyeballs")
+ * Args: Array of addresses in the order to try them, number of addresses,
+ *       milliseconds between starting attempts (0 to wait for each attempt to
+ *       fail before starting the next), pointer to index of the address used
+ * Returns: Connected (blocking) socket on success, -1 on failure with errno
+ *          set to the error from the last attempt to fail
+ */
+static int stagger_connect(struct addrinfo **addrs, int n, long stagger,
+        int *chosen)
+{
+    struct pollfd pfd[TCPMAXADDRS];
+    int idx[TCPMAXADDRS];
+    int i,fd,fflags,soerr;
+    int started=0,active=0,win=-1,err=ECONNREFUSED;
+    int64_t now,next=0;
+    socklen_t len;
+
+    while (win < 0) {
+        now=msclock();
+        if (started < n && (active == 0 || (stagger && now >= next))) {
+            i=started++;
+            if ((fd=socket(addrs[i]->ai_family,SOCK_STREAM,
+                    addrs[i]->ai_protocol)) < 0) {
+                err=errno;
+                continue;
+            }
+            if ((fflags=fcntl(fd,F_GETFL)) < 0 ||
+                    fcntl(fd,F_SETFL,fflags | O_NONBLOCK) < 0) {
+                err=errno;
+                close(fd);
+                continue;
+            }
+            pfd[active].fd=fd;
+            pfd[active].events=POLLOUT;
+            idx[active]=i;
+            if (connect(fd,addrs[i]->ai_addr,addrs[i]->ai_addrlen) == 0) {
+                win=active++;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                err=errno;
+                close(fd);
+                continue;
+            }
+            active++;
+            next=now+stagger;
+            continue;
+        }
+
+        if (active == 0)
+            break;
+
+        if (poll(pfd,active,(started < n && stagger)?(int) (next-now):-1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err=errno;
+            break;
+        }
+
+        for (i=0;i<active;) {
+            if (pfd[i].revents == 0) {
+                i++;
+                continue;
+            }
+            len=sizeof(soerr);
+            if (getsockopt(pfd[i].fd,SOL_SOCKET,SO_ERROR,&soerr,&len) < 0)
+                soerr=errno;
+            if (soerr == 0) {
+                win=i;
+                break;
+            }
+            err=soerr;
+            close(pfd[i].fd);
+            pfd[i]=pfd[--active];
+            idx[i]=idx[active];
+        }
+    }
+
+    /* Abandon any attempts still in progress */
+    for (i=0;i<active;i++)
+        if (i != win)
+            close(pfd[i].fd);
+
+    if (win < 0) {
+        errno=err;
+        return(-1);
+    }
+
+    fd=pfd[win].fd;
+    if ((fflags=fcntl(fd,F_GETFL)) < 0 ||
+            fcntl(fd,F_SETFL,fflags & ~O_NONBLOCK) < 0) {
+        err=errno;
+        close(fd);
+        errno=err;
+        return(-1);
+    }
+    *chosen=idx[win];
+    return(fd);
+}
+
+/*
+ * (Re-)connect a persistent client to its server, trying the last address
+ * used (or one newly found by the background resolver) first and then any
+ * other addresses the server's name resolved to
+ * Args: Pointer to interface
+ * Returns: 0 on success, -1 on failure with errno set
+ * Side effects: ift->fd is set to the new connection (-1 on failure) and the
+ * address used is remembered in ift->shared->sa.  ift->shared->t_mutex should
+ * be held by the calling routine
+ */
+static int tcp_connect(iface_t *ifa)
+{
+    struct if_tcp *ift = (struct if_tcp *) ifa->info;
+    struct addrinfo last;
+    struct addrinfo *addrs[TCPMAXADDRS];
+    int n,i;
+
+    update_addr(ifa);
+
+    memset(&last,0,sizeof(last));
+    last.ai_family=ift->shared->sa.ss_family;
+    last.ai_socktype=SOCK_STREAM;
+    last.ai_protocol=ift->shared->protocol;
+    last.ai_addrlen=ift->shared->sa_len;
+    last.ai_addr=(struct sockaddr *) &ift->shared->sa;
+
+    n=order_addrs(ift->shared->sa_len?&last:NULL,ift->shared->abase,addrs);
+    if ((ift->fd=stagger_connect(addrs,n,ift->shared->stagger,&i)) < 0)
+        return(-1);
+
+    if (addrs[i] != &last) {
+        ift->shared->sa_len=addrs[i]->ai_addrlen;
+        (void) memcpy(&ift->shared->sa,addrs[i]->ai_addr,addrs[i]->ai_addrlen);
+        ift->shared->protocol=addrs[i]->ai_protocol;
+        DEBUG(3,"%s: Connected using alternative address",ifa->name);
+    }
+    return(0);
+}
+
 /*
  * Reconnect a lost connection in persist mode
  * Args: Pointer to interface and error raised by onnection failure
@@ -181,16 +424,14 @@ int reconnect(iface_t *ifa, int err)
         /* For most re-connections, closing and re-opening the socket is 
          * unnecessary, but we do it here for consistency */
         close(ift->fd);
-        if ((ift->fd=socket(ift->shared->sa.ss_family,SOCK_STREAM,
-                ift->shared->protocol)) < 0) {
-            logerr(errno,"Failed to create socket");
-            retval=-1;
-            break;
-        }
         DEBUG(6,"%s: Reconnecting...",ifa->name);
-        if (connect(ift->fd,(const struct sockaddr *)
-                &ift->shared->sa,ift->shared->sa_len) == 0) {
+        if (tcp_connect(ifa) == 0)
             break;
+
+        if (ift->shared->res) {
+            err=errno;
+            resolver_kick(ift->shared->res);
+            errno=err;
         }
 
         switch (errno) {
@@ -219,10 +460,16 @@ int reconnect(iface_t *ifa, int err)
         if (ift->shared->preamble){
             do_preamble(ift,NULL);
         }
+        if (ift->shared->resume)
+            (void) do_resume(ift,ifa->pair);
     }
 
-    DEBUG(7,"Flushing queue interface %s",ifa->name);
-    flush_queue(ifa->q);
+    /* When resuming or spilling, sentences queued whilst disconnected are
+     * still sent */
+    if (!ift->shared->resume && !ifa->q->spill) {
+        DEBUG(7,"Flushing queue interface %s",ifa->name);
+        flush_queue(ifa->q);
+    }
 
     pthread_mutex_unlock(&ift->shared->t_mutex);
     return(retval);
@@ -243,6 +490,7 @@ ssize_t reread(iface_t *ifa, char *buf, int bsize)
     ssize_t nread;
     int fflags;
     int on=1;
+    int connected=0;
 
     DEBUG(3,"%s: Reconnecting (read) interface",ifa->name);
     /* ift->shared->t_mutex should be held by the calling routine */
@@ -263,19 +511,13 @@ ssize_t reread(iface_t *ifa, char *buf, int bsize)
             /* An actual error as opposed to success but would block */
             for (nread=-1;nread!=0;) {
                 close(ift->fd);
-                if ((ift->fd=socket(ift->shared->sa.ss_family,SOCK_STREAM,
-                        ift->shared->protocol)) < 0) {
-                    logerr(errno,"Failed to create socket");
-                    nread=-1;
-                    break;
-                }
-
                 mysleep(ift->shared->retry);
                 DEBUG(7,"%s: Retrying connection...",ifa->name);
-                if ((nread=connect(ift->fd,
-                        (const struct sockaddr *)&ift->shared->sa,
-                        ift->shared->sa_len)) == 0)
+                if ((nread=tcp_connect(ifa)) == 0) {
                     DEBUG(3,"%s: Reconnected (read) interface",ifa->name);
+                    connected=1;
+                } else if (ift->shared->res)
+                    resolver_kick(ift->shared->res);
 
             }
         } else {
@@ -306,6 +548,9 @@ ssize_t reread(iface_t *ifa, char *buf, int bsize)
                     do_preamble(iftp,NULL);
             }
         }
+        /* If the writer reconnected it has already asked to resume */
+        if (nread == 0 && connected && ift->shared->resume)
+            (void) do_resume(ift,ifa);
     }
 
     return(nread);
@@ -404,11 +649,19 @@ void write_tcp(struct iface *ifa)
     int cnt=1;
     int done = 0;
     struct iovec iov[2];
+    unsigned char *frame=NULL;
+    uint64_t seq=0;
+
+    if (flag_test(ifa,F_KPLEX) &&
+            (frame=(unsigned char *) malloc(KPMAXFRAME)) == NULL) {
+        logerr(errno,"Could not allocate kplex protocol buffer");
+        iface_thread_exit(errno);
+    }
 
     if (ifa->tagflags) {
         if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
-                logerr(errno,"Disabing tag output on interface id %x (%s)",
-                        ifa->id,ifa->name);
+                logerr(errno,"Disabing tag output on interface id %llx (%s)",
+                        (unsigned long long) ifa->id,ifa->name);
                 ifa->tagflags=0;
         } else {
             cnt=2;
@@ -421,15 +674,15 @@ void write_tcp(struct iface *ifa)
         if ((sptr = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
+        if (senfilter(sptr,ifa->ofilter,ifa)) {
             senblk_free(sptr,ifa->q);
             continue;
         }
 
         if (ifa->tagflags)
             if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %x (%s)",
-                        ifa->id,ifa->name);
+                logerr(errno,"Disabing tag output on interface id %llx (%s)",
+                        (unsigned long long) ifa->id,ifa->name);
                 ifa->tagflags=0;
                 cnt=1;
                 data=0;
@@ -438,8 +691,13 @@ void write_tcp(struct iface *ifa)
         /* SIGPIPE is blocked here so we can avoid using the (non-portable)
          * MSG_NOSIGNAL
          */
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        if (frame) {
+            iov[0].iov_base=frame;
+            iov[0].iov_len=kproto_batch(ifa,sptr,frame,KPMAXFRAME,&seq);
+        } else {
+            iov[data].iov_base=senblk_out(sptr);
+            iov[data].iov_len=senblk_outlen(sptr);
+        }
         if (flag_test(ifa,F_PERSIST)) {
             pthread_mutex_lock(&ift->shared->t_mutex);
             if (ift->fd == -1)
@@ -453,7 +711,8 @@ void write_tcp(struct iface *ifa)
             }
         }
         if (writev(ift->fd,iov,cnt) <0) {
-            DEBUG2(3,"%s id %x: write failed",ifa->name,ifa->id);
+            DEBUG2(3,"%s id %llx: write failed",ifa->name,
+                    (unsigned long long) ifa->id);
             err=errno;
             if (!flag_test(ifa,F_PERSIST)) {
                 senblk_free(sptr,ifa->q);
@@ -494,6 +753,8 @@ void write_tcp(struct iface *ifa)
 
     if (cnt == 2)
         free(iov[0].iov_base);
+    if (frame)
+        free(frame);
 
     iface_thread_exit(errno);
 }
@@ -502,8 +763,9 @@ void delayed_connect(iface_t *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *) ifa->info;
     struct if_tcp *iftp;
-    struct addrinfo hints,*abase,*aptr;
-    int err;
+    struct addrinfo hints,*abase;
+    struct addrinfo *addrs[TCPMAXADDRS];
+    int err,i;
     int on=1;
 
     memset((void *)&hints,0,sizeof(hints));
@@ -522,18 +784,13 @@ void delayed_connect(iface_t *ifa)
             abase=NULL;
         }
 
-        for (aptr=abase;aptr;aptr=aptr->ai_next) {
-            if ((ift->fd=socket(aptr->ai_family,aptr->ai_socktype,aptr->ai_protocol)) < 0)
-                continue;
-            if (connect(ift->fd,aptr->ai_addr,aptr->ai_addrlen) == 0)
-                break;
-            close(ift->fd);
-        }
-        if (aptr) {
-            ift->shared->sa_len=aptr->ai_addrlen;
-            (void) memcpy(&ift->shared->sa,aptr->ai_addr,aptr->ai_addrlen);
-            ift->shared->protocol=aptr->ai_protocol;
-            freeaddrinfo(abase);
+        if ((ift->fd=stagger_connect(addrs,order_addrs(NULL,abase,addrs),
+                ift->shared->stagger,&i)) >= 0) {
+            ift->shared->sa_len=addrs[i]->ai_addrlen;
+            (void) memcpy(&ift->shared->sa,addrs[i]->ai_addr,
+                    addrs[i]->ai_addrlen);
+            ift->shared->protocol=addrs[i]->ai_protocol;
+            ift->shared->abase=abase;
             free(ift->shared->host);
             free(ift->shared->port);
             ift->shared->host=ift->shared->port=NULL;
@@ -555,6 +812,8 @@ void delayed_connect(iface_t *ifa)
 
         } else {
             DEBUG(4,"%s: Delayed connect failed (sleeping)",ifa->name);
+            if (abase)
+                freeaddrinfo(abase);
             mysleep(ift->shared->retry);
         }
     }
@@ -562,12 +821,312 @@ void delayed_connect(iface_t *ifa)
     pthread_mutex_unlock(&ift->shared->t_mutex);
 
     if (ifa->direction == IN)
-        do_read(ifa);
+        (flag_test(ifa,F_KPLEX)?read_kplex:do_read)(ifa);
     else {
         write_tcp(ifa);
     }
 }
 
+/*
+ * Start connecting to one of the servers of a client with standby servers
+ * Args: Interface pointer, server
+ * Returns: Nothing
+ * Side effects: A non-blocking connect is started on ep->fd, or if that
+ * fails (or the server's address isn't known yet) another attempt is
+ * scheduled "retry" seconds later
+ */
+static void ep_connect(iface_t *ifa, struct tcp_endpoint *ep)
+{
+    struct if_tcp *ift = (struct if_tcp *) ifa->info;
+    int fflags;
+
+    ep->due=msclock()+(int64_t) ift->shared->retry*1000;
+    (void) resolver_get(ep->res,&ep->sa,&ep->sa_len,&ep->protocol,&ep->resgen);
+    if (ep->sa_len == 0) {
+        resolver_kick(ep->res);
+        return;
+    }
+
+    if ((ep->fd=socket(ep->sa.ss_family,SOCK_STREAM,ep->protocol)) < 0) {
+        logerr(errno,"Failed to create socket");
+        return;
+    }
+    if ((fflags=fcntl(ep->fd,F_GETFL)) < 0 ||
+            fcntl(ep->fd,F_SETFL,fflags | O_NONBLOCK) < 0 ||
+            (connect(ep->fd,(const struct sockaddr *) &ep->sa,ep->sa_len) < 0
+            && errno != EINPROGRESS)) {
+        DEBUG(7,"%s: Connection to %s/%s failed: %s",ifa->name,ep->host,
+                ep->port,strerror(errno));
+        close(ep->fd);
+        ep->fd=-1;
+        resolver_kick(ep->res);
+        return;
+    }
+    ep->connecting=1;
+}
+
+/*
+ * Close the connection to one of the servers of a client with standby
+ * servers
+ * Args: Interface pointer, server, error
+ * Returns: Nothing
+ * Side effects: Reconnection is scheduled "retry" seconds later
+ */
+static void ep_drop(iface_t *ifa, struct tcp_endpoint *ep, int err)
+{
+    struct if_tcp *ift = (struct if_tcp *) ifa->info;
+
+    if (ep->connecting) {
+        DEBUG(4,"%s: Failed to connect to %s/%s: %s",ifa->name,ep->host,
+                ep->port,strerror(err));
+    } else {
+        DEBUG(3,"%s: Lost connection to %s/%s: %s",ifa->name,ep->host,
+                ep->port,err?strerror(err):"EOF");
+    }
+    close(ep->fd);
+    ep->fd=-1;
+    ep->connecting=0;
+    ep->last=0;
+    ep->due=msclock()+(int64_t) ift->shared->retry*1000;
+    resolver_kick(ep->res);
+}
+
+/*
+ * Complete a connection to one of the servers of a client with standby
+ * servers
+ * Args: Interface pointer, server
+ * Returns: Nothing
+ */
+static void ep_connected(iface_t *ifa, struct tcp_endpoint *ep)
+{
+    struct if_tcp *ift = (struct if_tcp *) ifa->info;
+    socklen_t len=sizeof(int);
+    int err;
+
+    if (getsockopt(ep->fd,SOL_SOCKET,SO_ERROR,&err,&len) < 0)
+        err=errno;
+    if (err) {
+        ep_drop(ifa,ep,err);
+        return;
+    }
+
+    ep->connecting=0;
+    init_rdstate(ifa,&ep->rs);
+    ep->rs.hold=1;
+    DEBUG(3,"%s: Connected to %s/%s",ifa->name,ep->host,ep->port);
+
+    /* Keepalive and preamble routines work on the interface's descriptor */
+    ift->fd=ep->fd;
+    (void) establish_keepalive(ift);
+    if (ift->shared->preamble)
+        do_preamble(ift,NULL);
+    ift->fd=-1;
+}
+
+/*
+ * Choose which server of a client with standby servers to pass on sentences
+ * from: the first in order of preference which has sent one within the
+ * last "stale" milliseconds.  If none has, the current choice is kept
+ * Args: Interface pointer, current time from msclock()
+ * Returns: Nothing
+ */
+static void choose_active(iface_t *ifa, int64_t now)
+{
+    struct tcp_multi *m = ((struct if_tcp *) ifa->info)->multi;
+    struct tcp_endpoint *ep;
+    int i;
+
+    for (i=0;i<m->n;i++) {
+        ep=&m->ep[i];
+        if (ep->fd >= 0 && ep->last && now - ep->last <= m->stale)
+            break;
+    }
+    if (i == m->n || i == m->active)
+        return;
+
+    if (m->active < 0) {
+        DEBUG(3,"%s: Reading from %s/%s",ifa->name,m->ep[i].host,
+                m->ep[i].port);
+    } else {
+        ep=&m->ep[m->active];
+        DEBUG(3,"%s: Switching from %s/%s (%s) to %s/%s",ifa->name,
+                ep->host,ep->port,(ep->fd < 0)?"disconnected":
+                (ep->last && now - ep->last > m->stale)?"stale":"less preferred",
+                m->ep[i].host,m->ep[i].port);
+    }
+    m->active=i;
+}
+
+/*
+ * Read routine for clients with standby servers.  Used in place of do_read()
+ * All the servers are kept connected and read from but sentences are only
+ * passed on from the one choose_active() picks
+ * Args: Interface pointer
+ * Returns: Nothing
+ */
+static void read_multi(iface_t *ifa)
+{
+    struct tcp_multi *m = ((struct if_tcp *) ifa->info)->multi;
+    struct tcp_endpoint *ep;
+    struct pollfd pfd[TCPMAXENDPOINTS];
+    int idx[TCPMAXENDPOINTS];
+    char buf[BUFSIZ];
+    ssize_t nread,pos;
+    int64_t now,wake;
+    int i,n;
+
+    for (;;) {
+        now=msclock();
+        for (wake=-1,n=0,i=0;i<m->n;i++) {
+            ep=&m->ep[i];
+            if (ep->fd < 0 && now >= ep->due)
+                ep_connect(ifa,ep);
+            if (ep->fd < 0) {
+                if (wake < 0 || ep->due < wake)
+                    wake=ep->due;
+                continue;
+            }
+            pfd[n].fd=ep->fd;
+            pfd[n].events=ep->connecting?POLLOUT:POLLIN;
+            idx[n++]=i;
+        }
+
+        if (poll(pfd,n,(wake < 0)?-1:(int) (wake-now)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i=0;i<n;i++) {
+            if (pfd[i].revents == 0)
+                continue;
+            ep=&m->ep[idx[i]];
+            if (ep->connecting) {
+                ep_connected(ifa,ep);
+                continue;
+            }
+            if ((nread=read(ep->fd,buf,BUFSIZ)) <= 0) {
+                if (nread < 0 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                ep_drop(ifa,ep,(nread < 0)?errno:0);
+                continue;
+            }
+            ep->rs.sblk.ts=mstime();
+            for (pos=0;pos<nread;) {
+                pos+=parse_input(ifa,&ep->rs,buf+pos,nread-pos);
+                if (!ep->rs.ready)
+                    continue;
+                ep->rs.ready=0;
+                ep->last=msclock();
+                if (idx[i] != m->active)
+                    choose_active(ifa,ep->last);
+                if (idx[i] == m->active &&
+                        senfilter(&ep->rs.sblk,ifa->ifilter,ifa) == 0)
+                    publish(&ep->rs.sblk,ifa);
+            }
+        }
+    }
+    iface_thread_exit(errno);
+}
+
+/*
+ * Set up a client with standby servers
+ * Args: Interface pointer, tcp interface info, address and port of the
+ * preferred server, its address if connected to it, standby servers
+ * ("<address>[/<port>]"), number of standby servers, "stale" time (ms),
+ * "resolve" interval (s, 0 for default)
+ * Returns: Pointer to new tcp_multi or NULL on error
+ */
+static struct tcp_multi *init_multi(iface_t *ifa, struct if_tcp *ift,
+        char *host, char *port, struct addrinfo *connection, char **standby,
+        int nstandby, long stale, long resolve)
+{
+    struct tcp_multi *m;
+    struct tcp_endpoint *ep;
+    struct addrinfo hints,*abase,*aptr;
+    char *ptr;
+    int i,err;
+
+    if ((m=(struct tcp_multi *) malloc(sizeof(struct tcp_multi))) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return(NULL);
+    }
+    memset(m,0,sizeof(struct tcp_multi));
+    m->active=-1;
+    m->stale=stale;
+
+    memset((void *)&hints,0,sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+
+    for (i=0;i<=nstandby;i++,m->n++) {
+        ep=&m->ep[i];
+        ep->fd=-1;
+        if (i == 0) {
+            ep->host=strdup(host);
+            ep->port=strdup(port);
+        } else if ((ep->host=strdup(standby[i-1])) != NULL) {
+            if ((ptr=strchr(ep->host,'/')) != NULL)
+                *ptr++='\0';
+            ep->port=strdup((ptr && *ptr)?ptr:port);
+        }
+        if (ep->host == NULL || ep->port == NULL) {
+            logerr(errno,"Could not allocate memory");
+            m->n++;
+            break;
+        }
+
+        aptr=NULL;
+        abase=NULL;
+        if (i == 0) {
+            aptr=connection;
+        } else if ((err=getaddrinfo(ep->host,ep->port,&hints,&abase))) {
+            if (err != EAI_AGAIN && err != EAI_FAIL) {
+                logerr(0,"Lookup failed for host %s/service %s: %s",ep->host,
+                        ep->port,gai_strerror(err));
+                m->n++;
+                break;
+            }
+        } else
+            aptr=abase;
+
+        if (aptr) {
+            ep->sa_len=aptr->ai_addrlen;
+            (void) memcpy(&ep->sa,aptr->ai_addr,aptr->ai_addrlen);
+            ep->protocol=aptr->ai_protocol;
+            ep->resgen=1;
+        }
+        ep->res=resolver_add(ep->host,ep->port,AF_UNSPEC,SOCK_STREAM,
+                (time_t) (resolve?resolve:DEFEPRESOLVE),
+                aptr?aptr->ai_addr:NULL,aptr?aptr->ai_addrlen:0,
+                aptr?aptr->ai_protocol:0);
+        if (abase)
+            freeaddrinfo(abase);
+        if (ep->res == NULL) {
+            m->n++;
+            break;
+        }
+
+        if (i == 0 && connection) {
+            ep->fd=ift->fd;
+            init_rdstate(ifa,&ep->rs);
+            ep->rs.hold=1;
+        }
+    }
+
+    if (i <= nstandby) {
+        for (i=0;i<m->n;i++) {
+            if (m->ep[i].res)
+                resolver_free(m->ep[i].res);
+            free(m->ep[i].host);
+            free(m->ep[i].port);
+        }
+        free(m);
+        return(NULL);
+    }
+    return(m);
+}
+
 iface_t *new_tcp_conn(int fd, iface_t *ifa)
 {
     iface_t *newifa;
@@ -581,6 +1140,7 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
         return(NULL);
 
     memset(newifa,0,sizeof(iface_t));
+    newifa->decimation=ifa->decimation;
 
     if (((newift = (struct if_tcp *) malloc(sizeof(struct if_tcp))) == NULL) ||
             ((ifa->direction != IN) &&
@@ -596,15 +1156,18 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
 
     newift->fd=fd;
     newift->shared=NULL;
-    newifa->id=ifa->id+(fd&IDMINORMASK);
+    newift->multi=NULL;
+    newifa->id=new_connid(ifa);
     newifa->direction=ifa->direction;
     newifa->type=TCP;
     newifa->name=ifa->name;
     newifa->info=newift;
     newifa->cleanup=cleanup_tcp;
     newifa->write=write_tcp;
-    newifa->read=do_read;
+    newifa->read=flag_test(ifa,F_KPLEX)?read_kplex:do_read;
     newifa->tagflags=ifa->tagflags;
+    newifa->buses=ifa->buses;
+    newifa->format=ifa->format;
     newifa->flags=ifa->flags;
     newifa->readbuf=read_tcp;
     newifa->lists=ifa->lists;
@@ -613,7 +1176,7 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
     newifa->checksum=ifa->checksum;
     newifa->strict=ifa->strict;
     if (ifa->direction == IN)
-        newifa->q=ifa->lists->engine->q;
+        newifa->q=bus_queue(ifa);
     else {
         if (setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) < 0)
             logerr(errno,"Could not disable Nagle on new tcp connection");
@@ -628,7 +1191,7 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
             }
             newifa->direction=OUT;
             newifa->pair->direction=IN;
-            newifa->pair->q=ifa->lists->engine->q;
+            newifa->pair->q=bus_queue(ifa);
             sigemptyset(&set);
             sigaddset(&set, SIGUSR1);
             pthread_sigmask(SIG_BLOCK, &set, &saved);
@@ -656,7 +1219,7 @@ void tcp_server(iface_t *ifa)
     char addrs[INET6_ADDRSTRLEN];
 
 
-    if (listen(ift->fd,5) == 0) {
+    if (listen(ift->fd,SOMAXCONN) == 0) {
         while(ifa->direction != NONE) {
             slen = sizeof(struct sockaddr_storage);
             if ((afd = accept(ift->fd,(struct sockaddr *) &sad,&slen)) < 0)
@@ -666,8 +1229,8 @@ void tcp_server(iface_t *ifa)
                 close(afd);
                 afd=-1;
             }
-            DEBUG(3,"%s: New connection id %x %ssuccessfully received from %s",
-                    ifa->name,newifa->id,(afd<0)?"un":"",
+            DEBUG(3,"%s: New connection id %llx %ssuccessfully received from %s",
+                    ifa->name,(unsigned long long) newifa->id,(afd<0)?"un":"",
                     inet_ntop(sad.ss_family,(sad.ss_family == AF_INET)?
                     (const void *) &((struct sockaddr_in *)&sad)->sin_addr:
                     (const void *) &((struct sockaddr_in6 *)&sad)->sin6_addr,
@@ -803,8 +1366,18 @@ iface_t *init_tcp(iface_t *ifa)
     unsigned keepcnt=0;
     unsigned sndbuf=DEFSNDBUF;
     int nodelay=1;
+    int resume=0;
+    char *spillfile=NULL;
+    off_t spillsize=DEFSPILLSIZE;
+    int spillrate=0;
     long timeout=-1;
+    long resolve=0;
+    long stagger=-1;
+    long stale=-1;
+    char *standby[TCPMAXENDPOINTS];
+    int nstandby=0;
     int gpsd=0;
+    struct addrinfo *addrs[TCPMAXADDRS];
 
     host=port=NULL;
 
@@ -815,6 +1388,7 @@ iface_t *init_tcp(iface_t *ifa)
 
     ift->qsize=DEFTCPQSIZE;
     ift->shared=NULL;
+    ift->multi=NULL;
     preamble=NULL;
 
     for(opt=ifa->options;opt;opt=opt->next) {
@@ -901,6 +1475,19 @@ iface_t *init_tcp(iface_t *ifa)
                 logerr(0,"Invalid sndbuf size value specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"proto")) {
+            if (!strcasecmp(opt->val,"nmea")) {
+                flag_clear(ifa,F_KPLEX);
+            } else if (!strcasecmp(opt->val,"kplex")) {
+                flag_set(ifa,F_KPLEX);
+            } else if (!strcasecmp(opt->val,"gpsd")) {
+                gpsd=1;
+                if (!port)
+                    port="2947";
+            } else {
+                logerr(0,"Invalid option \"proto=%s\"",opt->val);
+                return(NULL);
+            }
         } else if (!strcasecmp(opt->var,"gpsd")) {
             if (!strcasecmp(opt->val,"yes")) {
                 gpsd=1;
@@ -921,6 +1508,66 @@ iface_t *init_tcp(iface_t *ifa)
                 logerr(0,"Could not parse preamble %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"subscribe")) {
+            if (!strcasecmp(opt->val,"yes")) {
+                flag_set(ifa,F_SUBSCRIBE);
+            } else if (!strcasecmp(opt->val,"no")) {
+                flag_clear(ifa,F_SUBSCRIBE);
+            } else {
+                logerr(0,"Invalid option \"subscribe=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"resume")) {
+            if (!strcasecmp(opt->val,"yes")) {
+                resume=1;
+            } else if (!strcasecmp(opt->val,"no")) {
+                resume=0;
+            } else {
+                logerr(0,"Invalid option \"resume=%s\"",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"spill")) {
+            spillfile=opt->val;
+        } else if (!strcasecmp(opt->var,"spillsize")) {
+            errno=0;
+            if ((spillsize=(off_t) strtoll(opt->val,&eptr,0)) <= 0 || errno ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid spillsize %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"spillrate")) {
+            if ((spillrate=atoi(opt->val)) <= 0 || spillrate > 1000) {
+                logerr(0,"Invalid spillrate %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"resolve")) {
+            errno=0;
+            if ((resolve=strtol(opt->val,&eptr,0)) <= 0 || errno ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid resolve interval %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"standby")) {
+            if (nstandby == TCPMAXENDPOINTS-1) {
+                logerr(0,"No more than %d standby servers may be given",
+                        TCPMAXENDPOINTS-1);
+                return(NULL);
+            }
+            standby[nstandby++]=opt->val;
+        } else if (!strcasecmp(opt->var,"stale")) {
+            errno=0;
+            if ((stale=strtol(opt->val,&eptr,0)) <= 0 || errno ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid stale value %s",opt->val);
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"stagger")) {
+            errno=0;
+            if ((stagger=strtol(opt->val,&eptr,0)) < 0 || errno ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid stagger value %s",opt->val);
+                return(NULL);
+            }
         } else if (!strcasecmp(opt->var,"nodelay")) {
             if (!strcasecmp(opt->val,"no")) {
                 nodelay=0;
@@ -952,11 +1599,69 @@ iface_t *init_tcp(iface_t *ifa)
             timeout=DEFSNDTIMEO;
     }
 
+    if (flag_test(ifa,F_KPLEX)) {
+        if (gpsd || preamble) {
+            logerr(0,"gpsd and preamble options can't be used with proto=kplex");
+            return(NULL);
+        }
+        if (ifa->format != FMT_NMEA) {
+            logerr(0,"format option can't be used with proto=kplex");
+            return(NULL);
+        }
+        if (ifa->tagflags) {
+            logwarn("%s: TAG blocks not sent with proto=kplex",ifa->name);
+            ifa->tagflags=0;
+        }
+    }
+
     if (*conntype == 'c') {
         if (!host) {
             logerr(0,"Must specify address for tcp client mode\n");
             return(NULL);
         }
+        if (flag_test(ifa,F_SUBSCRIBE)) {
+            logerr(0,"subscribe option only valid for servers");
+            return(NULL);
+        }
+        if (resume && !flag_test(ifa,F_PERSIST)) {
+            logerr(0,"resume option requires persist option");
+            return(NULL);
+        }
+        if (resume && ifa->direction == OUT) {
+            logerr(0,"resume option not valid for output only clients");
+            return(NULL);
+        }
+        if (resolve && !flag_test(ifa,F_PERSIST)) {
+            logerr(0,"resolve option requires persist option");
+            return(NULL);
+        }
+        if (stagger < 0)
+            stagger=DEFSTAGGER;
+        if (nstandby) {
+            if (!flag_test(ifa,F_PERSIST) || ifa->direction != IN) {
+                logerr(0,"standby option requires persist option and direction=in");
+                return(NULL);
+            }
+            if (flag_test(ifa,F_KPLEX) || resume) {
+                logerr(0,"standby option can't be used with proto=kplex or resume");
+                return(NULL);
+            }
+            if (stale < 0)
+                stale=DEFSTALE;
+        } else if (stale > 0) {
+            logerr(0,"stale option requires standby option");
+            return(NULL);
+        }
+        if (spillfile) {
+            if (!flag_test(ifa,F_PERSIST) || ifa->direction == IN) {
+                logerr(0,"spill option requires persist option and output");
+                return(NULL);
+            }
+            if (ifa->format != FMT_NMEA) {
+                logerr(0,"spill option can't be used with format option");
+                return(NULL);
+            }
+        }
         if (gpsd) {
             if (preamble) {
                 logerr(0,"Can't specify preamble with proto=gpsd");
@@ -981,13 +1686,27 @@ iface_t *init_tcp(iface_t *ifa)
             logerr(0,"proto=gpsd not valid for servers");
             return(NULL);
         }
+
+        if (resume || spillfile || resolve || stagger >= 0 || nstandby ||
+                stale > 0) {
+            logerr(0,"resume, spill, resolve, stagger, standby and stale options not valid for servers");
+            return(NULL);
+        }
+
+        if (flag_test(ifa,F_SUBSCRIBE) && ifa->direction != BOTH) {
+            logerr(0,"subscribe option requires direction=both");
+            return(NULL);
+        }
     }
 
     if (!port) {
+        /* getservbyname() isn't thread safe */
+        pthread_mutex_lock(&ifa->lists->init_mutex);
         if ((svent=getservbyname("nmea-0183","tcp")) != NULL)
-            port=svent->s_name;
+            port="nmea-0183";
         else
             port = DEFPORTSTRING;
+        pthread_mutex_unlock(&ifa->lists->init_mutex);
     }
 
     memset((void *)&hints,0,sizeof(hints));
@@ -1005,13 +1724,17 @@ iface_t *init_tcp(iface_t *ifa)
         }
     }
 
-    for (connection=abase;connection;connection=connection->ai_next) {
-        if ((ift->fd=socket(connection->ai_family,connection->ai_socktype,connection->ai_protocol)) < 0)
-            continue;
-        if (*conntype == 'c') {
-            if (connect(ift->fd,connection->ai_addr,connection->ai_addrlen) == 0)
-                break;
-        } else {
+    if (*conntype == 'c') {
+        if ((ift->fd=stagger_connect(addrs,order_addrs(NULL,abase,addrs),
+                stagger,&i)) < 0) {
+            err=errno;
+            connection=NULL;
+        } else
+            connection=addrs[i];
+    } else {
+        for (connection=abase;connection;connection=connection->ai_next) {
+            if ((ift->fd=socket(connection->ai_family,connection->ai_socktype,connection->ai_protocol)) < 0)
+                continue;
             setsockopt(ift->fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
             if (connection->ai_family == AF_INET6) {
                 for (ptr=((struct sockaddr_in6 *)connection->ai_addr)->sin6_addr.s6_addr,i=0;i<16;i++,ptr++)
@@ -1027,9 +1750,9 @@ iface_t *init_tcp(iface_t *ifa)
             if (bind(ift->fd,connection->ai_addr,connection->ai_addrlen) == 0)
                 break;
             err=errno;
+            close(ift->fd);
         }
-        close(ift->fd);
-     }
+    }
 
     if (connection == NULL && (!flag_test(ifa,F_IPERSIST))) {
         logerr(err,"Failed to open tcp %s for %s/%s",(*conntype == 's')?"server":"connection",host,port);
@@ -1069,6 +1792,19 @@ iface_t *init_tcp(iface_t *ifa)
             DEBUG(3,"%s: Initial connection to %s port %s failed",ifa->name,
                     host,port);
         }
+        ift->shared->abase=NULL;
+        ift->shared->stagger=stagger;
+        ift->shared->res=NULL;
+        ift->shared->resgen=0;
+        if (resolve && !nstandby) {
+            if ((ift->shared->res=resolver_add(host,port,AF_UNSPEC,SOCK_STREAM,
+                    (time_t) resolve,connection?connection->ai_addr:NULL,
+                    connection?connection->ai_addrlen:0,
+                    connection?connection->ai_protocol:0)) == NULL)
+                return(NULL);
+            if (connection)
+                ift->shared->resgen=1;
+        }
         ift->shared->donewith=1;
         ift->shared->critical=0;
         ift->shared->fixing=0;
@@ -1080,10 +1816,21 @@ iface_t *init_tcp(iface_t *ifa)
         ift->shared->tv.tv_sec=timeout;
         ift->shared->tv.tv_usec=0;
         ift->shared->nodelay=nodelay;
+        ift->shared->resume=resume;
         ift->shared->preamble=preamble;
     }
 
-    freeaddrinfo(abase);
+    if (nstandby && (ift->multi=init_multi(ifa,ift,host,port,connection,
+            standby,nstandby,stale,resolve)) == NULL) {
+        freeaddrinfo(abase);
+        return(NULL);
+    }
+
+    /* Persistent clients keep all the server's addresses for reconnecting */
+    if (ift->shared && connection && *conntype == 'c' && !nstandby)
+        ift->shared->abase=abase;
+    else
+        freeaddrinfo(abase);
 
     if (flag_test(ifa,F_PERSIST) && (connection)) {
         (void) establish_keepalive(ift);    
@@ -1095,6 +1842,10 @@ iface_t *init_tcp(iface_t *ifa)
             logerr(errno,"Interface duplication failed");
             return(NULL);
         }
+        if (spillfile && init_spill(ifa->q,spillfile,spillsize,spillrate) < 0) {
+            logerr(errno,"Could not open spill file %s",spillfile);
+            return(NULL);
+        }
         /* Disable Nagle. Not fatal if we fail for any reason */
         if (connection) {
             if (nodelay && (setsockopt(ift->fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) < 0))
@@ -1113,12 +1864,17 @@ iface_t *init_tcp(iface_t *ifa)
                     free(preamble);
                 }
             }
-            ifa->read=do_read;
+            ifa->read=flag_test(ifa,F_KPLEX)?read_kplex:do_read;
             ifa->write=write_tcp;
         } else {
             ifa->read=delayed_connect;
             ifa->write=delayed_connect;
         }
+        if (ift->multi) {
+            /* read_multi() manages the servers' connections */
+            ifa->read=read_multi;
+            ift->fd=-1;
+        }
         ifa->readbuf=read_tcp;
         if (ifa->direction == BOTH) {
             if ((ifa->next=ifdup(ifa)) == NULL) {
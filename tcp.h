@@ -11,6 +11,12 @@
 #define DEFKEEPINTVL 10
 #define DEFKEEPCNT 3
 #define MAXPREAMBLE 1024
+#define DEFSPILLSIZE 67108864
+#define DEFSTAGGER 250
+#define TCPMAXADDRS 16
+#define TCPMAXENDPOINTS 8
+#define DEFSTALE 2000
+#define DEFEPRESOLVE 300
 
 struct tcp_preamble {
     unsigned char * string;
@@ -21,6 +27,31 @@ struct if_tcp {
     int fd;
     size_t qsize;
     struct if_tcp_shared *shared;
+    struct tcp_multi *multi;
+};
+
+/* A server a client with standby servers reads from */
+struct tcp_endpoint {
+    char *host;
+    char *port;
+    struct resolver *res;
+    unsigned long resgen;
+    socklen_t sa_len;
+    struct sockaddr_storage sa;
+    int protocol;
+    int fd;
+    int connecting;
+    int64_t due;
+    int64_t last;
+    struct rdstate rs;
+};
+
+/* Servers in order of preference: ep[0] is the one given by "address" */
+struct tcp_multi {
+    int n;
+    int active;
+    long stale;
+    struct tcp_endpoint ep[TCPMAXENDPOINTS];
 };
 
 struct if_tcp_shared {
@@ -29,6 +60,10 @@ struct if_tcp_shared {
     time_t retry;
     socklen_t sa_len;
     struct sockaddr_storage sa;
+    struct addrinfo *abase;
+    long stagger;
+    struct resolver *res;
+    unsigned long resgen;
     int donewith;
     int protocol;
     int keepalive;
@@ -37,6 +72,7 @@ struct if_tcp_shared {
     unsigned keepcnt;
     unsigned sndbuf;
     int nodelay;
+    int resume;
     int critical;
     int fixing;
     pthread_mutex_t t_mutex;
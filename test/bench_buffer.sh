@@ -0,0 +1,85 @@
+#!/bin/sh
+# bench_buffer.sh
+# This file is part of kplex
+# Copyright Keith Young 2012-2016
+# For copying information see the file COPYING distributed with this software
+#
+# Benchmark of file output with and without the "buffer" option.
+# Usage: test/bench_buffer.sh [sentences] [buffer size]
+#
+# The same sentences are sent through kplex from a FIFO to a file, once
+# unbuffered and once with buffer=<buffer size>.  Queues are made large
+# enough that nothing is dropped, and a run only counts once the output file
+# holds every sentence.  For each run the time taken, sentences per second,
+# the number of write system calls kplex made and the average bytes per write
+# are reported (from /proc/<pid>/io, so Linux only).  The buffered time
+# includes waiting up to one flush interval for the last partly filled buffer.
+# Only the writes kplex makes are counted: the storage device's own write
+# amplification is not measured.
+
+N=${1:-1000000}
+BUF=${2:-65536}
+KPLEX=${KPLEX:-./kplex}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/kplexbench.XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+if [ ! -r /proc/self/io ]; then
+    echo "bench_buffer.sh: /proc/<pid>/io is needed" >&2
+    exit 1
+fi
+
+# Checksums aren't checked on input, so they needn't be right
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i++)
+        printf("$GPRMC,%09d,A,5130.0000,N,00007.0000,W,0.0,0.0,010116,,*00\n", i)
+}' > "$DIR/in.txt"
+BYTES=$(wc -c < "$DIR/in.txt")
+
+# run <label> [extra output options]
+run() {
+    label=$1
+    shift
+    rm -f "$DIR/out.txt" "$DIR/fifo"
+    mkfifo "$DIR/fifo"
+    "$KPLEX" -f- -o qsize="$N" \
+        "file:filename=$DIR/fifo,direction=in,checksum=no" \
+        "file:filename=$DIR/out.txt,direction=out,qsize=$N$*" &
+    pid=$!
+    # Sentences read before the output has started are lost, so wait for it
+    # to open its file and get going
+    while [ ! -e "$DIR/out.txt" ]; do
+        sleep 0.05
+    done
+    sleep 0.5
+    start=$(date +%s.%N)
+    # Hold the FIFO open so kplex doesn't see the end of its input
+    (cat "$DIR/in.txt"; exec sleep 600) > "$DIR/fifo" &
+    feeder=$!
+    while [ "$(wc -l < "$DIR/out.txt")" -lt "$N" ]; do
+        if ! kill -0 $pid 2>/dev/null; then
+            echo "$label: kplex exited early" >&2
+            kill $feeder 2>/dev/null
+            return 1
+        fi
+        sleep 0.05
+    done
+    end=$(date +%s.%N)
+    syscw=$(awk '/^syscw:/ { print $2 }' /proc/$pid/io)
+    kill $pid
+    wait $pid 2>/dev/null
+    kill $feeder 2>/dev/null
+    wait $feeder 2>/dev/null
+    if ! cmp -s "$DIR/in.txt" "$DIR/out.txt"; then
+        echo "$label: output differs from input" >&2
+        return 1
+    fi
+    awk -v l="$label" -v s="$start" -v e="$end" -v n="$N" -v w="$syscw" \
+            -v b="$BYTES" 'BEGIN {
+        t = e - s
+        printf("%-16s %8d sentences %7.2fs %9.0f sentences/s %8d writes %8.0f bytes/write\n",
+                l, n, t, n / t, w, b / w)
+    }'
+}
+
+run unbuffered || exit 1
+run "buffer=$BUF" ",buffer=$BUF" || exit 1
@@ -0,0 +1,184 @@
+/* stagger_connect.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Test of connecting to the first of several server addresses to answer
+ * (tcp.c stagger_connect()).  tcp.c is included so that its static functions
+ * can be called, and the test is linked with kplex's other objects ("make
+ * check").
+ *
+ * An address which never answers is made by filling the accept queue of a
+ * listening socket which is never accepted from: further SYNs to it are
+ * dropped, so connections to it stay in progress as they would to a host
+ * which is down.
+ */
+
+#include "../tcp.c"
+
+/* Milliseconds between connection attempts */
+#define STAGGER 50
+/* Connections queued on the dead listener before it stops answering */
+#define FILLERS 4
+
+static int failures;
+
+#define CHECK(cond,...) do { \
+        if (!(cond)) { \
+            fprintf(stderr,"FAIL: " __VA_ARGS__); \
+            fprintf(stderr,"\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+/*
+ * Count open file descriptors
+ * Args: None
+ * Returns: Number of open descriptors
+ */
+static int count_fds(void)
+{
+    int fd,n=0;
+
+    for (fd=0;fd<1024;fd++)
+        if (fcntl(fd,F_GETFD) != -1)
+            n++;
+    return(n);
+}
+
+/*
+ * Make a listening socket on the loopback address
+ * Args: Backlog, address to fill in with the socket's address
+ * Returns: Socket or -1 on failure
+ */
+static int listener(int backlog, struct sockaddr_in *sa)
+{
+    socklen_t len=sizeof(*sa);
+    int fd;
+
+    memset(sa,0,sizeof(*sa));
+    sa->sin_family=AF_INET;
+    sa->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    if ((fd=socket(AF_INET,SOCK_STREAM,0)) < 0 ||
+            bind(fd,(struct sockaddr *) sa,sizeof(*sa)) < 0 ||
+            listen(fd,backlog) < 0 ||
+            getsockname(fd,(struct sockaddr *) sa,&len) < 0) {
+        perror("listener");
+        exit(2);
+    }
+    return(fd);
+}
+
+/*
+ * Fill in an addrinfo for a loopback address
+ * Args: addrinfo to fill in, address
+ * Returns: Nothing
+ */
+static void set_addr(struct addrinfo *ai, struct sockaddr_in *sa)
+{
+    memset(ai,0,sizeof(*ai));
+    ai->ai_family=AF_INET;
+    ai->ai_socktype=SOCK_STREAM;
+    ai->ai_addrlen=sizeof(*sa);
+    ai->ai_addr=(struct sockaddr *) sa;
+}
+
+/*
+ * Check which listener a connected socket is connected to
+ * Args: Connected socket, listener's address
+ * Returns: 1 if connected to that address, 0 if not
+ */
+static int connected_to(int fd, struct sockaddr_in *sa)
+{
+    struct sockaddr_in peer;
+    socklen_t len=sizeof(peer);
+
+    if (getpeername(fd,(struct sockaddr *) &peer,&len) < 0)
+        return(0);
+    return(peer.sin_port == sa->sin_port);
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in dead,live,closed;
+    struct addrinfo ai[3];
+    struct addrinfo *addrs[3];
+    int dfd,lfd,cfd,fd,i,chosen,nfds;
+    int fillers[FILLERS];
+    int64_t start,took;
+
+    signal(SIGPIPE,SIG_IGN);
+
+    /* An address which never answers */
+    dfd=listener(0,&dead);
+    for (i=0;i<FILLERS;i++) {
+        if ((fillers[i]=socket(AF_INET,SOCK_STREAM,0)) < 0 ||
+                fcntl(fillers[i],F_SETFL,O_NONBLOCK) < 0) {
+            perror("filler");
+            exit(2);
+        }
+        (void) connect(fillers[i],(struct sockaddr *) &dead,sizeof(dead));
+    }
+    usleep(100000);
+
+    /* One which accepts, and one which refuses */
+    lfd=listener(5,&live);
+    cfd=listener(1,&closed);
+    close(cfd);
+
+    /* First address never answers, second accepts */
+    set_addr(&ai[0],&dead);
+    set_addr(&ai[1],&live);
+    addrs[0]=&ai[0];
+    addrs[1]=&ai[1];
+    nfds=count_fds();
+    chosen=-1;
+    start=msclock();
+    fd=stagger_connect(addrs,2,STAGGER,&chosen);
+    took=msclock()-start;
+    CHECK(fd >= 0,"no connection when second address accepts: %s",
+            strerror(errno));
+    CHECK(chosen == 1,"winning index %d, expected 1",chosen);
+    CHECK(fd < 0 || connected_to(fd,&live),"not connected to second address");
+    CHECK(took >= STAGGER,"second attempt started after %lldms, before "
+            "stagger of %dms",(long long) took,STAGGER);
+    CHECK(took < 1000,"took %lldms to connect",(long long) took);
+    CHECK(count_fds() == nfds+(fd >= 0),"%d descriptors left open, "
+            "expected %d: losing socket not closed",count_fds()-nfds,fd >= 0);
+    if (fd >= 0)
+        close(fd);
+
+    /* Without staggering, a refused first address falls back to the
+     * second */
+    set_addr(&ai[0],&closed);
+    nfds=count_fds();
+    chosen=-1;
+    fd=stagger_connect(addrs,2,0,&chosen);
+    CHECK(fd >= 0 && chosen == 1,"no fallback from refused address: fd %d "
+            "index %d",fd,chosen);
+    if (fd >= 0)
+        close(fd);
+    CHECK(count_fds() == nfds,"descriptor leaked after fallback");
+
+    /* When every address refuses, the error is reported and nothing is
+     * left open */
+    set_addr(&ai[1],&closed);
+    nfds=count_fds();
+    errno=0;
+    fd=stagger_connect(addrs,2,STAGGER,&chosen);
+    CHECK(fd < 0 && errno == ECONNREFUSED,"expected ECONNREFUSED, got fd %d "
+            "(%s)",fd,strerror(errno));
+    CHECK(count_fds() == nfds,"descriptor leaked when all addresses refuse");
+
+    for (i=0;i<FILLERS;i++)
+        close(fillers[i]);
+    close(dfd);
+    close(lfd);
+
+    if (failures) {
+        fprintf(stderr,"stagger_connect: %d check(s) failed\n",failures);
+        return(1);
+    }
+    printf("stagger_connect: all checks passed\n");
+    return(0);
+}
@@ -14,6 +14,8 @@
 
 #define DEFUDPQSIZE 64
 #define CBUFSIZ 128
+/* Keep kplex protocol datagrams within a typical MTU */
+#define KPUDPFRAME 1400
 
 static struct ignore_addr {
     struct sockaddr_in iaddr;
@@ -40,6 +42,8 @@ struct if_udp {
     } mr;
     struct ignore_addr *ignore;
     struct coalesce *coalesce;
+    struct resolver *res;
+    unsigned long resgen;
 };
 
 /*
@@ -59,8 +63,10 @@ void *ifdup_udp(void *ifa)
 
     (void) memcpy(newif, oldif, sizeof(struct if_udp));
 
-    /* In-bound connections don't need pointer to coalesce buffer */
+    /* In-bound connections don't need pointer to coalesce buffer or to
+     * follow the destination's address */
     newif->coalesce = NULL;
+    newif->res = NULL;
 
     /* Whole new file descriptor to bind() to.  Not an issue for Linux but
      * for some other platforms (e.g. OS X) we can't send with a multicast /
@@ -108,46 +114,13 @@ void cleanup_udp(iface_t *ifa)
     if (ifu->coalesce)
         free(ifu->coalesce);
 
+    if (ifu->res)
+        resolver_free(ifu->res);
+
     /* iomutex should be locked in the cleanup routine */
     close(ifu->fd);
 }
 
-int is_ais(char *sptr,size_t len,size_t *nfrag, size_t *frag, unsigned int *seq)
-{
-    int i;
-
-    if (len < 13)
-        return(0);
-
-    if (!(sptr[3] == 'V' && sptr[4] == 'D' &&
-            (sptr[5] == 'M' || sptr[5] == 'O')))
-        return(0);
-    sptr+=6;
-
-    if ((*sptr++) != ',')
-        return(0);
-
-    for (i=7,*nfrag=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
-        *nfrag = *nfrag*10+*sptr-'0';
-
-    if (*sptr++ != ',' || i > len)
-        return(0);
-
-    for (*frag=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
-        *frag = *frag*10+*sptr-'0';
-
-    if (*sptr++ != ',' || i > len)
-        return(0);
-
-    for (*seq=0;i <= len && *sptr >= '0' && *sptr <= '9';sptr++,i++)
-        *seq = *seq*10+*sptr-'0';
-
-    if (*sptr != ',' || i > len)
-        return(0);
-
-    return(1);
-}
-
 int coalesce(struct if_udp *ifu, struct msghdr * mh)
 {
     size_t nfrags,frag;
@@ -201,6 +174,8 @@ void write_udp(struct iface *ifa)
     int data=0;
     struct msghdr msgh;
     struct iovec iov[2];
+    unsigned char *frame=NULL;
+    uint64_t seq=0;
 
     ifu = (struct if_udp *) ifa->info;
     msgh.msg_name=(void *)&ifu->addr;
@@ -219,11 +194,18 @@ void write_udp(struct iface *ifa)
             data=1;
         }
     }
+
+    if (flag_test(ifa,F_KPLEX) &&
+            (frame=(unsigned char *) malloc(KPUDPFRAME)) == NULL) {
+        logerr(errno,"Could not allocate kplex protocol buffer");
+        iface_thread_exit(errno);
+    }
+
     for (;;) {
         if ((sptr = next_senblk(ifa->q)) == NULL)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
+        if (senfilter(sptr,ifa->ofilter,ifa)) {
             senblk_free(sptr,ifa->q);
             continue;
         }
@@ -237,16 +219,27 @@ void write_udp(struct iface *ifa)
                 free(iov[0].iov_base);
             }
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        if (frame) {
+            iov[0].iov_base=frame;
+            iov[0].iov_len=kproto_batch(ifa,sptr,frame,KPUDPFRAME,&seq);
+        } else {
+            iov[data].iov_base=senblk_out(sptr);
+            iov[data].iov_len=senblk_outlen(sptr);
+        }
 
-        if (ifu->coalesce) {
+        if (ifu->coalesce && !sptr->enc) {
             if (coalesce(ifu,&msgh)) {
                 senblk_free(sptr,ifa->q);
                 continue;
             }
         }
 
+        if (ifu->res && resolver_get(ifu->res,&ifu->addr,&ifu->asize,NULL,
+                &ifu->resgen)) {
+            msgh.msg_namelen=ifu->asize;
+            DEBUG(3,"%s: Destination address has changed",ifa->name);
+        }
+
         if (sendmsg(ifu->fd,&msgh,0) < 0)
             break;
         senblk_free(sptr,ifa->q);
@@ -254,6 +247,8 @@ void write_udp(struct iface *ifa)
 
     if (ifa->tagflags)
         free(iov[0].iov_base);
+    if (frame)
+        free(frame);
 
     iface_thread_exit(errno);
 }
@@ -333,6 +328,7 @@ struct iface *init_udp(struct iface *ifa)
     size_t qsize = DEFUDPQSIZE;
     struct kopts *opt;
     int coalesce=0;
+    long resolve=0;
     int ifindex,iffound=0;
     int linklocal=0;
     int on=1,off=0;
@@ -374,6 +370,15 @@ struct iface *init_udp(struct iface *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"proto")) {
+            if (!strcasecmp(opt->val,"nmea"))
+                flag_clear(ifa,F_KPLEX);
+            else if (!strcasecmp(opt->val,"kplex"))
+                flag_set(ifa,F_KPLEX);
+            else {
+                logerr(0,"Invalid option \"proto=%s\"",opt->val);
+                return(NULL);
+            }
         } else if (!strcasecmp(opt->var,"type")) {
             if (!strcasecmp(opt->val,"unicast"))
                 ifu->type = UDP_UNICAST;
@@ -385,15 +390,39 @@ struct iface *init_udp(struct iface *ifa)
                 logerr(0,"Invalid UDP mode \'%s\'",opt->val);
                 return(NULL);
             }
+        } else if (!strcasecmp(opt->var,"resolve")) {
+            errno=0;
+            if ((resolve=strtol(opt->val,&eptr,0)) <= 0 || errno ||
+                    *eptr != '\0') {
+                logerr(0,"Invalid resolve interval %s",opt->val);
+                return(NULL);
+            }
         } else  {
             logerr(0,"Unknown interface option %s",opt->var);
             return(NULL);
         }
     }
 
+    if (flag_test(ifa,F_KPLEX)) {
+        if (coalesce) {
+            logerr(0,"coalesce option can't be used with proto=kplex");
+            return(NULL);
+        }
+        if (ifa->format != FMT_NMEA) {
+            logerr(0,"format option can't be used with proto=kplex");
+            return(NULL);
+        }
+        if (ifa->tagflags) {
+            logwarn("%s: TAG blocks not sent with proto=kplex",ifa->name);
+            ifa->tagflags=0;
+        }
+    }
+
+    /* getservbyname() isn't thread safe */
+    pthread_mutex_lock(&ifa->lists->init_mutex);
     if (!service) {
         if ((svent = getservbyname("nmea-0183","udp")) != NULL) {
-            service=svent->s_name;
+            service="nmea-0183";
             port=svent->s_port;
         } else {
             service=DEFPORTSTRING;
@@ -407,6 +436,7 @@ struct iface *init_udp(struct iface *ifa)
                 port=DEFPORT;
         }
     }
+    pthread_mutex_unlock(&ifa->lists->init_mutex);
 
     if (address || ifa->direction == IN) {
         memset((void *)&hints,0,sizeof(hints));
@@ -782,8 +812,20 @@ struct iface *init_udp(struct iface *ifa)
             ((struct sockaddr_in6*)&ifu->addr)->sin6_port));
     }
 
+    if (resolve) {
+        if (ifu->type != UDP_UNICAST || !address || ifname ||
+                ifa->direction == IN) {
+            logerr(0,"resolve option requires a unicast output address and no device");
+            return(NULL);
+        }
+        if ((ifu->res=resolver_add(address,service,ifu->addr.ss_family,
+                SOCK_DGRAM,(time_t) resolve,sa,ifu->asize,IPPROTO_UDP)) == NULL)
+            return(NULL);
+        ifu->resgen=1;
+    }
+
     ifa->write=write_udp;
-    ifa->read=do_read;
+    ifa->read=flag_test(ifa,F_KPLEX)?read_kplex:do_read;
     ifa->readbuf=read_udp;
     ifa->cleanup=cleanup_udp;
     ifa->info = (void *) ifu;